@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include "arena.h"
+#include "smalloc.h"
+
+struct arena_block {
+	arena_block *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct arena_release_fn {
+	arena_release_fn *next;
+	destructor dest;
+	void *data;
+};
+
+// enough for any of the pointers and ints the allocations are made of
+#define ARENA_ALIGN sizeof(void *)
+
+arena *arena_create(void)
+{
+	arena *a = smalloc(sizeof(arena));
+	a->blocks = NULL;
+	a->on_release = NULL;
+	a->refs = 1;
+	return a;
+}
+
+/*
+ * Blocks double in size up to ARENA_MAX_BLOCK_BYTES, so a one line
+ * expression costs little and a big module takes few blocks.
+ */
+static arena_block *arena_add_block(arena *a, size_t size)
+{
+	size_t block_size = a->blocks ? a->blocks->size * 2 : ARENA_FIRST_BLOCK_BYTES;
+	if (block_size > ARENA_MAX_BLOCK_BYTES) {
+		block_size = ARENA_MAX_BLOCK_BYTES;
+	}
+	if (block_size < size) {
+		block_size = size;
+	}
+
+	arena_block *block = smalloc(sizeof(arena_block) + block_size);
+	block->size = block_size;
+	block->used = 0;
+	block->next = a->blocks;
+	a->blocks = block;
+	return block;
+}
+
+void *arena_alloc(arena *a, size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	arena_block *block = a->blocks;
+	if (block == NULL || block->size - block->used < size) {
+		block = arena_add_block(a, size);
+	}
+
+	void *p = block->data + block->used;
+	block->used += size;
+	return p;
+}
+
+/*
+ * dest is called with data and a NULL context when the arena is freed,
+ * most recently registered first.
+ */
+void arena_on_release(arena *a, destructor dest, void *data)
+{
+	arena_release_fn *fn = arena_alloc(a, sizeof(arena_release_fn));
+	fn->dest = dest;
+	fn->data = data;
+	fn->next = a->on_release;
+	a->on_release = fn;
+}
+
+void arena_retain(arena *a)
+{
+	a->refs++;
+}
+
+void arena_release(arena *a)
+{
+	if (--a->refs > 0) {
+		return;
+	}
+
+	for (arena_release_fn *fn = a->on_release; fn != NULL; fn = fn->next) {
+		fn->dest(fn->data, NULL);
+	}
+
+	arena_block *block = a->blocks;
+	while (block != NULL) {
+		arena_block *next = block->next;
+		free(block);
+		block = next;
+	}
+	free(a);
+}
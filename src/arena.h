@@ -0,0 +1,31 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include "linked_list.h"
+
+typedef struct arena_block arena_block;
+typedef struct arena_release_fn arena_release_fn;
+
+/*
+ * Memory handed out by bumping a pointer through a few large blocks,
+ * which are all freed at once when the last reference to the arena is
+ * released. Allocations holding on to anything outside the arena
+ * register a callback to let go of it first.
+ */
+typedef struct arena {
+	arena_block *blocks;
+	arena_release_fn *on_release;
+	int refs;
+} arena;
+
+#define ARENA_FIRST_BLOCK_BYTES (4*1024)
+#define ARENA_MAX_BLOCK_BYTES (256*1024)
+
+arena *arena_create(void);
+void *arena_alloc(arena *a, size_t size);
+void arena_on_release(arena *a, destructor dest, void *data);
+void arena_retain(arena *a);
+void arena_release(arena *a);
+
+#endif
@@ -4,28 +4,26 @@
 #include "ht.h"
 #include "type.h"
 
-void extract_arg_list(runtime *rt, hval *arglist, ...)
+void extract_arg_list(runtime *rt, arguments *args, ...)
 {
-	if (arglist->type != list_t) {
-		runtime_error("argument error: expected list\n");
-	}
-
 	va_list vargs;
-	va_start(vargs, arglist);
+	va_start(vargs, args);
 	hval **dest = NULL;
 	hval *value = NULL;
 	type expected_type;
-	ll_node *arglist_node = hval_list_head(arglist);
+	int i = 0;
 	while ((dest = va_arg(vargs, hval**)) != NULL) {
 		expected_type = va_arg(vargs, type);
-		/*value = (hval *) arglist_node->data;*/
-		value = runtime_get_arg_value(arglist_node);
-		if (value->type == expected_type) {
+		if (i == args->count) {
+			runtime_error("argument error: expected more than %d arguments\n", args->count);
+		}
+
+		value = args->values[i++];
+		if (hval_type(value) == expected_type) {
 			*dest = value;
 		} else {
-			runtime_error("argument error: got %s, expected %s\n", hval_type_string(expected_type), hval_type_string(value->type));
+			runtime_error("argument error: got %s, expected %s\n", hval_type_string(expected_type), hval_type_string(hval_type(value)));
 		}
-		arglist_node = arglist_node->next;
 	}
 
 	va_end(vargs);
@@ -1,6 +1,8 @@
 #ifndef DATA_H
 #define DATA_H
 
+#include <stdint.h>
+#include "arena.h"
 #include "ht.h"
 #include "str.h"
 
@@ -14,11 +16,35 @@ typedef struct hval hval;
 typedef struct list_hval list_hval;
 typedef struct mem mem;
 typedef struct expression expression;
+typedef struct shape shape;
+typedef struct vm_code vm_code;
 //typedef struct _list_hval list_hval;
 
+#define PROP_CACHE_WAYS 4
+
+/*
+ * One inline cache entry per receiver shape seen at a prop_ref. holder is
+ * NULL when the member lives on the receiver itself; otherwise it is the
+ * ancestor that had it, reached through the receiver's parent.
+ */
+typedef struct prop_cache_entry {
+	shape *shape;
+	hval *holder;
+	int slot;
+	hval *parent;
+	int parent_slot;
+	unsigned int epoch;
+} prop_cache_entry;
+
 typedef struct prop_ref {
 	expression *site;
 	hstr *name;
+	// lexical address filled in by the resolver: the frame depth levels
+	// up and the slot in it; index is -1 for names resolved dynamically
+	int depth;
+	int index;
+	prop_cache_entry cache[PROP_CACHE_WAYS];
+	int cache_next;
 } prop_ref;
 
 typedef struct prop_set {
@@ -39,7 +65,12 @@ typedef struct _function_declaration {
 
 struct expression {
 	expression_type type;
-	int refs;
+	// the module's arena, which the expression is allocated in
+	arena *arena;
+	// bytecode compiled on first evaluation, as a value and, for function
+	// bodies, as a statement sequence
+	vm_code *code;
+	vm_code *body_code;
 	union {
 		prop_ref *prop_ref;
 		prop_set *prop_set;
@@ -53,7 +84,19 @@ struct expression {
 	} operation;
 };
 
-typedef hval *(*native_function)(hval *this, hval *args);
+/*
+ * The arguments to a call: count values in a contiguous argv that lives on
+ * the caller's stack or the mem root stack, so nothing is allocated to pass
+ * them. names is NULL when every argument is positional; otherwise
+ * names[i] is the interned name of a named argument, or NULL.
+ */
+typedef struct arguments {
+	int count;
+	hval **values;
+	hstr **names;
+} arguments;
+
+typedef hval *(*native_function)(hval *this, arguments *args);
 
 typedef struct deferred_expression {
 	hval *ctx;
@@ -70,16 +113,26 @@ struct hval {
 	type type;
 	int refs;
 	union {
-		int number;
-		bool boolean;
 		hstr *str;
 		linked_list *list;
 		deferred_expression deferred_expression;
 		native_function native_fn;
 		function_decl fn;
+		// the next free slot, while on its chunk's free list
+		hval *next_free;
 	} value;
+	// members live in slots laid out by shape, or in the members hash
+	// once the object has too many of them (shape is then NULL)
+	shape *shape;
+	hval **slots;
 	hash *members;
-	bool reachable;
+	int slot_capacity;
+	// set once an inline cache has looked through this hval
+	bool prototype;
+	// set once the hval survives a collection; remembered is set while
+	// it sits in the remembered set
+	bool old;
+	bool remembered;
 };
 
 //struct list_hval {
@@ -87,6 +140,12 @@ struct hval {
 	//linked_list *list;
 //};
 
+/*
+ * EVAL_VM runs compiled bytecode; EVAL_AST walks the expression tree
+ * directly and is kept as a reference implementation.
+ */
+typedef enum { EVAL_VM, EVAL_AST } eval_mode;
+
 typedef struct {
 	hval *top_level;
 	hval *last_result;
@@ -95,6 +154,13 @@ typedef struct {
 	hval *object_root;
 
 	linked_list *loaded_modules;
+	eval_mode eval_mode;
+	// whether sys.load reads and writes .hspc files
+	bool module_cache;
+	// every native function the runtime has, by which heap images link
+	// theirs back up
+	struct _native_function_spec *natives;
+	int native_count;
 } runtime;
 
 typedef struct _native_function_spec {
@@ -102,32 +168,146 @@ typedef struct _native_function_spec {
 	native_function function;
 } native_function_spec;
 
+/*
+ * Chunks are CHUNK_BYTES long and aligned to CHUNK_BYTES, so the chunk an
+ * hval lives in is found by masking its address.
+ */
+#define CHUNK_BYTES (64 * 1024)
+
+/*
+ * Each chunk keeps side bitmaps with a bit per CHUNK_GRANULE bytes, found
+ * from an hval's offset in the chunk; element sizes are at least that, so
+ * no two hvals share a bit.
+ */
+#define CHUNK_GRANULE 16
+#define CHUNK_BITMAP_WORDS (CHUNK_BYTES / CHUNK_GRANULE / 64)
+
 typedef struct _chunk {
+	// the size of the mapping, which is CHUNK_BYTES unless it's large
+	size_t bytes;
 	int count;
+	int size_class;
 	size_t element_size;
 	size_t raw_size;
 	char *free_hint;
 	int allocated;
-	linked_list *free_list;
+	// cleared when a collection has finished marking, set once the chunk
+	// has been swept; nothing is allocated from a chunk until then
+	bool swept;
+	hval *free_list;
+	// on its size class's list of chunks that may have room
+	bool available;
+	struct _chunk *next_available;
+	// marks from the last collection, and which slots hold an hval
+	uint64_t marks[CHUNK_BITMAP_WORDS];
+	uint64_t in_use[CHUNK_BITMAP_WORDS];
 	char base[];
 } chunk;
 
 typedef struct _chunk_list {
 	chunk **chunks;
 	int num_chunks;
+	int capacity;
+	chunk *available;
 } chunk_list;
 
+/*
+ * Requests up to MEM_MAX_SMALL_SIZE bytes are rounded up to one of
+ * MEM_SIZE_CLASSES sizes and carved out of chunks; bigger ones get a
+ * chunk-aligned block each, so chunk_of() and the bitmaps still work.
+ */
+#define MEM_SIZE_CLASSES 23
+#define MEM_MAX_SMALL_SIZE 1024
+#define MEM_LARGE_CLASS (-1)
+
+/*
+ * With MEM_GUARDS, every hval is followed by at least MEM_GUARD_BYTES of
+ * a known pattern, checked when it's freed.
+ */
+#define MEM_GUARD_BYTES 16
+#define MEM_GUARD_PATTERN 0xa5
+
+#define MEM_ROOT_STACK_SIZE 65536
+#define MEM_NURSERY_SIZE 8192
+#define MEM_MIN_FULL_GC_THRESHOLD 65536
+#define MEM_MIN_HEAP_BYTES (4 * 1024 * 1024)
+// how big the heap may get, relative to what survived the last full
+// collection, before it's collected rather than grown
+#define MEM_HEAP_LIVE_RATIO 2
+#define MEM_GC_STEP_ALLOCS 256
+#define MEM_MAX_GC_THREADS 64
+
+typedef struct gc_pool gc_pool;
+
+/*
+ * A full collection marks, then sweeps. Marking is stop-the-world, or a
+ * slice at a time with a pause budget; white hvals are unmarked, gray ones
+ * are marked and waiting on the gray stack, and black ones have been
+ * scanned. Sweeping is lazy: a chunk is swept when allocation first
+ * reaches it, by incremental steps, or before the next mark at the latest.
+ */
+typedef enum { GC_IDLE, GC_MARKING, GC_SWEEPING } gc_phase;
+
 struct mem {
-	linked_list *gc_roots;
-	chunk_list chunks[8];
+	// long-lived roots, each with a count of how many times it's been
+	// added; temporaries go on the root stack instead
+	hash *gc_roots;
+	// values between root_stack and root_stack_top are gc roots; the
+	// bytecode VM uses this as its operand stack
+	hval **root_stack;
+	hval **root_stack_top;
+	hval **root_stack_limit;
+	chunk_list chunks[MEM_SIZE_CLASSES];
+	// one chunk per hval too big for the size classes
+	chunk_list large;
+	// hvals allocated since the last collection, which is all a minor
+	// collection has to sweep; entries may since have been freed
+	hval **nursery;
+	int nursery_count;
+	// old hvals that have been given a reference to a young one
+	hval **remembered;
+	int remembered_count;
+	int remembered_capacity;
+	// a full collection runs once old_count passes full_gc_threshold, or
+	// when the heap would have to grow past heap_target
+	int old_count;
+	int full_gc_threshold;
+	// bytes mapped for chunks, and the most that should be; empty chunks
+	// are unmapped after a full collection while there are more
+	size_t heap_bytes;
+	size_t heap_target;
+	// bytes allocated since the last full collection; once a heap bigger
+	// than the minimum has allocated its own size again, it's collected
+	// to see whether any of it can be given back
+	size_t allocated_bytes;
+	// with a pause budget, full collections run incrementally: a step of
+	// at most pause_us microseconds every MEM_GC_STEP_ALLOCS allocations
+	long pause_us;
+	gc_phase phase;
+	int allocs_since_step;
+	hval **gray;
+	int gray_count;
+	int gray_capacity;
+	// hvals marked by the collection in progress
+	int marked_count;
+	// where the incremental sweep has got to
+	int sweep_class;
+	int sweep_chunk;
+	// with more than one gc thread, stop-the-world collections mark and
+	// sweep on a pool of workers
+	int gc_threads;
+	gc_pool *pool;
 	bool gc;
+	// set while a heap known to be reachable is built; see mem_hold_gc
+	bool gc_held;
 };
 
-#define NATIVE_FUNCTION(name) hval *name(hval *this, hval *args)
+#define NATIVE_FUNCTION(name) hval *name(hval *this, arguments *args)
 #define runtime_error(...) fprintf(stderr, __VA_ARGS__); exit(1);
+#define runtime_arg_name(args, i) ((args)->names != NULL ? (args)->names[i] : NULL)
 #define runtime_get_arg_value(lln) (hval_hash_get(((hval *)lln->data), VALUE, NULL))
 #define runtime_get_arg_name(lln) (hval_hash_get(((hval *)lln->data), NAME, NULL))
-void extract_arg_list(runtime *rt, hval *args, ...);
+void extract_arg_list(runtime *rt, arguments *args, ...);
 void register_native_functions(runtime *r, native_function_spec *spec, int count);
 
 #endif
@@ -3,9 +3,17 @@
 #include <stdlib.h>
 #include "log.h"
 
-unsigned int hash_index_of(hash *hash, void *key);
-void *hash_resolve_chain(hash *hash, hash_entry *entry, void *key);
-void hash_entry_destroy(hash_entry *entry, destructor key_dtor, void *key_context, destructor value_dtor, void *value_context, bool top_level);
+unsigned int hash_index_of(hash *hash, unsigned int hash_code);
+static hash_entry *hash_table_create(int buckets);
+static void hash_table_clear(hash_entry *table, int buckets);
+static void hash_reset_small(hash *hash);
+static hash_entry *hash_find_entry(hash *hash, void *key);
+static hash_entry *hash_find_hashed(hash *hash, unsigned int hash_code, key_comparator matches, void *probe);
+static void hash_insert_entry(hash *hash, void *key, void *value, unsigned int hash_code);
+static void hash_grow(hash *hash);
+void hash_entry_destroy(hash_entry *entry, destructor key_dtor, void *key_context, destructor value_dtor, void *value_context);
+
+#define hash_probe_distance(h, code, i) (((i) - hash_index_of((h), (code))) & ((h)->buckets - 1))
 
 hash *hash_create(hash_function hash_func, key_comparator comp)
 {
@@ -14,71 +22,82 @@ hash *hash_create(hash_function hash_func, key_comparator comp)
 	{
 		hlog("Unable to allocate memory for hash");
 	} else {
-		h->buckets = 32;
-		h->table = malloc(sizeof(hash_entry) * h->buckets);
-		for (int i=0; i < h->buckets; i++) {
-			h->table[i].key = NULL;
-			h->table[i].value = NULL;
-			h->table[i].next = NULL;
-		}
-
-		if (h->table == NULL)
-		{
-			hlog("Unable to allocate memory for hash table");
-			// don't return a half-ready table
-			free(h);
-			h = NULL;
-		}
-		else
-		{
-			h->size = 0;
-			h->hasher = hash_func;
-			h->key_comparator = comp;
-		}
+		h->table = NULL;
+		hash_reset_small(h);
+		h->size = 0;
+		h->hasher = hash_func;
+		h->key_comparator = comp;
 	}
 
 	return h;
 }
 
+static hash_entry *hash_table_create(int buckets)
+{
+	hash_entry *table = malloc(sizeof(hash_entry) * buckets);
+	if (table != NULL) {
+		hash_table_clear(table, buckets);
+	}
+
+	return table;
+}
+
+static void hash_table_clear(hash_entry *table, int buckets)
+{
+	for (int i = 0; i < buckets; i++) {
+		table[i].key = NULL;
+		table[i].value = NULL;
+		table[i].hash_code = 0;
+	}
+}
+
+/*
+ * Drops any promoted table and switches back to the inline small map.
+ */
+static void hash_reset_small(hash *hash)
+{
+	if (hash->table != NULL && !hash_is_small(hash)) {
+		free(hash->table);
+	}
+
+	hash->table = hash->small;
+	hash->buckets = HASH_SMALL_BUCKETS;
+	hash_table_clear(hash->small, HASH_SMALL_BUCKETS);
+}
+
 void hash_empty(hash *h, destructor key_dtor, void *key_context, destructor value_dtor, void *value_context)
 {
 	/*fprintf(stderr, "hash_empty: %p key_dtor: %p value_dtor: %p\n", h, key_dtor, value_dtor);*/
 	for (hash_entry *entry = h->table + h->buckets - 1; entry >= h->table; entry--) {
 		if (entry->key) {
-			hash_entry_destroy(entry, key_dtor, key_context, value_dtor, value_context, true);
+			hash_entry_destroy(entry, key_dtor, key_context, value_dtor, value_context);
 		}
 	}
 
 	h->size = 0;
+	// hashes are reused along with their hval slots, so give back any
+	// large table rather than keeping it around for the next occupant
+	hash_reset_small(h);
 }
 
 void hash_destroy(hash *h, destructor key_dtor, void *key_context, destructor value_dtor, void *value_context)
 {
-	int i = h->buckets;
-	while (--i >= 0)
-	{
-		hash_entry *entry = h->table + i;
-		hash_entry_destroy(entry, key_dtor, key_context, value_dtor, value_context, true);
-	}
-
-	free(h->table);
+	hash_empty(h, key_dtor, key_context, value_dtor, value_context);
 	free(h);
 }
 
-void hash_entry_destroy(hash_entry *entry, destructor key_dtor, void *key_context, destructor value_dtor, void *value_context, bool top_level)
+void hash_entry_destroy(hash_entry *entry, destructor key_dtor, void *key_context, destructor value_dtor, void *value_context)
 {
 	if (!entry || !entry->key)
 	{
 		return;
 	}
-	
+
 	void *key = entry->key;
 	entry->key = NULL;
 	void *value = entry->value;
 	entry->value = NULL;
-	hash_entry *next = entry->next;
 
-	hash_entry_destroy(next, key_dtor, key_context, value_dtor, value_context, false);
 	hlog("hash_entry_destroy key, value: %p %p\n", key, value);
 	if (key != NULL && key_dtor != NULL) {
 		key_dtor(key, key_context);
@@ -87,11 +106,6 @@ void hash_entry_destroy(hash_entry *entry, destructor key_dtor, void *key_contex
 	if (value != NULL && value_dtor != NULL) {
 		value_dtor(value, value_context);
 	}
-
-	if (!top_level)
-	{
-		free(entry);
-	}
 }
 
 void *hash_put(hash *hash, void *key, void *value)
@@ -100,50 +114,115 @@ void *hash_put(hash *hash, void *key, void *value)
 		printf("hash_put into null hash\n");
 		exit(1);
 	}
-	unsigned int i = hash_index_of(hash, key);
-	hash_entry *candidate = hash->table + i;
 
-	// since the table doesn't point to pointers to hash_entries,
-	// we need different logic to chain.
-	if (candidate->key)
+	hash_entry *candidate = hash_find_entry(hash, key);
+	if (candidate)
 	{
-		//while (candidate->next)
-		while (true)
+		if (candidate->value == value)
 		{
-			if (hash->key_comparator(candidate->key, key))
-			{
-				if (candidate->value == value)
-				{
-					hlog("overwriting with same value\n");
-					return NULL;
-				}
-				else
-				{
-					hlog("overwriting with new value\n");
-					void *old_value = candidate->value;
-					candidate->value = value;
-					return old_value;
-				}
-			}
-			if (candidate->next == NULL) {
-				break;
-			}
-			candidate = candidate->next;
+			hlog("overwriting with same value\n");
+			return NULL;
 		}
+		else
+		{
+			hlog("overwriting with new value\n");
+			void *old_value = candidate->value;
+			candidate->value = value;
+			return old_value;
+		}
+	}
 
-		hash->size++;
-		candidate->next = malloc(sizeof(hash_entry));
-		candidate->next->key = key;
-		candidate->next->value = value;
-		candidate->next->next = NULL;
-		return NULL;
+	if (hash_is_small(hash))
+	{
+		if (hash->size < HASH_SMALL_BUCKETS)
+		{
+			hash_entry *entry = hash->small + hash->size;
+			entry->key = key;
+			entry->value = value;
+			entry->hash_code = hash->hasher(key);
+			hash->size++;
+			return NULL;
+		}
+
+		hash_grow(hash);
+	}
+	else if ((hash->size + 1) * HASH_LOAD_DEN > hash->buckets * HASH_LOAD_NUM)
+	{
+		hash_grow(hash);
+	}
+
+	hash_insert_entry(hash, key, value, hash->hasher(key));
+	hash->size++;
+	return NULL;
+}
+
+/*
+ * Robin Hood insertion: walk forward from the home bucket, and whenever
+ * the resident entry is closer to its own home than the entry being
+ * inserted, swap them and carry on inserting the displaced one. This
+ * keeps probe sequences short and lets hash_get stop early.
+ */
+static void hash_insert_entry(hash *hash, void *key, void *value, unsigned int hash_code)
+{
+	hash_entry carry = { key, value, hash_code };
+	unsigned int mask = hash->buckets - 1;
+	unsigned int i = hash_index_of(hash, hash_code);
+	unsigned int distance = 0;
+
+	while (true)
+	{
+		hash_entry *entry = hash->table + i;
+		if (entry->key == NULL)
+		{
+			*entry = carry;
+			return;
+		}
+
+		unsigned int resident_distance = hash_probe_distance(hash, entry->hash_code, i);
+		if (resident_distance < distance)
+		{
+			hash_entry tmp = *entry;
+			*entry = carry;
+			carry = tmp;
+			distance = resident_distance;
+		}
+
+		i = (i + 1) & mask;
+		distance++;
+	}
+}
+
+static void hash_grow(hash *hash)
+{
+	bool was_small = hash_is_small(hash);
+	int old_buckets = hash->buckets;
+	int new_buckets = was_small ? HASH_DEFAULT_BUCKETS : old_buckets * 2;
+	hash_entry *old_table = hash->table;
+	hash_entry *new_table = hash_table_create(new_buckets);
+	if (new_table == NULL)
+	{
+		perror("Unable to grow hash table");
+		exit(1);
+	}
+
+	hlog("hash_grow: %p %d -> %d\n", hash, old_buckets, new_buckets);
+	hash->table = new_table;
+	hash->buckets = new_buckets;
+	for (hash_entry *entry = old_table, *max = old_table + old_buckets; entry < max; entry++)
+	{
+		if (entry->key)
+		{
+			hash_insert_entry(hash, entry->key, entry->value, entry->hash_code);
+		}
+	}
+
+	if (was_small)
+	{
+		hash_table_clear(hash->small, HASH_SMALL_BUCKETS);
 	}
 	else
 	{
-		hash->size++;
-		candidate->key = key;
-		candidate->value = value;
-		return NULL;
+		free(old_table);
 	}
 }
 
@@ -159,74 +238,141 @@ void hash_put_all(hash *dest, hash *src, destructor overwrite_dtor)
 	hash_iterator_destroy(iter);
 }
 
-unsigned int hash_index_of(hash *hash, void *key)
+void hash_reserve(hash *h, int buckets)
+{
+	if (h->size > 0 || buckets <= h->buckets)
+	{
+		return;
+	}
+
+	hash_reset_small(h);
+	h->table = hash_table_create(buckets);
+	if (h->table == NULL)
+	{
+		perror("Unable to grow hash table");
+		exit(1);
+	}
+	h->buckets = buckets;
+}
+
+unsigned int hash_index_of(hash *hash, unsigned int hash_code)
 {
-	int hash_result = hash->hasher(key);
-	unsigned int bucket = hash_result % hash->buckets;
-	return bucket;
+	// buckets is always a power of two
+	return hash_code & (hash->buckets - 1);
 }
 
-void *hash_get(hash *hash, void *key)
+/*
+ * Finds the entry with the given hash code whose key matches probe, which
+ * needn't be a key itself.
+ */
+static hash_entry *hash_find_hashed(hash *hash, unsigned int hash_code, key_comparator matches, void *probe)
 {
-	int i = hash_index_of(hash, key);
-	hash_entry *candidate = hash->table + i;
+	if (hash_is_small(hash))
+	{
+		// small maps are packed, so a linear scan of size entries will do
+		for (hash_entry *candidate = hash->small, *max = hash->small + hash->size; candidate < max; candidate++)
+		{
+			if (candidate->hash_code == hash_code && matches(candidate->key, probe))
+			{
+				return candidate;
+			}
+		}
 
-	while (candidate && candidate->key)
+		return NULL;
+	}
+
+	unsigned int mask = hash->buckets - 1;
+	unsigned int i = hash_index_of(hash, hash_code);
+	unsigned int distance = 0;
+
+	while (true)
 	{
-		if (hash->key_comparator(candidate->key, key))
+		hash_entry *candidate = hash->table + i;
+		// an empty bucket, or a resident closer to home than we'd be,
+		// means the key can't be any further along
+		if (candidate->key == NULL || hash_probe_distance(hash, candidate->hash_code, i) < distance)
 		{
-			return candidate->value;
+			return NULL;
 		}
-		
-		candidate = candidate->next;
+
+		if (candidate->hash_code == hash_code && matches(candidate->key, probe))
+		{
+			return candidate;
+		}
+
+		i = (i + 1) & mask;
+		distance++;
 	}
+}
 
-	return NULL;
+static hash_entry *hash_find_entry(hash *hash, void *key)
+{
+	if (hash->size == 0)
+	{
+		return NULL;
+	}
+
+	return hash_find_hashed(hash, hash->hasher(key), hash->key_comparator, key);
+}
+
+void *hash_get(hash *hash, void *key)
+{
+	hash_entry *entry = hash_find_entry(hash, key);
+	return entry ? entry->value : NULL;
+}
+
+void *hash_get_hashed(hash *hash, unsigned int hash_code, key_comparator matches, void *probe)
+{
+	if (hash->size == 0)
+	{
+		return NULL;
+	}
+
+	hash_entry *entry = hash_find_hashed(hash, hash_code, matches, probe);
+	return entry ? entry->value : NULL;
 }
 
+/*
+ * Removal uses backward-shift deletion: every following entry that isn't
+ * already in its home bucket moves back one slot, so no tombstones are
+ * left behind and lookups never have to skip over deleted entries.
+ */
 void *hash_remove(hash *hash, void *key)
 {
-	int i = hash_index_of(hash, key);
-	hash_entry *ent = hash->table + i;
-	if (!ent->key)
+	hash_entry *ent = hash_find_entry(hash, key);
+	if (!ent)
 	{
 		hlog("key not found!");
 		return NULL;
 	}
 
-
-	void *old_value = NULL;
-	if (hash->key_comparator(ent->key, key))
+	void *old_value = ent->value;
+	if (hash_is_small(hash))
 	{
-		old_value = ent->value;
-		hash_entry *old_next = ent->next;
-		if (old_next)
-		{
-			*ent = *ent->next;
-			free(old_next);
-			old_next = NULL;
-		}
-		else
-		{
-			ent->key = NULL;
-			ent->value = NULL;
-		}
+		// keep the small map packed by moving the last entry into the hole
+		hash_entry *last = hash->small + hash->size - 1;
+		*ent = *last;
+		last->key = NULL;
+		last->value = NULL;
+		last->hash_code = 0;
+		hash->size--;
+		return old_value;
 	}
-	else
+
+	unsigned int mask = hash->buckets - 1;
+	unsigned int i = ent - hash->table;
+	unsigned int next = (i + 1) & mask;
+	while (hash->table[next].key != NULL && hash_probe_distance(hash, hash->table[next].hash_code, next) > 0)
 	{
-		while (ent->next)
-		{
-			if (hash->key_comparator(ent->next->key, key))
-			{
-				old_value = ent->next->value;
-				ent->next = ent->next->next;
-				
-				break;
-			}
-		}
-		
+		hash->table[i] = hash->table[next];
+		i = next;
+		next = (next + 1) & mask;
 	}
 
+	hash->table[i].key = NULL;
+	hash->table[i].value = NULL;
+	hash->table[i].hash_code = 0;
+
 	hash->size--;
 	return old_value;
 }
@@ -238,11 +384,7 @@ void hash_iterate(hash *h, key_value_callback callback, void *ctx)
 		if (h->table[i].key)
 		{
 			hash_entry *entry = h->table + i;
-			do
-			{
-				callback(h, entry->key, entry->value, ctx);
-				entry = entry->next;
-			}  while (entry);
+			callback(h, entry->key, entry->value, ctx);
 		}
 	}
 }
@@ -250,48 +392,39 @@ void hash_iterate(hash *h, key_value_callback callback, void *ctx)
 hash_iterator *hash_iterator_create(hash *h)
 {
 	hash_iterator *it = malloc(sizeof(hash_iterator));
+	hash_iterator_init(it, h);
+	return it;
+}
+
+void hash_iterator_init(hash_iterator *it, hash *h)
+{
 	it->hash = h;
-	it->bucket = 0;
+	it->bucket = -1;
 	it->current_entry = NULL;
 	it->current_key = NULL;
 	it->current_value = NULL;
 	hash_iterator_next(it);
-	return it;
 }
 
 void hash_iterator_next(hash_iterator *iter)
 {
+	iter->current_entry = NULL;
 	iter->current_value = NULL;
 	iter->current_key = NULL;
 	hash *h = iter->hash;
-	if (iter->current_entry)
-	{
-		iter->current_entry = iter->current_entry->next;
-		if (iter->current_entry == NULL)
+
+	for (int i = iter->bucket + 1, max = h->buckets; i < max; i++) {
+		if (h->table[i].key)
 		{
-			iter->bucket++;
-		} else {
+			iter->current_entry = h->table + i;
 			iter->current_key = iter->current_entry->key;
 			iter->current_value = iter->current_entry->value;
+			iter->bucket = i;
+			return;
 		}
 	}
 
-	if (!iter->current_key) {
-		/*int *i = &iter->bucket;*/
-		/*for (int *i = &iter->bucket; *i < h->buckets; (*i)++) {*/
-		/*int i = iter->bucket;*/
-		/*for (; iter->bucket < h->buckets; iter->bucket++) {*/
-		for (int i = iter->bucket, max = h->buckets; i < max; i++) {
-			if (h->table[i].key)
-			{
-				iter->current_entry = h->table + i;
-				iter->current_key = iter->current_entry->key;
-				iter->current_value = iter->current_entry->value;
-				iter->bucket = i;
-				break;
-			}
-		}
-	}
+	iter->bucket = h->buckets;
 }
 
 void hash_iterator_destroy(hash_iterator *iter)
@@ -308,37 +441,29 @@ void hash_dump(hash *hash, char *(*key_to_string)(void *), char *(*value_to_stri
 		{
 			hlog("%04d:", i);
 			hash_entry *entry = hash->table + i;
-			do
+			char *key_str = key_to_string
+					? key_to_string(entry->key)
+					: (char *) entry->key;
+
+			hlog("key: %s\n", key_str);
+			if (key_to_string)
 			{
-				char *key_str = key_to_string
-						? key_to_string(entry->key)
-						: (char *) entry->key;
-				
-				hlog("key: %s\n", key_str);
-				if (key_to_string)
-				{
-					free(key_str);
-					key_str = NULL;
-				}
-
-				char *val_str = value_to_string
-						? value_to_string(entry->value)
-						: (char *) entry->value;
-				hlog(" %d: %s", hash->hasher(entry->key), val_str);
-				if (value_to_string)
-				{
-					free(val_str);
-					val_str = NULL;
-				}
-				entry = entry->next;
-			} while (entry);
+				free(key_str);
+				key_str = NULL;
+			}
+
+			char *val_str = value_to_string
+					? value_to_string(entry->value)
+					: (char *) entry->value;
+			hlog(" %u (distance %u): %s", entry->hash_code,
+					hash_probe_distance(hash, entry->hash_code, i), val_str);
+			if (value_to_string)
+			{
+				free(val_str);
+				val_str = NULL;
+			}
 			hlog("\n");
 		}
 
 	}
 }
-
-void *hash_resolve_chain(hash *hash, hash_entry *entry, void *key)
-{
-	return NULL;
-}
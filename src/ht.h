@@ -4,13 +4,38 @@
 #include <stdbool.h>
 #include "linked_list.h"
 
-typedef int (*hash_function)(void *);
+typedef unsigned int (*hash_function)(void *);
 typedef bool (*key_comparator)(void *, void *);
 
+/*
+ * Hashes start out as a small map: up to HASH_SMALL_BUCKETS entries kept
+ * packed in storage inside the hash itself and found by linear scan.
+ * Most objects (numbers, strings, bound functions) never outgrow it.
+ */
+#define HASH_SMALL_BUCKETS 4
+
+/*
+ * Number of buckets a small map is promoted to once it overflows; the
+ * table then doubles from there. Always a power of two.
+ */
+#define HASH_DEFAULT_BUCKETS 16
+
+/*
+ * The table is grown once size * HASH_LOAD_DEN exceeds
+ * buckets * HASH_LOAD_NUM (a load factor of 0.75).
+ */
+#define HASH_LOAD_NUM 3
+#define HASH_LOAD_DEN 4
+
+/*
+ * Entries live directly in the table (open addressing with Robin Hood
+ * linear probing). An empty bucket has a NULL key; the cached hash code
+ * avoids calling the hasher again when probing or growing the table.
+ */
 typedef struct _hash_entry {
 	void *key;
 	void *value;
-	struct _hash_entry *next;
+	unsigned int hash_code;
 } hash_entry;
 
 typedef struct {
@@ -19,8 +44,11 @@ typedef struct {
 	hash_entry *table;
 	hash_function hasher;
 	key_comparator key_comparator;
+	hash_entry small[HASH_SMALL_BUCKETS];
 } hash;
 
+#define hash_is_small(h) ((h)->table == (h)->small)
+
 typedef struct {
 	hash *hash;
 	int bucket;
@@ -50,6 +78,12 @@ void *hash_put(hash *hash, void *key, void *value);
  */
 void hash_put_all(hash *dest, hash *src, destructor overwrite_dtor);
 
+/**
+ * Gives an empty hash a table of the given number of buckets (a power of
+ * two), as though it had already grown to that size.
+ */
+void hash_reserve(hash *h, int buckets);
+
 /* Removes a key from the hash and returns the value that was
  * associated with it, if any.
  */
@@ -57,6 +91,12 @@ void *hash_remove(hash *hash, void *key);
 
 void *hash_get(hash *hash, void *key);
 
+/*
+ * Looks up the key with the given hash code that matches(key, probe), so
+ * that a key needn't be built just to look one up.
+ */
+void *hash_get_hashed(hash *hash, unsigned int hash_code, key_comparator matches, void *probe);
+
 void hash_dump(hash *hash, char *(key_to_string)(void *), char *(*value_to_string)(void *));
 
 //void hash_iterate(hash *h, void (*callback)(hash *, void *, void *, void *), void *ctx);
@@ -64,5 +104,6 @@ void hash_iterate(hash *h, key_value_callback callback, void *ctx);
 void hash_iterator_next(hash_iterator *);
 void hash_iterator_destroy(hash_iterator *);
 hash_iterator *hash_iterator_create(hash *);
+void hash_iterator_init(hash_iterator *, hash *);
 
 #endif
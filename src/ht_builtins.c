@@ -1,23 +1,85 @@
 #include <string.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include "ht_builtins.h"
 
-#define HASH_STRING_LIMIT 32
-int hash_string(void *vstr)
+/*
+ * A wyhash-style hash: the whole key is consumed 16 bytes at a time and
+ * folded with 64x64->128 bit multiplies, which mix every input bit into
+ * the low bits that hash_index_of masks off.
+ */
+#define HASH_SEED 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6e3ull
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
 {
-	const char *str = (char *) vstr;
-	int hash = 0;
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t) a * b;
+	return (uint64_t) r ^ (uint64_t) (r >> 64);
+#else
+	uint64_t ha = a >> 32, la = (uint32_t) a, hb = b >> 32, lb = (uint32_t) b;
+	uint64_t hi = ha * hb, lo = la * lb, mid1 = ha * lb, mid2 = la * hb;
+	uint64_t t = lo + (mid1 << 32);
+	uint64_t carry = t < lo;
+	lo = t + (mid2 << 32);
+	carry += lo < t;
+	hi += (mid1 >> 32) + (mid2 >> 32) + carry;
+	return lo ^ hi;
+#endif
+}
+
+static inline uint64_t hash_read64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t hash_read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+unsigned int hash_bytes(const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	uint64_t seed = HASH_SEED;
+	uint64_t a = 0, b = 0;
+	size_t remaining = len;
 
-	int i = 0;
-	unsigned char c;
-	while (i < HASH_STRING_LIMIT && str[i])
+	while (remaining > 16)
 	{
-		c = (unsigned char) str[i];
-		hash += c;
-		i++;
+		seed = hash_mix(hash_read64(p) ^ HASH_P1, hash_read64(p + 8) ^ seed);
+		p += 16;
+		remaining -= 16;
 	}
 
-	return hash;
+	if (remaining >= 8)
+	{
+		a = hash_read64(p);
+		b = hash_read64(p + remaining - 8);
+	}
+	else if (remaining >= 4)
+	{
+		a = (hash_read32(p) << 32) | hash_read32(p + remaining - 4);
+	}
+	else if (remaining > 0)
+	{
+		a = ((uint64_t) p[0] << 16) | ((uint64_t) p[remaining >> 1] << 8) | p[remaining - 1];
+	}
+
+	uint64_t h = hash_mix(HASH_P1 ^ len, hash_mix(a ^ HASH_P1, b ^ seed ^ HASH_P2));
+	return (unsigned int) (h ^ (h >> 32));
+}
+
+unsigned int hash_string(void *vstr)
+{
+	const char *str = (char *) vstr;
+	return hash_bytes(str, strlen(str));
 }
 
 bool hash_string_comparator(void *str1, void *str2)
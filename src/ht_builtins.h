@@ -1,7 +1,11 @@
 #ifndef HT_BUILTINS_H
 #define HT_BUILTINS_H
 
-int hash_string(void *str);
+#include <stdbool.h>
+#include <stddef.h>
+
+unsigned int hash_bytes(const void *data, size_t len);
+unsigned int hash_string(void *str);
 
 bool hash_string_comparator(void *str1, void *str2);
 
@@ -0,0 +1,928 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ht.h"
+#include "image.h"
+#include "log.h"
+#include "mm.h"
+#include "module_cache.h"
+#include "runtime.h"
+#include "smalloc.h"
+#include "type.h"
+#include "modules/list.h"
+
+/*
+ * An image is this header followed by its body of 32-bit words:
+ *
+ * - the string table, as in a module cache file
+ * - each module: its source's path, identity, size and mtime, then its
+ *   node count and cache file body, if anything saved refers to it; if
+ *   not, its node count is zero and it's just noted as loaded
+ * - the number of hvals, and those of the top level and object root
+ * - each hval's type, size, string and the primitive it is, if any
+ * - each hval's list items, deferred expression or native function name,
+ *   then its members
+ *
+ * Values are a kind and a number: an immediate, or an hval by number.
+ * Expressions are a module and a node number within it.
+ */
+typedef struct image_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t body_hash;
+	uint32_t string_count;
+	uint32_t module_count;
+	uint32_t hval_count;
+	uint32_t word_count;
+} image_header;
+
+#define IMAGE_MAGIC "HSPI"
+#define NO_INDEX 0xffffffffu
+
+enum { REF_NULL, REF_NUMBER, REF_BOOLEAN, REF_HVAL };
+enum { MEMBERS_SHAPED, MEMBERS_HASHED };
+
+typedef struct image_words {
+	uint32_t *words;
+	size_t count;
+	size_t capacity;
+} image_words;
+
+typedef struct saved_module {
+	loaded_module *module;
+	module_cache_body body;
+	uint32_t node_count;
+	// whether any saved function's body is in it
+	bool needed;
+} saved_module;
+
+typedef struct image_writer {
+	runtime *rt;
+	image_words strings;
+	image_words body;
+	// each string written so far, to its index plus one
+	hash *string_index;
+	uint32_t string_count;
+	// the hvals to save, by number, and each one's number plus one
+	hval **hvals;
+	uint32_t hval_count;
+	uint32_t hval_capacity;
+	hash *hval_index;
+	// each module expression, and string primitive, to its module plus
+	// one in the high half and its node number in the low
+	hash *node_index;
+	// each native function to its index in rt->natives plus one
+	hash *native_index;
+	saved_module *modules;
+	uint32_t module_count;
+	bool failed;
+} image_writer;
+
+typedef struct image_module {
+	char *filename;
+	const uint32_t *words;
+	uint32_t word_count;
+	uint32_t string_count;
+	uint32_t node_count;
+	expression **nodes;
+	hval **primitives;
+	expression *expr;
+	struct stat st;
+} image_module;
+
+typedef struct image_reader {
+	runtime *rt;
+	const uint32_t *pos;
+	const uint32_t *end;
+	uint32_t string_count;
+	const char **string_text;
+	uint32_t *string_len;
+	// interned on first use as a name
+	hstr **names;
+	image_module *modules;
+	uint32_t module_count;
+	hval **hvals;
+	uint32_t hval_count;
+	bool failed;
+} image_reader;
+
+static unsigned int hash_pointer(void *p);
+static bool pointer_comparator(void *a, void *b);
+static void number_hval(image_writer *w, hval *hv);
+static void put_hval(image_writer *w, hval *hv);
+static bool read_image(image_reader *r);
+
+static unsigned int hash_pointer(void *p)
+{
+	uint64_t bits = (uintptr_t) p;
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdULL;
+	bits ^= bits >> 33;
+	return (unsigned int) bits;
+}
+
+static bool pointer_comparator(void *a, void *b)
+{
+	return a == b;
+}
+
+/*
+ * What the hval was allocated with; a custom hval's extra fields are its
+ * native state, a list's nodes or a file's handle.
+ */
+static uint32_t hval_size(hval *hv)
+{
+	size_t size = chunk_of(hv)->element_size;
+#if MEM_GUARDS
+	size -= MEM_GUARD_BYTES;
+#endif
+	return size;
+}
+
+static void put_word(image_words *b, uint32_t word)
+{
+	if (b->count == b->capacity) {
+		b->capacity = b->capacity ? b->capacity * 2 : 1024;
+		b->words = srealloc(b->words, sizeof(uint32_t) * b->capacity);
+	}
+
+	b->words[b->count++] = word;
+}
+
+static void put_wide(image_words *b, uint64_t value)
+{
+	put_word(b, (uint32_t) value);
+	put_word(b, (uint32_t) (value >> 32));
+}
+
+static void put_string(image_writer *w, hstr *str)
+{
+	uintptr_t index = (uintptr_t) hash_get(w->string_index, str);
+	if (index == 0) {
+		index = ++w->string_count;
+		hstr_retain(str);
+		hash_put(w->string_index, str, (void *) index);
+
+		uint32_t len = strlen(str->str);
+		put_word(&w->strings, len);
+		for (uint32_t i = 0; i < len; i += sizeof(uint32_t)) {
+			uint32_t word = 0;
+			memcpy(&word, str->str + i, len - i < sizeof(uint32_t) ? len - i : sizeof(uint32_t));
+			put_word(&w->strings, word);
+		}
+	}
+
+	put_word(&w->body, index - 1);
+}
+
+static void put_chars(image_writer *w, char *chars)
+{
+	hstr *str = hstr_create(chars);
+	put_string(w, str);
+	hstr_release(str);
+}
+
+static void put_ref(image_writer *w, hval *value)
+{
+	if (value == NULL) {
+		put_word(&w->body, REF_NULL);
+		put_word(&w->body, 0);
+	} else if (hval_is_number_immediate(value)) {
+		put_word(&w->body, REF_NUMBER);
+		put_word(&w->body, (uint32_t) hval_number_value(value));
+	} else if (hval_is_boolean_immediate(value)) {
+		put_word(&w->body, REF_BOOLEAN);
+		put_word(&w->body, hval_boolean_value(value));
+	} else {
+		put_word(&w->body, REF_HVAL);
+		put_word(&w->body, (uintptr_t) hash_get(w->hval_index, value) - 1);
+	}
+}
+
+static void put_node(image_writer *w, void *node)
+{
+	uintptr_t code = node != NULL ? (uintptr_t) hash_get(w->node_index, node) : 0;
+	if (code == 0 || !w->modules[(code >> 32) - 1].needed) {
+		put_word(&w->body, NO_INDEX);
+		put_word(&w->body, NO_INDEX);
+	} else {
+		put_word(&w->body, (code >> 32) - 1);
+		put_word(&w->body, (uint32_t) code);
+	}
+}
+
+static void number_hval(image_writer *w, hval *hv)
+{
+	if (hv == NULL || hval_is_immediate(hv) || hash_get(w->hval_index, hv) != NULL) {
+		return;
+	}
+
+	if (w->hval_count == w->hval_capacity) {
+		w->hval_capacity = w->hval_capacity ? w->hval_capacity * 2 : 1024;
+		w->hvals = srealloc(w->hvals, sizeof(hval *) * w->hval_capacity);
+	}
+	w->hvals[w->hval_count++] = hv;
+	hash_put(w->hval_index, hv, (void *) (uintptr_t) w->hval_count);
+}
+
+/*
+ * Encodes a module and numbers its expressions, which it's written out
+ * with, once it's known whether anything needs them.
+ */
+static void encode_module(image_writer *w, saved_module *saved)
+{
+	expression **nodes = NULL;
+	uint32_t node_count = 0;
+	memset(&saved->body, 0, sizeof(saved->body));
+	// a module restored without its expressions has none to save
+	if (saved->module->expr == NULL) {
+		return;
+	} else if (!module_cache_encode(saved->module->expr, &saved->body, &nodes, &node_count)) {
+		fprintf(stderr, "Unable to save module %s in an image\n", saved->module->filename);
+		w->failed = true;
+	}
+
+	uintptr_t module_code = (uintptr_t) (saved - w->modules + 1) << 32;
+	for (uint32_t i = 0; i < node_count; i++) {
+		hash_put(w->node_index, nodes[i], (void *) (module_code | i));
+		hval *primitive = nodes[i]->type == expr_primitive_t ? nodes[i]->operation.primitive : NULL;
+		if (primitive != NULL && !hval_is_immediate(primitive)) {
+			hash_put(w->node_index, primitive, (void *) (module_code | i));
+		}
+	}
+	saved->node_count = node_count;
+	free(nodes);
+}
+
+static void put_module(image_writer *w, saved_module *saved)
+{
+	// saved as an absolute path, so the image works from anywhere
+	loaded_module *module = saved->module;
+	char *path = realpath(module->filename, NULL);
+	put_chars(w, path != NULL ? path : module->filename);
+	free(path);
+	put_wide(&w->body, module->dev);
+	put_wide(&w->body, module->ino);
+	put_wide(&w->body, module->size);
+	put_wide(&w->body, module->mtime.tv_sec);
+	put_wide(&w->body, module->mtime.tv_nsec);
+	if (!saved->needed) {
+		put_word(&w->body, 0);
+		return;
+	}
+
+	put_word(&w->body, saved->node_count);
+	put_word(&w->body, saved->body.string_count);
+	put_word(&w->body, saved->body.word_count);
+	for (size_t i = 0; i < saved->body.word_count; i++) {
+		put_word(&w->body, saved->body.words[i]);
+	}
+}
+
+/*
+ * Members are put back in the order they're written. In slots, that makes
+ * the same shape; a members hash is written as module cache files write
+ * hash literals, so it's rebuilt just as it was.
+ */
+static void put_members(image_writer *w, hval *hv)
+{
+	if (hv->shape != NULL) {
+		put_word(&w->body, MEMBERS_SHAPED);
+		put_word(&w->body, hv->shape->count);
+		for (int i = 0; i < hv->shape->count; i++) {
+			put_string(w, hv->shape->keys[i]);
+			put_ref(w, hv->slots[i]);
+		}
+		return;
+	}
+
+	hash *members = hv->members;
+	put_word(&w->body, MEMBERS_HASHED);
+	put_word(&w->body, members->buckets);
+	put_word(&w->body, members->size);
+	int start = 0;
+	if (!hash_is_small(members)) {
+		while (members->table[start].key != NULL) {
+			start++;
+		}
+	}
+
+	for (int i = 0; i < members->buckets; i++) {
+		hash_entry *entry = members->table + (start + i) % members->buckets;
+		if (entry->key != NULL) {
+			put_string(w, (hstr *) entry->key);
+			put_ref(w, (hval *) entry->value);
+		}
+	}
+}
+
+static void put_hval(image_writer *w, hval *hv)
+{
+	switch (hv->type)
+	{
+		case list_t:
+			put_word(&w->body, hval_list_size(hv));
+			LL_FOREACH(hval_list_list(hv), node) {
+				put_ref(w, (hval *) node->data);
+			}
+			break;
+		case deferred_expression_t:
+			put_ref(w, hv->value.deferred_expression.ctx);
+			put_node(w, hv->value.deferred_expression.expr);
+			break;
+		case native_function_t: {
+			uintptr_t index = (uintptr_t) hash_get(w->native_index, hv->value.native_fn);
+			if (index == 0) {
+				fprintf(stderr, "Unable to save an unregistered native function in an image\n");
+				w->failed = true;
+				put_word(&w->body, NO_INDEX);
+			} else {
+				put_chars(w, w->rt->natives[index - 1].path);
+			}
+			break;
+		}
+		case string_t:
+		case hash_t:
+			break;
+		default:
+			fprintf(stderr, "Unable to save a %s in an image\n", hval_type_string(hv->type));
+			w->failed = true;
+			break;
+	}
+
+	put_members(w, hv);
+}
+
+bool image_write(runtime *rt, char *filename)
+{
+	image_writer w;
+	memset(&w, 0, sizeof(w));
+	w.rt = rt;
+	w.string_index = hash_create((hash_function) hash_hstr, (key_comparator) hstr_comparator);
+	w.hval_index = hash_create(hash_pointer, pointer_comparator);
+	w.node_index = hash_create(hash_pointer, pointer_comparator);
+	w.native_index = hash_create(hash_pointer, pointer_comparator);
+	for (int i = rt->native_count - 1; i >= 0; i--) {
+		hash_put(w.native_index, rt->natives[i].function, (void *) (uintptr_t) (i + 1));
+	}
+
+	uint32_t module_count = rt->loaded_modules != NULL ? rt->loaded_modules->size : 0;
+	w.modules = smalloc(sizeof(saved_module) * (module_count + 1));
+	if (rt->loaded_modules != NULL) {
+		LL_FOREACH(rt->loaded_modules, node) {
+			saved_module *saved = w.modules + w.module_count++;
+			saved->module = (loaded_module *) node->data;
+			saved->needed = false;
+			encode_module(&w, saved);
+		}
+	}
+
+	// hvals are numbered in the order they're reached, and then written
+	number_hval(&w, rt->top_level);
+	number_hval(&w, rt->object_root);
+	for (uint32_t i = 0; i < w.hval_count; i++) {
+		hval *hv = w.hvals[i];
+		hval_member_iterator iter;
+		hval_member_iterator_init(&iter, hv);
+		while (iter.current_key) {
+			number_hval(&w, iter.current_value);
+			hval_member_iterator_next(&iter);
+		}
+
+		if (hv->type == list_t) {
+			LL_FOREACH(hval_list_list(hv), node) {
+				number_hval(&w, (hval *) node->data);
+			}
+		} else if (hv->type == deferred_expression_t) {
+			number_hval(&w, hv->value.deferred_expression.ctx);
+			expression *expr = hv->value.deferred_expression.expr;
+			uintptr_t code = expr != NULL ? (uintptr_t) hash_get(w.node_index, expr) : 0;
+			if (code != 0) {
+				w.modules[(code >> 32) - 1].needed = true;
+			} else if (expr != NULL) {
+				fprintf(stderr, "Unable to save a function that isn't from a loaded module in an image\n");
+				w.failed = true;
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < w.module_count; i++) {
+		put_module(&w, w.modules + i);
+	}
+
+	put_word(&w.body, w.hval_count);
+	put_ref(&w, rt->top_level);
+	put_ref(&w, rt->object_root);
+	for (uint32_t i = 0; i < w.hval_count; i++) {
+		hval *hv = w.hvals[i];
+		put_word(&w.body, hv->type);
+		put_word(&w.body, hval_size(hv));
+		if (hv->type == string_t) {
+			put_string(&w, hv->value.str);
+		} else {
+			put_word(&w.body, NO_INDEX);
+		}
+		put_node(&w, hv->type == string_t ? hv : NULL);
+	}
+	for (uint32_t i = 0; i < w.hval_count && !w.failed; i++) {
+		put_hval(&w, w.hvals[i]);
+	}
+
+	// the body goes after the strings
+	size_t word_count = w.strings.count + w.body.count;
+	uint32_t *words = srealloc(w.strings.words, sizeof(uint32_t) * (word_count + 1));
+	memcpy(words + w.strings.count, w.body.words, sizeof(uint32_t) * w.body.count);
+
+	image_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, IMAGE_MAGIC, 4);
+	header.version = IMAGE_VERSION;
+	header.string_count = w.string_count;
+	header.module_count = module_count;
+	header.hval_count = w.hval_count;
+	header.word_count = word_count;
+	header.body_hash = module_cache_checksum(words, word_count * sizeof(uint32_t));
+
+	// written under a temporary name and renamed into place, as module
+	// cache files are
+	bool written = false;
+	char *temp = smalloc(strlen(filename) + 16);
+	sprintf(temp, "%s.%d", filename, (int) getpid());
+	FILE *out = w.failed ? NULL : fopen(temp, "wb");
+	if (out != NULL) {
+		written = fwrite(&header, sizeof(header), 1, out) == 1
+			&& fwrite(words, sizeof(uint32_t), word_count, out) == word_count;
+		written = fclose(out) == 0 && written && rename(temp, filename) == 0;
+		if (!written) {
+			perror("Unable to write image");
+			unlink(temp);
+		}
+	} else if (!w.failed) {
+		perror("Unable to write image");
+	}
+	hlog("image_write: %s: %u hvals, %u modules, %s\n", filename, w.hval_count, module_count,
+		written ? "written" : "failed");
+
+	free(temp);
+	free(words);
+	free(w.body.words);
+	free(w.hvals);
+	for (uint32_t i = 0; i < w.module_count; i++) {
+		free(w.modules[i].body.words);
+	}
+	free(w.modules);
+	hash_destroy(w.string_index, (destructor) hstr_release, NULL, NULL, NULL);
+	hash_destroy(w.hval_index, NULL, NULL, NULL, NULL);
+	hash_destroy(w.node_index, NULL, NULL, NULL, NULL);
+	hash_destroy(w.native_index, NULL, NULL, NULL, NULL);
+	return written;
+}
+
+static uint32_t get_word(image_reader *r)
+{
+	if (r->pos >= r->end) {
+		r->failed = true;
+		return NO_INDEX;
+	}
+
+	return *r->pos++;
+}
+
+static uint64_t get_wide(image_reader *r)
+{
+	uint64_t low = get_word(r);
+	return low | (uint64_t) get_word(r) << 32;
+}
+
+static uint32_t get_string_index(image_reader *r)
+{
+	uint32_t index = get_word(r);
+	if (index >= r->string_count) {
+		r->failed = true;
+		return 0;
+	}
+
+	return index;
+}
+
+static hstr *get_name(image_reader *r)
+{
+	uint32_t index = get_string_index(r);
+	if (r->failed) {
+		return NULL;
+	}
+
+	if (r->names[index] == NULL) {
+		r->names[index] = hstr_intern_len((char *) r->string_text[index], r->string_len[index]);
+	}
+
+	return r->names[index];
+}
+
+static hval *get_ref(image_reader *r)
+{
+	uint32_t kind = get_word(r);
+	uint32_t value = get_word(r);
+	if (kind == REF_NUMBER) {
+		return hval_number_create((int32_t) value, r->rt);
+	} else if (kind == REF_BOOLEAN) {
+		return hval_boolean_create(value != 0, r->rt);
+	} else if (kind == REF_HVAL && value < r->hval_count) {
+		return r->hvals[value];
+	} else if (kind != REF_NULL) {
+		r->failed = true;
+	}
+
+	return NULL;
+}
+
+/*
+ * A module and a node number in it; the module is NO_INDEX for none.
+ */
+static uint32_t get_node(image_reader *r, uint32_t *number)
+{
+	uint32_t module = get_word(r);
+	*number = get_word(r);
+	if (module != NO_INDEX && (module >= r->module_count || *number >= r->modules[module].node_count)) {
+		r->failed = true;
+		return NO_INDEX;
+	}
+
+	return module;
+}
+
+/*
+ * Modules are only used while their sources are the files they were
+ * read from, and unchanged since.
+ */
+static void get_module(image_reader *r, image_module *module)
+{
+	uint32_t index = get_string_index(r);
+	uint64_t dev = get_wide(r);
+	uint64_t ino = get_wide(r);
+	uint64_t size = get_wide(r);
+	int64_t mtime = get_wide(r);
+	int64_t mtime_nsec = get_wide(r);
+	module->node_count = get_word(r);
+	if (module->node_count != 0) {
+		module->string_count = get_word(r);
+		module->word_count = get_word(r);
+	}
+	if (r->failed || module->word_count > r->end - r->pos) {
+		r->failed = true;
+		return;
+	}
+	module->words = r->pos;
+	r->pos += module->word_count;
+
+	module->filename = smalloc(r->string_len[index] + 1);
+	memcpy(module->filename, r->string_text[index], r->string_len[index]);
+	module->filename[r->string_len[index]] = '\0';
+	if (stat(module->filename, &module->st) == -1
+			|| module->st.st_dev != dev || module->st.st_ino != ino || module->st.st_size != size
+			|| module->st.st_mtim.tv_sec != mtime || module->st.st_mtim.tv_nsec != mtime_nsec) {
+		hlog("image_read: %s has changed\n", module->filename);
+		r->failed = true;
+		return;
+	}
+
+	// a node count the body doesn't have fails its decoding, so it's
+	// only bounded here
+	if (module->node_count > module->word_count) {
+		r->failed = true;
+		return;
+	}
+	module->nodes = smalloc(sizeof(expression *) * (module->node_count + 1));
+	module->primitives = smalloc(sizeof(hval *) * (module->node_count + 1));
+	memset(module->primitives, 0, sizeof(hval *) * (module->node_count + 1));
+}
+
+/*
+ * Makes each hval, with its string if it has one, before any of them are
+ * filled in, since they refer to each other in any order.
+ */
+static void make_hval(image_reader *r, uint32_t number)
+{
+	type t = get_word(r);
+	uint32_t size = get_word(r);
+	uint32_t string = get_word(r);
+	uint32_t primitive;
+	uint32_t module = get_node(r, &primitive);
+	if (r->failed || (t != string_t && t != hash_t && t != list_t && t != deferred_expression_t && t != native_function_t)
+			|| size < (t == list_t ? sizeof(list_hval) : sizeof(hval)) || size > MEM_MAX_SMALL_SIZE
+			|| (t == string_t) != (string < r->string_count) || (module != NO_INDEX && t != string_t)) {
+		r->failed = true;
+		return;
+	}
+
+	hval *hv = hval_create_custom(size, t, r->rt);
+	memset((char *) hv + sizeof(hval), 0, size - sizeof(hval));
+	memset(&hv->value, 0, sizeof(hv->value));
+	if (t == string_t) {
+		hv->value.str = hstr_create_len((char *) r->string_text[string], r->string_len[string]);
+	} else if (t == list_t) {
+		hval_list_list(hv) = ll_create();
+	}
+
+	if (module != NO_INDEX) {
+		r->modules[module].primitives[primitive] = hv;
+	}
+
+	r->hvals[number] = hv;
+}
+
+static void get_members(image_reader *r, hval *hv)
+{
+	uint32_t layout = get_word(r);
+	if (layout == MEMBERS_SHAPED) {
+		uint32_t count = get_word(r);
+		if (count > SHAPE_MAX_SLOTS) {
+			r->failed = true;
+		}
+		for (uint32_t i = 0; i < count && !r->failed; i++) {
+			hstr *key = get_name(r);
+			hval *value = get_ref(r);
+			if (!r->failed) {
+				hval_hash_put(hv, key, value, r->rt->mem);
+			}
+		}
+		return;
+	}
+
+	uint32_t buckets = get_word(r);
+	uint32_t count = get_word(r);
+	if (r->failed || layout != MEMBERS_HASHED || count > r->end - r->pos || buckets > (1 << 24)
+			|| (buckets & (buckets - 1)) != 0 || count > buckets
+			|| (buckets > HASH_SMALL_BUCKETS && count * HASH_LOAD_DEN > buckets * HASH_LOAD_NUM)) {
+		r->failed = true;
+		return;
+	}
+	hval_members_reserve(hv, buckets);
+
+	hstr **keys = smalloc(sizeof(hstr *) * (count + 1));
+	for (uint32_t i = 0; i < count && !r->failed; i++) {
+		keys[i] = get_name(r);
+		hval *value = get_ref(r);
+		if (!r->failed) {
+			hval_hash_put(hv, keys[i], value, r->rt->mem);
+		}
+	}
+
+	// as with hash literals, the iteration is the order written, rotated
+	hash_iterator iter;
+	hash_iterator_init(&iter, hv->members);
+	uint32_t first = 0;
+	while (first < count && !r->failed && keys[first] != iter.current_key) {
+		first++;
+	}
+	for (uint32_t i = 0; i < count && !r->failed; i++) {
+		if (iter.current_key != keys[(first + i) % count]) {
+			r->failed = true;
+		}
+		hash_iterator_next(&iter);
+	}
+	free(keys);
+}
+
+static native_function find_native(image_reader *r, uint32_t index)
+{
+	for (int i = 0; i < r->rt->native_count; i++) {
+		const char *path = r->rt->natives[i].path;
+		if (strlen(path) == r->string_len[index] && memcmp(path, r->string_text[index], r->string_len[index]) == 0) {
+			return r->rt->natives[i].function;
+		}
+	}
+
+	hlog("image_read: no native function %.*s\n", (int) r->string_len[index], r->string_text[index]);
+	return NULL;
+}
+
+/*
+ * Fills in an hval, apart from its deferred expression, whose module
+ * is only read once the heap is in place; its module and number are
+ * noted in deferred instead.
+ */
+static void fill_hval(image_reader *r, hval *hv, uint32_t *deferred)
+{
+	switch (hv->type)
+	{
+		case list_t: {
+			uint32_t count = get_word(r);
+			if (count > r->end - r->pos) {
+				r->failed = true;
+			}
+			for (uint32_t i = 0; i < count && !r->failed; i++) {
+				hval *item = get_ref(r);
+				if (!r->failed) {
+					hval_list_insert_tail((list_hval *) hv, item, r->rt->mem);
+				}
+			}
+			break;
+		}
+		case deferred_expression_t:
+			hv->value.deferred_expression.ctx = get_ref(r);
+			mem_write_barrier(r->rt->mem, hv, hv->value.deferred_expression.ctx);
+			deferred[0] = get_node(r, deferred + 1);
+			break;
+		case native_function_t: {
+			uint32_t index = get_string_index(r);
+			hv->value.native_fn = r->failed ? NULL : find_native(r, index);
+			if (hv->value.native_fn == NULL) {
+				r->failed = true;
+			}
+			break;
+		}
+		default:
+			break;
+	}
+
+	if (!r->failed) {
+		get_members(r, hv);
+	}
+}
+
+/*
+ * Hvals are made with the object root unset, so none of them get a
+ * PARENT they didn't have, and with collection held off until the roots
+ * are set. Then the modules are read, making any of their primitives
+ * that weren't saved as they would have been made. Nothing changes rt
+ * until it all has worked.
+ */
+static bool read_image(image_reader *r)
+{
+	runtime *rt = r->rt;
+	for (uint32_t i = 0; i < r->module_count && !r->failed; i++) {
+		get_module(r, r->modules + i);
+	}
+
+	r->hval_count = get_word(r);
+	if (r->failed || r->hval_count > r->end - r->pos) {
+		return false;
+	}
+	r->hvals = smalloc(sizeof(hval *) * (r->hval_count + 1));
+	uint32_t *deferred = smalloc(sizeof(uint32_t) * 2 * (r->hval_count + 1));
+	const uint32_t *roots = r->pos;
+	r->pos += 4;
+
+	mem_hold_gc(rt->mem, true);
+	for (uint32_t i = 0; i < r->hval_count && !r->failed; i++) {
+		make_hval(r, i);
+	}
+	for (uint32_t i = 0; i < r->hval_count && !r->failed; i++) {
+		deferred[i * 2] = NO_INDEX;
+		fill_hval(r, r->hvals[i], deferred + i * 2);
+	}
+
+	const uint32_t *end = r->pos;
+	r->pos = roots;
+	hval *top_level = get_ref(r);
+	hval *object_root = get_ref(r);
+	r->pos = end;
+	if (!r->failed && top_level != NULL && object_root != NULL && r->pos == r->end) {
+		rt->top_level = top_level;
+		rt->object_root = object_root;
+		mem_add_gc_root(rt->mem, rt->top_level);
+		mem_add_gc_root(rt->mem, rt->object_root);
+		rt->primitive_pool = (list_hval *) hval_list_create(rt);
+		mem_add_gc_root(rt->mem, (hval *) rt->primitive_pool);
+
+		for (uint32_t i = 0; i < r->module_count && !r->failed; i++) {
+			image_module *module = r->modules + i;
+			if (module->node_count == 0) {
+				continue;
+			}
+			module->expr = module_cache_decode(rt, module->words, module->word_count,
+				module->string_count, module->primitives, module->nodes, module->node_count);
+			r->failed = module->expr == NULL;
+		}
+	} else {
+		r->failed = true;
+	}
+
+	if (!r->failed) {
+		for (uint32_t i = 0; i < r->hval_count; i++) {
+			if (deferred[i * 2] != NO_INDEX) {
+				expression *expr = r->modules[deferred[i * 2]].nodes[deferred[i * 2 + 1]];
+				r->hvals[i]->value.deferred_expression.expr = expr;
+				expr_retain(expr);
+			}
+		}
+
+		// added last first, so they're listed as they were
+		for (uint32_t i = r->module_count; i > 0; i--) {
+			image_module *module = r->modules + i - 1;
+			loaded_module *loaded = smalloc(sizeof(loaded_module));
+			loaded->filename = module->filename;
+			loaded->dev = module->st.st_dev;
+			loaded->ino = module->st.st_ino;
+			loaded->size = module->st.st_size;
+			loaded->mtime = module->st.st_mtim;
+			loaded->expr = module->expr;
+			runtime_add_module(rt, loaded);
+			module->filename = NULL;
+			module->expr = NULL;
+		}
+	} else if (rt->top_level != NULL) {
+		mem_remove_gc_root(rt->mem, rt->top_level);
+		mem_remove_gc_root(rt->mem, rt->object_root);
+		mem_remove_gc_root(rt->mem, (hval *) rt->primitive_pool);
+		rt->top_level = NULL;
+		rt->object_root = NULL;
+		rt->primitive_pool = NULL;
+	}
+
+	// whatever was made is either reachable from the roots now or garbage
+	mem_hold_gc(rt->mem, false);
+	free(deferred);
+	return !r->failed;
+}
+
+bool image_read(runtime *rt, char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		hlog("image_read: can't open %s\n", filename);
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < sizeof(image_header)) {
+		close(fd);
+		return false;
+	}
+
+	size_t size = st.st_size;
+	image_header *header = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		return false;
+	}
+
+	if (memcmp(header->magic, IMAGE_MAGIC, 4) != 0 || header->version != IMAGE_VERSION
+			|| size != sizeof(image_header) + (size_t) header->word_count * sizeof(uint32_t)
+			|| header->body_hash != module_cache_checksum(header + 1, size - sizeof(image_header))) {
+		hlog("image_read: %s isn't a usable image\n", filename);
+		munmap(header, size);
+		return false;
+	}
+
+	image_reader r;
+	memset(&r, 0, sizeof(r));
+	r.rt = rt;
+	r.pos = (const uint32_t *) (header + 1);
+	r.end = r.pos + header->word_count;
+	r.string_count = header->string_count;
+	r.module_count = header->module_count;
+	if (r.string_count > header->word_count || r.module_count > header->word_count) {
+		munmap(header, size);
+		return false;
+	}
+	r.string_text = smalloc(sizeof(char *) * (r.string_count + 1));
+	r.string_len = smalloc(sizeof(uint32_t) * (r.string_count + 1));
+	r.names = smalloc(sizeof(hstr *) * (r.string_count + 1));
+	memset(r.names, 0, sizeof(hstr *) * (r.string_count + 1));
+	r.modules = smalloc(sizeof(image_module) * (r.module_count + 1));
+	memset(r.modules, 0, sizeof(image_module) * (r.module_count + 1));
+
+	for (uint32_t i = 0; i < r.string_count && !r.failed; i++) {
+		uint32_t len = get_word(&r);
+		uint32_t words = (len + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+		if (r.failed || words > r.end - r.pos) {
+			r.failed = true;
+			break;
+		}
+
+		r.string_text[i] = (const char *) r.pos;
+		r.string_len[i] = len;
+		r.pos += words;
+	}
+
+	bool loaded = !r.failed && read_image(&r);
+	hlog("image_read: %s %s\n", filename, loaded ? "loaded" : "unusable");
+
+	for (uint32_t i = 0; i < r.module_count; i++) {
+		if (r.modules[i].expr != NULL) {
+			expr_release(r.modules[i].expr);
+		}
+		free(r.modules[i].filename);
+		free(r.modules[i].nodes);
+		free(r.modules[i].primitives);
+	}
+	for (uint32_t i = 0; i < r.string_count; i++) {
+		if (r.names[i] != NULL) {
+			hstr_release(r.names[i]);
+		}
+	}
+	free(r.modules);
+	free(r.hvals);
+	free(r.names);
+	free(r.string_len);
+	free(r.string_text);
+	munmap(header, size);
+	return loaded;
+}
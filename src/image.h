@@ -0,0 +1,32 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+#include "data.h"
+
+/*
+ * A heap image is everything reachable from a runtime's top level and
+ * object root, along with the modules it has loaded, so a runtime can be
+ * started from it rather than by registering its builtins and running
+ * those modules again. Hvals are saved by number rather than by address,
+ * and native functions by the path they're registered at, so an image can
+ * be read into any process. It's only used while its modules' sources are
+ * unchanged.
+ */
+#define IMAGE_VERSION 1
+
+/*
+ * Saves rt's heap to filename. Returns false, having said why, if there's
+ * something in it that can't be saved, such as a function defined outside
+ * of a loaded module.
+ */
+bool image_write(runtime *rt, char *filename);
+
+/*
+ * Sets up the heap of rt, which has its mem and natives but nothing else
+ * yet, from the image in filename. Returns false, with rt as it was, if
+ * the image can't be used.
+ */
+bool image_read(runtime *rt, char *filename);
+
+#endif
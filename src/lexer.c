@@ -7,9 +7,16 @@
 #include "log.h"
 #include "buffer.h"
 #include "smalloc.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 size_t token_string_size(token *token);
 void read_matching(lexer_input *li, buffer *buf, bool (*matcher)(char, buffer*));
+static const char *span_matching(lexer_input *li, const bool *matches);
+static void init_char_tables();
+static const char *skip_whitespace(const char *p, const char *end);
+static const char *find_char(const char *p, const char *end, char c);
 
 #define lexer_error(...) fputs("lexer error: ", stderr);\
 fprintf(stderr, __VA_ARGS__);\
@@ -59,15 +66,53 @@ static rule rules[] = {
 	{is_break, get_token_sequence_break}
 };
 
+/*
+ * The rules are run over every byte once, up front: rule_of gives the
+ * first rule to accept each byte, which is the one a token starting
+ * with it is read by, or NO_RULE if none does. The other tables say
+ * which bytes carry a number or an identifier on.
+ */
+#define NO_RULE 0xff
+static unsigned char rule_of[256];
+static bool numeric_char[256];
+static bool identifier_char[256];
+static bool char_tables_ready = false;
+
+static void init_char_tables()
+{
+	for (int ch = 0; ch < 256; ch++) {
+		rule_of[ch] = NO_RULE;
+		for (int i = 0; i < sizeof(rules) / sizeof(rule); i++) {
+			if (rules[i].test_input((char) ch, NULL)) {
+				rule_of[ch] = i;
+				break;
+			}
+		}
+
+		numeric_char[ch] = is_numeric((char) ch, NULL);
+		identifier_char[ch] = is_identifier((char) ch, NULL);
+	}
+
+	char_tables_ready = true;
+}
+
+/*
+ * A lexer only holds on to its current and peeked tokens, so destroyed
+ * tokens are kept here and reused rather than going back to malloc.
+ */
+static token *spare_tokens = NULL;
+
 token *token_create(token_type type)
 {
-	token *t = malloc(sizeof(token));
-	if (!t) {
-		hlog("Unable to allocate memory for token");
-		exit(1);
+	token *t = spare_tokens;
+	if (t) {
+		spare_tokens = t->value.next_spare;
+	} else {
+		t = smalloc(sizeof(token));
 	}
 
 	t->type = type;
+	t->value.string = NULL;
 	return t;
 }
 
@@ -79,7 +124,8 @@ void token_destroy(token *t, void *context)
 		{
 			hstr_release(t->value.string);
 		}
-		free(t);
+		t->value.next_spare = spare_tokens;
+		spare_tokens = t;
 	}
 }
 
@@ -160,66 +206,135 @@ size_t token_string_size(token *token)
 	}
 }
 
-token* get_next_token(lexer_input *li)
+token* get_next_token(lexer *l)
 {
+	if (!char_tables_ready) {
+		init_char_tables();
+	}
+
+	lexer_input *li = l->input;
 	while (true)
 	{
+		if (lexer_has_span(li)) {
+			li->pos = skip_whitespace(li->pos, li->end);
+		}
+
 		int ch = lexer_getc(li);
 		if (ch == -1) {
 			return NULL;
 		}
 
 		char c = (char) ch;
-		int i = 0;
-		rule *r = NULL;
-		bool matched = false;
-		token *token = NULL;
-		for (; i < sizeof(rules); i++)
-		{
-			r = rules + i;
-			if (r->test_input(c, NULL))
-			{
-				matched = true;
-				break;
-			}
-		}
-
-		if (!matched)
+		if (rule_of[ch] == NO_RULE)
 		{
 			hlog("Error: unexpected %c' (%d)", c, ch);
 			exit(1);
 		}
-		else if (r->read_token)
+
+		rule *r = rules + rule_of[ch];
+		if (!r->read_token)
 		{
 			// if no read op, the rule produces no output and should be skipped
-			buffer *buf = buffer_create(512);
-			buffer_append_char(buf, c);
-			token = r->read_token(li, buf);
-			buffer_destroy(buf);
-
-			return token;
+			continue;
+		}
+		else if (lexer_has_span(li))
+		{
+			// the token's text is all there in the input, so it's sliced
+			// out of that rather than copied through a buffer
+			return r->read_token(li, NULL);
+		}
+		else
+		{
+			buffer_shrink(l->scratch, l->scratch->len);
+			buffer_append_char(l->scratch, c);
+			return r->read_token(li, l->scratch);
 		}
-		/*} else {*/
-			/*token = token_create(r->simple_type);*/
-			/*return token;*/
-		/*}*/
 	}
 
 	return NULL;
 }
 
+/*
+ * Spaces and tabs, skipped sixteen at a time where SSE2 is available.
+ */
+static const char *skip_whitespace(const char *p, const char *end)
+{
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	while (end - p >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *) p);
+		unsigned int blank = _mm_movemask_epi8(_mm_or_si128(
+				_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)));
+		if (blank != 0xffff) {
+			return p + __builtin_ctz(~blank);
+		}
+		p += 16;
+	}
+#endif
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+
+	return p;
+}
+
+/*
+ * The first c at or after p, or end if there isn't one.
+ */
+static const char *find_char(const char *p, const char *end, char c)
+{
+#ifdef __SSE2__
+	const __m128i wanted = _mm_set1_epi8(c);
+	while (end - p >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *) p);
+		unsigned int found = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, wanted));
+		if (found != 0) {
+			return p + __builtin_ctz(found);
+		}
+		p += 16;
+	}
+#endif
+	while (p < end && *p != c) {
+		p++;
+	}
+
+	return p;
+}
+
 token *get_token_numeric(lexer_input *li, buffer *buf)
 {
-	read_matching(li, buf, is_numeric);
-	int value = atoi(buf->data);
-	token *t = malloc(sizeof(token));
-	t->type = number;
+	int value = 0;
+	if (lexer_has_span(li)) {
+		for (const char *p = span_matching(li, numeric_char); p < li->pos; p++) {
+			value = value * 10 + (*p - '0');
+		}
+	} else {
+		read_matching(li, buf, is_numeric);
+		value = atoi(buf->data);
+	}
+	token *t = token_create(number);
 	t->value.number = value;
 	return t;
 }
 
 token *get_token_string(lexer_input *li, buffer *buf)
 {
+	if (lexer_has_span(li)) {
+		// up to the first unescaped copy of the opening quote
+		const char *start = li->pos - 1;
+		const char *p = li->pos;
+		while ((p = find_char(p, li->end, *start)) < li->end && p[-1] == '\\') {
+			p++;
+		}
+		li->pos = p < li->end ? p + 1 : li->end;
+
+		size_t len = li->pos - start;
+		token *token = token_create(string);
+		token->value.string = hstr_create_len((char *) start + 1, len >= 2 ? len - 2 : 0);
+		return token;
+	}
+
 	read_matching(li, buf, is_string_incomplete);
 	char *str = buffer_substring(buf, 1, buf->len - 2);
 	/*printf("get_token_string read %d chars: '%s'\n", buf->len-2, str);*/
@@ -232,6 +347,18 @@ token *get_token_string(lexer_input *li, buffer *buf)
 
 token *get_token_identifier(lexer_input *li, buffer *buf)
 {
+	if (lexer_has_span(li)) {
+		const char *start = span_matching(li, identifier_char);
+		size_t len = li->pos - start;
+		if (len == 2 && start[0] == '-' && start[1] == '>') {
+			return token_create(fn_declaration);
+		}
+
+		token *token = token_create(identifier);
+		token->value.string = hstr_intern_len((char *) start, len);
+		return token;
+	}
+
 	read_matching(li, buf, is_identifier);
 	char *str = buffer_to_string(buf);
 	/*fprintf(stderr, "get_token_identifier: %s\n", str);*/
@@ -241,7 +368,7 @@ token *get_token_identifier(lexer_input *li, buffer *buf)
 	}
 
 	token *token = token_create(identifier);
-	token->value.string = hstr_create(str);
+	token->value.string = hstr_intern(str);
 	free(str);
 
 	return token;
@@ -310,6 +437,21 @@ void read_matching(lexer_input *li, buffer *buf, bool (*matcher)(char, buffer*))
 	}
 }
 
+/*
+ * The span version of read_matching: moves the input past the characters
+ * matches[] is true for, and returns where the token started, which is
+ * the character before them.
+ */
+static const char *span_matching(lexer_input *li, const bool *matches)
+{
+	const char *start = li->pos - 1;
+	while (li->pos < li->end && matches[(unsigned char) *li->pos]) {
+		li->pos++;
+	}
+
+	return start;
+}
+
 bool is_numeric(const char c, buffer *buf)
 {
 	return c >= '0' && c <= '9';
@@ -409,6 +551,7 @@ lexer *lexer_create(lexer_input *input)
 
 	l->input = input;
 	l->current = l->peek = NULL;
+	l->scratch = buffer_create(512);
 
 	return l;
 }
@@ -420,6 +563,7 @@ void lexer_destroy(lexer *l, bool destroy_input)
 	}
 
 	l->current = l->peek = NULL;
+	buffer_destroy(l->scratch);
 	free(l);
 }
 
@@ -434,7 +578,7 @@ token *lexer_get_next_token(lexer *l)
 		t = l->peek;
 		l->peek = NULL;
 	} else {
-		t = get_next_token(l->input);
+		t = get_next_token(l);
 	}
 
 	l->current = t;
@@ -450,7 +594,7 @@ token *lexer_current_token(lexer *l)
 token *lexer_peek_token(lexer *l)
 {
 	if (!l->peek) {
-		l->peek = get_next_token(l->input);
+		l->peek = get_next_token(l);
 	}
 
 	/*fprintf(stderr, "lexer_peek_token: %s\n", l->peek ? token_type_string(l->peek->type) : "NULL");*/
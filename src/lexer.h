@@ -9,16 +9,20 @@
 
 typedef enum { identifier, number, string, assignment, list_start, list_end, hash_start, hash_end, delim, quote, dereference, fn_declaration, sequence_break } token_type;
 
+typedef struct token token;
+
 typedef union {
 	hstr *string;
 	int number;
 	linked_list *list;
+	// the next spare token, while the token is waiting to be reused
+	token *next_spare;
 } value;
 
-typedef struct {
+struct token {
 	token_type type;
 	value value;
-} token;
+};
 
 typedef struct {
 	bool (*test_input)(char, buffer *);
@@ -30,6 +34,8 @@ typedef struct _lexer {
 	lexer_input *input;
 	token *current;
 	token *peek;
+	// holds the text of each token read from an input without a span
+	buffer *scratch;
 } lexer;
 
 #define token_string(t) (t->value.string)
@@ -38,7 +44,7 @@ const char* token_type_string_token(token *token);
 const char* token_type_string(token_type type);
 char* token_to_string(token *token);
 
-token* get_next_token(lexer_input *li);
+token* get_next_token(lexer *l);
 token* get_token_number(lexer_input *li);
 token *token_create(token_type type);
 void token_destroy(token *t, void *context);
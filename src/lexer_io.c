@@ -1,7 +1,11 @@
 #include "lexer_io.h"
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <readline/readline.h>
 
 #include "smalloc.h"
@@ -9,6 +13,9 @@
 static int lexer_file_input_getc(lexer_input *);
 static int lexer_file_input_ungetc(int c, lexer_input *input);
 static void lexer_file_input_destroy(lexer_input *input);
+static char *read_fully(int fd, size_t *size);
+
+static void lexer_string_input_destroy(lexer_input *input);
 
 static int lexer_readline_input_getc(lexer_input *);
 static int lexer_readline_input_ungetc(int c, lexer_input *input);
@@ -17,39 +24,102 @@ static void lexer_readline_input_destroy(lexer_input *input);
 lexer_input *
 lexer_file_input_create(char *file)
 {
-	FILE *fh = fopen(file, "r");
-	if (fh == NULL) {
+	int fd = open(file, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
 		perror("Unable to open file");
 		exit(1);
 	}
 
 	lexer_file_input *input = smalloc(sizeof(lexer_file_input));
-	input->fh = fh;
+	input->mapped = false;
+	// an empty file can't be mapped, and a pipe has no size up front
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		input->size = st.st_size;
+		input->text = mmap(NULL, input->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		input->mapped = input->text != MAP_FAILED;
+	}
+	if (!input->mapped) {
+		input->text = read_fully(fd, &input->size);
+	}
+	close(fd);
+
 	input->base.li_getc = lexer_file_input_getc;
 	input->base.li_ungetc = lexer_file_input_ungetc;
 	input->base.li_destroy = lexer_file_input_destroy;
+	input->base.data = input->text;
+	input->base.pos = input->text;
+	input->base.end = input->text + input->size;
 
 	return (lexer_input *) input;
 }
 
+static char *read_fully(int fd, size_t *size)
+{
+	size_t capacity = 4096;
+	char *text = smalloc(capacity);
+	*size = 0;
+	ssize_t n;
+	while ((n = read(fd, text + *size, capacity - *size)) > 0) {
+		*size += n;
+		if (*size == capacity) {
+			capacity *= 2;
+			text = srealloc(text, capacity);
+		}
+	}
+
+	if (n == -1) {
+		perror("Unable to read file");
+		exit(1);
+	}
+
+	return text;
+}
+
 static void lexer_file_input_destroy(lexer_input *input)
 {
 	lexer_file_input *lfi = (lexer_file_input *) input;
-	fclose(lfi->fh);
-	lfi->fh = NULL;
+	if (lfi->mapped) {
+		munmap(lfi->text, lfi->size);
+	} else {
+		free(lfi->text);
+	}
+	lfi->text = NULL;
 	free(lfi);
 }
 
+/*
+ * lexer_getc and lexer_ungetc read the span themselves; these are only
+ * for callers going through the function pointers.
+ */
 static int lexer_file_input_getc(lexer_input *input)
 {
-	lexer_file_input *lhf = (lexer_file_input *) input;
-	return fgetc(lhf->fh);
+	return input->pos < input->end ? (unsigned char) *input->pos++ : EOF;
 }
 
 static int lexer_file_input_ungetc(int c, lexer_input *input)
 {
-	lexer_file_input *lfi = (lexer_file_input *) input;
-	return ungetc(c, lfi->fh);
+	input->pos--;
+	return c;
+}
+
+lexer_input *
+lexer_string_input_create(const char *text, size_t size)
+{
+	lexer_input *input = smalloc(sizeof(lexer_input));
+	input->li_getc = lexer_file_input_getc;
+	input->li_ungetc = lexer_file_input_ungetc;
+	input->li_destroy = lexer_string_input_destroy;
+	input->data = text;
+	input->pos = text;
+	input->end = text + size;
+
+	return input;
+}
+
+static void lexer_string_input_destroy(lexer_input *input)
+{
+	free(input);
 }
 
 lexer_input *
@@ -59,6 +129,9 @@ lexer_readline_input_create()
 	input->base.li_getc = lexer_readline_input_getc;
 	input->base.li_ungetc = lexer_readline_input_ungetc;
 	input->base.li_destroy = lexer_readline_input_destroy;
+	input->base.data = NULL;
+	input->base.pos = NULL;
+	input->base.end = NULL;
 
 	input->buf = NULL;
 	input->buf_size = 0;
@@ -1,5 +1,6 @@
 #ifndef LEXER_IO_H
 #define LEXER_IO_H
+#include <stdbool.h>
 #include <stdio.h>
 
 struct _lexer_input;
@@ -9,11 +10,22 @@ struct _lexer_input {
 	int (*li_getc)(lexer_input *);
 	int (*li_ungetc)(int c, lexer_input *);
 	void (*li_destroy)(lexer_input *);
+	// inputs holding all of their text in memory expose it as the span
+	// from data to end, read up to pos, so the lexer can scan it in
+	// place; data is NULL for the others
+	const char *data;
+	const char *pos;
+	const char *end;
 };
 
+/*
+ * A file's text, mapped if it's a regular file, or else read in whole.
+ */
 typedef struct {
 	lexer_input base;
-	FILE *fh;
+	char *text;
+	size_t size;
+	bool mapped;
 } lexer_file_input;
 
 typedef struct {
@@ -23,8 +35,11 @@ typedef struct {
 	int index;
 } lexer_readline_input;
 
-#define lexer_getc(li) (li->li_getc(li))
-#define lexer_ungetc(c, li) (li->li_ungetc(c, li))
+#define lexer_has_span(li) ((li)->data != NULL)
+#define lexer_getc(li) (lexer_has_span(li) \
+		? ((li)->pos < (li)->end ? (unsigned char) *(li)->pos++ : EOF) \
+		: (li)->li_getc(li))
+#define lexer_ungetc(c, li) (lexer_has_span(li) ? ((li)->pos--, (c)) : (li)->li_ungetc(c, li))
 #define lexer_input_destroy(li) (li->li_destroy(li))
 
 lexer_input *
@@ -33,4 +48,10 @@ lexer_file_input_create(char *file);
 lexer_input *
 lexer_readline_input_create();
 
+/*
+ * Lexes text already in memory, which the input doesn't own.
+ */
+lexer_input *
+lexer_string_input_create(const char *text, size_t size);
+
 #endif
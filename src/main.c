@@ -1,18 +1,44 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include "image.h"
 #include "lexer.h"
 #include "lexer_io.h"
 #include "log.h"
 #include "runtime.h"
 #include "linked_list.h"
 
+/*
+ * folly --save-image IMAGE [MODULE...] loads each module and saves the
+ * heap, which FOLLY_IMAGE=IMAGE then starts runtimes from.
+ */
+static int save_image(runtime *r, char *filename, int count, char **modules)
+{
+	for (int i = 0; i < count; i++) {
+		if (!runtime_load_module(r, modules[i])) {
+			fprintf(stderr, "Unable to load %s\n", modules[i]);
+			return 1;
+		}
+	}
+
+	return image_write(r, filename) ? 0 : 1;
+}
+
 int main(int argc, char **argv)
 {
 	hlog_init("parsify.log");
 
 	runtime_init_globals();
 	runtime *r = runtime_create();
+
+	if (argc >= 3 && strcmp(argv[1], "--save-image") == 0) {
+		int status = save_image(r, argv[2], argc - 3, argv + 3);
+		runtime_destroy(r);
+		runtime_destroy_globals();
+		hlog_shutdown();
+		return status;
+	}
 	
 	lexer_input *input = NULL;
 	bool trace = false;
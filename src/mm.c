@@ -1,7 +1,13 @@
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include "config.h"
 #include "linked_list.h"
 #include "log.h"
@@ -9,7 +15,11 @@
 #include "smalloc.h"
 #include "type.h"
 
-#define DEFAULT_CHUNK_SIZE 512
+#ifdef __GNUC__
+#define gc_prefetch(p) __builtin_prefetch(p)
+#else
+#define gc_prefetch(p)
+#endif
 
 #if GC_REPORTING
 #define GC_LOG(...) (fprintf(stderr, __VA_ARGS__))
@@ -17,132 +27,304 @@
 #define GC_LOG(...)
 #endif
 
-void mark(hval *hv);
-void sweep(mem *m);
-chunk *chunk_create(size_t element_size, int count);
+static void shade_young(mem *m, hval *hv);
+static void gc_push_gray(mem *m, hval *hv);
+static void mark_children(mem *m, hval *hv, void (*mark_fn)(mem *, hval *));
+static void sweep_chunk(mem *m, chunk *chnk);
+static void sweep_nursery(mem *m);
+static void promote_nursery(mem *m);
+static void gc_full(mem *m);
+static void gc_begin_cycle(mem *m);
+static void gc_begin_mark(mem *m);
+static void gc_end_mark(mem *m);
+static bool gc_mark_step(mem *m, struct timespec *deadline);
+static bool gc_sweep_step(mem *m, struct timespec *deadline);
+static void gc_finish_sweep(mem *m);
+static bool gc_drain_gray(mem *m, void (*shade_fn)(mem *, hval *), struct timespec *deadline);
+static bool gc_deadline_passed(struct timespec *deadline);
+static void gc_shade_roots(mem *m);
+static void gc_end_full(mem *m, size_t live_bytes);
+static void gc_forget_remembered(mem *m);
+static chunk *chunk_create(mem *m, size_t element_size);
+static void chunk_list_add(chunk_list *list, chunk *chnk);
+static void chunk_release(mem *m, chunk *chnk);
+static int chunk_live(chunk *chnk);
 static hval *mem_alloc_helper(size_t size, mem *m, bool run_gc);
+static void sweep_free(mem *m, chunk *chnk, hval *hv);
+static void chunk_make_available(mem *m, chunk *chnk);
+static gc_pool *gc_pool_create(mem *m, int size);
+static void gc_pool_destroy(gc_pool *pool);
+static void gc_parallel_mark(mem *m);
+static chunk *chunk_alloc(mem *m, size_t element_size, size_t bytes);
+static void chunk_destroy(mem *m, chunk *chnk);
+static hval *mem_alloc_large(size_t size, mem *m);
+static void mem_release_large(mem *m, chunk *chnk);
+static unsigned int hash_root(void *root);
+static bool root_comparator(hval *a, hval *b);
+static size_t gc_sweep_large(mem *m);
+#if MEM_GUARDS
+static void mem_guard_set(hval *hv, size_t size);
+static void mem_guard_check(hval *hv);
+#endif
+
+// 8 bytes apart up to 64, then four steps per doubling
+static const size_t size_classes[MEM_SIZE_CLASSES] = {
+	16, 24, 32, 40, 48, 56, 64,
+	80, 96, 112, 128,
+	160, 192, 224, 256,
+	320, 384, 448, 512,
+	640, 768, 896, 1024
+};
+
+// size class for each size, in steps of 8 bytes
+static unsigned char size_class_of[MEM_MAX_SMALL_SIZE / 8 + 1];
+
+static chunk *chunk_create(mem *m, size_t element_size)
+{
+	return chunk_alloc(m, element_size, CHUNK_BYTES);
+}
 
-chunk *chunk_create(size_t element_size, int count)
+/*
+ * Chunks are mapped straight from the OS, so that an empty one can be
+ * handed back. The fresh pages are zeroed, which is already a free hval
+ * in every slot, so only the header needs setting up and the rest isn't
+ * touched until it's allocated from.
+ */
+static chunk *chunk_alloc(mem *m, size_t element_size, size_t bytes)
 {
+	assert(element_size >= CHUNK_GRANULE);
+	int count = (bytes - sizeof(chunk)) / element_size;
 	GC_LOG("chunk_create: %ld * %d = %ld\n", element_size, count, element_size * count);
-	chunk *chnk = smalloc(sizeof(chunk) + count * element_size);
+	// map an extra CHUNK_BYTES, then trim it to an aligned block
+	char *raw = mmap(NULL, bytes + CHUNK_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED) {
+		perror("Unable to allocate memory for chunk");
+		exit(1);
+	}
+	char *start = (char *) (((uintptr_t) raw + CHUNK_BYTES - 1) & ~((uintptr_t) CHUNK_BYTES - 1));
+	if (start > raw) {
+		munmap(raw, start - raw);
+	}
+	munmap(start + bytes, raw + CHUNK_BYTES - start);
+
+	chunk *chnk = (chunk *) start;
+	chnk->bytes = bytes;
 	chnk->count = count;
 	chnk->element_size = element_size;
 	chnk->raw_size = count * element_size;
 	chnk->free_hint = chnk->base;
 	chnk->allocated = 0;
-	chnk->free_list = ll_create();
-	hval *hv;
-	for (char *ptr = chnk->base, *max = chnk->base + count * element_size; ptr < max; ptr += element_size) {
-		hv = (hval *) ptr;
-		hv->type = free_t;
-		hv->members = NULL;
-	}
-	
+	chnk->swept = true;
+	chnk->free_list = NULL;
+	chnk->available = false;
+	chnk->next_available = NULL;
+	m->heap_bytes += bytes;
 	return chnk;
 }
 
-mem *mem_create() {
+static void chunk_list_add(chunk_list *list, chunk *chnk)
+{
+	if (list->num_chunks == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 16;
+		list->chunks = srealloc(list->chunks, sizeof(chunk *) * list->capacity);
+	}
+
+	list->chunks[list->num_chunks++] = chnk;
+}
+
+mem *mem_create(int gc_threads) {
 	mem *m = malloc(sizeof(mem));
 	if (m == NULL) {
 		perror("Unable to allocate memory for mem");
 		exit(1);
 	}
 
-	m->gc_roots = ll_create();
+	m->gc_roots = hash_create(hash_root, (key_comparator) root_comparator);
+	m->root_stack = malloc(sizeof(hval *) * MEM_ROOT_STACK_SIZE);
+	if (m->root_stack == NULL) {
+		perror("Unable to allocate memory for root stack");
+		exit(1);
+	}
+	m->root_stack_top = m->root_stack;
+	m->root_stack_limit = m->root_stack + MEM_ROOT_STACK_SIZE;
+	m->nursery = smalloc(sizeof(hval *) * MEM_NURSERY_SIZE);
+	m->nursery_count = 0;
+	m->remembered_capacity = 256;
+	m->remembered = smalloc(sizeof(hval *) * m->remembered_capacity);
+	m->remembered_count = 0;
+	m->old_count = 0;
+	m->full_gc_threshold = MEM_MIN_FULL_GC_THRESHOLD;
+	m->heap_bytes = 0;
+	m->heap_target = MEM_MIN_HEAP_BYTES;
+	m->allocated_bytes = 0;
+	m->pause_us = 0;
+	m->phase = GC_IDLE;
+	m->allocs_since_step = 0;
+	m->gray_capacity = 1024;
+	m->gray = smalloc(sizeof(hval *) * m->gray_capacity);
+	m->gray_count = 0;
 	for (int i=0; i < sizeof(m->chunks) / sizeof(chunk_list); i++) {
 		m->chunks[i].num_chunks = 0;
+		m->chunks[i].capacity = 0;
 		m->chunks[i].chunks = NULL;
+		m->chunks[i].available = NULL;
+	}
+	m->large.num_chunks = 0;
+	m->large.capacity = 0;
+	m->large.chunks = NULL;
+	m->large.available = NULL;
+	for (int size = 0, class = 0; size <= MEM_MAX_SMALL_SIZE; size += 8) {
+		while (size_classes[class] < size) {
+			class++;
+		}
+		size_class_of[size / 8] = class;
 	}
+	m->gc_threads = gc_threads < 1 ? 1 : gc_threads > MEM_MAX_GC_THREADS ? MEM_MAX_GC_THREADS : gc_threads;
+	m->pool = m->gc_threads > 1 ? gc_pool_create(m, m->gc_threads) : NULL;
 	m->gc = false;
+	m->gc_held = false;
 	return m;
 }
 
 void mem_destroy(mem *mem) {
-	/*for (chunk *chnk = mem->chunks + mem->num_chunks - 1; chnk >= mem->chunks; chnk--) {*/
+	if (mem->pool != NULL) {
+		gc_pool_destroy(mem->pool);
+	}
+
 	for (int i = 0; i < sizeof(mem->chunks) / sizeof(chunk_list); i++) {
 		chunk_list *chunk_list = mem->chunks + i;
-		chunk *chnk = NULL;
 		for (int j = 0; j < chunk_list->num_chunks; j++) {
-			chnk = chunk_list->chunks[j];
-			hval *hv = NULL;
-			for (char *pt = chnk->base + chnk->raw_size - chnk->element_size; pt >= chnk->base; pt -= chnk->element_size) {
-				hv = (hval *) pt;
-				if (hv->type != free_t) {
-					hval_destroy(hv, mem, false);
-				}
-
-				if (hv->members != NULL) {
-					hash_destroy(hv->members, NULL, NULL, NULL, NULL);
-					hv->members = NULL;
-				}
-			}
-
-			ll_destroy(chnk->free_list, NULL, NULL);
-			free(chnk);
+			chunk_destroy(mem, chunk_list->chunks[j]);
 		}
+		free(chunk_list->chunks);
+	}
 
-		if (chunk_list->num_chunks) {
-			free(chunk_list->chunks);
-		}
+	for (int j = 0; j < mem->large.num_chunks; j++) {
+		chunk_destroy(mem, mem->large.chunks[j]);
 	}
+	free(mem->large.chunks);
 
 	/*free(mem->chunks);*/
-	ll_destroy(mem->gc_roots, NULL, NULL);
+	hash_destroy(mem->gc_roots, NULL, NULL, NULL, NULL);
+	free(mem->root_stack);
+	free(mem->nursery);
+	free(mem->remembered);
+	free(mem->gray);
 	free(mem);
 }
 
-hval *chunk_get_free(chunk *chnk)
+static void chunk_destroy(mem *m, chunk *chnk)
 {
-	if (chnk->allocated == chnk->count) {
-		return NULL;
+	// nothing past the free hint has ever been allocated
+	for (char *pt = chnk->free_hint - chnk->element_size; pt >= chnk->base; pt -= chnk->element_size) {
+		hval *hv = (hval *) pt;
+		if (hv->type != free_t) {
+			hval_destroy(hv, m, false);
+		}
+
+		if (hv->members != NULL) {
+			hash_destroy(hv->members, NULL, NULL, NULL, NULL);
+			hv->members = NULL;
+		}
+
+		free(hv->slots);
+		hv->slots = NULL;
 	}
 
-	hval *hv = NULL;
-	if (chnk->free_list->size > 0) {
-		hv = (hval *) chnk->free_list->head->data;
-		ll_remove_first(chnk->free_list, hv);
-		chnk->allocated++;
-		return hv;
+	m->heap_bytes -= chnk->bytes;
+	munmap(chnk, chnk->bytes);
+}
+
+/*
+ * Takes a free slot from the chunk, sweeping it first if the last
+ * collection hasn't got round to it yet.
+ */
+hval *chunk_get_free(mem *m, chunk *chnk)
+{
+	if (!chnk->swept) {
+		sweep_chunk(m, chnk);
 	}
 
-	if (chnk->free_hint < chnk->base + chnk->raw_size - chnk->element_size && ((hval *)chnk->free_hint)->type == free_t) {
-		hval *hv = (hval *) chnk->free_hint;
+	hval *hv = chnk->free_list;
+	if (hv != NULL) {
+		chnk->free_list = hv->value.next_free;
+	} else if (chnk->free_hint < chnk->base + chnk->raw_size) {
+		hv = (hval *) chnk->free_hint;
 		chnk->free_hint += chnk->element_size;
-		chnk->allocated++;
-		return hv;
+	} else {
+		return NULL;
 	}
 
-	return NULL;
+	chnk->allocated++;
+	chunk_word(chnk->in_use, hv) |= chunk_mask(hv);
+	return hv;
 }
 
 hval *mem_alloc(size_t size, mem *m) {
-	hval *p = mem_alloc_helper(size, m, true);
+	if (m->phase != GC_IDLE && m->pause_us > 0 && !m->gc_held && ++m->allocs_since_step >= MEM_GC_STEP_ALLOCS) {
+		m->allocs_since_step = 0;
+		gc_step(m);
+	}
+
+	if (m->phase != GC_MARKING && m->nursery_count == MEM_NURSERY_SIZE) {
+		if (m->gc_held) {
+			promote_nursery(m);
+		} else {
+			gc_minor(m);
+		}
+	}
+
+#if MEM_GUARDS
+	size_t requested = size;
+	size += MEM_GUARD_BYTES;
+#endif
+	hval *p = size > MEM_MAX_SMALL_SIZE
+		? mem_alloc_large(size, m)
+		: mem_alloc_helper(size, m, m->phase != GC_MARKING && !m->gc_held);
+#if MEM_GUARDS
+	mem_guard_set(p, requested);
+#endif
+	p->remembered = false;
+	if (m->phase == GC_MARKING) {
+		// allocated black
+		mem_set_mark(p);
+		p->old = true;
+		m->marked_count++;
+	} else {
+		p->old = false;
+		m->nursery[m->nursery_count++] = p;
+		m->allocated_bytes += size;
+	}
 	GC_LOG("mem_alloc created %p (size %ld)\n", p, size);
 	return p;
 }
 
 static hval *mem_alloc_helper(size_t size, mem *m, bool run_gc)
 {
-	unsigned int bucket = 0;
-	unsigned int bucket_size = 8;
-	while (bucket_size < size) {
-		bucket++;
-		bucket_size = bucket_size << 1;
-	}
+	unsigned int bucket = size_class_of[(size + 7) / 8];
+	size_t bucket_size = size_classes[bucket];
 
 	chunk_list *chunk_list = m->chunks + bucket;
 	hval *hv = NULL;
-	for (int i=chunk_list->num_chunks - 1; i >= 0; i--) {
-		chunk *chnk = chunk_list->chunks[i];
-		hv = chunk_get_free(chnk);
+	while (chunk_list->available != NULL) {
+		chunk *chnk = chunk_list->available;
+		hv = chunk_get_free(m, chnk);
 		if (hv) {
 			return hv;
 		}
+
+		// full; it goes back on the list when a sweep frees something in it
+		chunk_list->available = chnk->next_available;
+		chnk->available = false;
 	}
 
 	if (run_gc) {
-		gc(m);
+		// only grow the heap once a minor collection hasn't made room,
+		// nor a full one if the heap is already as big as it should be
+		gc_minor(m);
+		if (m->phase != GC_MARKING && m->heap_bytes + CHUNK_BYTES > m->heap_target) {
+			gc_full(m);
+		}
 		return mem_alloc_helper(size, m, false);
 	}
 
@@ -151,21 +333,29 @@ static hval *mem_alloc_helper(size_t size, mem *m, bool run_gc)
 	debug_heap_output(m);
 #endif
 
-	if (chunk_list->chunks) {
-#if GC_REPORTING
-		printf("reallocating existing chunks\n");
-#endif
-		chunk_list->chunks = realloc(chunk_list->chunks, sizeof(chunk *) * (chunk_list->num_chunks + 1));
-	} else {
-		chunk_list->chunks = malloc(sizeof(chunk *));
+	// grow each size class by half again, as far as the heap target
+	// allows, so a class that keeps growing doesn't collect every chunk
+	int grow = chunk_list->num_chunks / 2;
+	int room = m->heap_bytes < m->heap_target ? (m->heap_target - m->heap_bytes) / CHUNK_BYTES : 0;
+	if (grow > room) {
+		grow = room;
+	}
+	if (grow < 1) {
+		grow = 1;
 	}
 
-	chunk_list->chunks[chunk_list->num_chunks] = chunk_create(bucket_size, DEFAULT_CHUNK_SIZE);
-	hv = chunk_get_free(chunk_list->chunks[chunk_list->num_chunks]);
+	chunk *chnk = NULL;
+	for (int i = 0; i < grow; i++) {
+		chnk = chunk_create(m, bucket_size);
+		chnk->size_class = bucket;
+		chunk_list_add(chunk_list, chnk);
+		chunk_make_available(m, chnk);
+	}
+	// the last one made is at the head of the available list
+	hv = chunk_get_free(m, chnk);
 	if (hv == NULL) {
 		exit(2);
 	}
-	chunk_list->num_chunks++;
 #if GC_REPORTING
 	printf("grew heap:\n");
 	debug_heap_output(m);
@@ -173,119 +363,994 @@ static hval *mem_alloc_helper(size_t size, mem *m, bool run_gc)
 	return hv;
 }
 
+/*
+ * Large hvals get a chunk of their own, with room for exactly one.
+ */
+static hval *mem_alloc_large(size_t size, mem *m)
+{
+	size_t bytes = (sizeof(chunk) + size + CHUNK_BYTES - 1) & ~((size_t) CHUNK_BYTES - 1);
+	if (m->phase != GC_MARKING && !m->gc_held && m->heap_bytes + bytes > m->heap_target) {
+		gc_full(m);
+	}
+
+	chunk *chnk = chunk_alloc(m, size, bytes);
+	chnk->size_class = MEM_LARGE_CLASS;
+	chunk_list_add(&m->large, chnk);
+	return chunk_get_free(m, chnk);
+}
+
+static void mem_release_large(mem *m, chunk *chnk)
+{
+	for (int i = 0; i < m->large.num_chunks; i++) {
+		if (m->large.chunks[i] == chnk) {
+			m->large.chunks[i] = m->large.chunks[--m->large.num_chunks];
+			break;
+		}
+	}
+
+	chunk_destroy(m, chnk);
+}
+
 void mem_free(mem *m, hval *hv) {
 	// TODO consider resetting the free hint?
 	GC_LOG("mem_free: %p\n", hv);
+#if MEM_GUARDS
+	mem_guard_check(hv);
+#endif
 	hv->type = free_t;
-	/*assert(ll_search_simple(m->gc_roots, hv) == NULL);*/
+	chunk_word(chunk_of(hv)->in_use, hv) &= ~chunk_mask(hv);
+	if (hv->old && m != NULL) {
+		m->old_count--;
+	}
+	hv->old = false;
+}
+
+static unsigned int hash_root(void *root)
+{
+	// hvals are at least CHUNK_GRANULE apart, so the low bits are all zero
+	uintptr_t bits = (uintptr_t) root / CHUNK_GRANULE;
+	return (unsigned int) (bits ^ (bits >> 32)) * 2654435761u;
+}
+
+static bool root_comparator(hval *a, hval *b)
+{
+	return a == b;
 }
 
+/*
+ * For roots that outlive the C call adding them; anything scoped to a
+ * call should go on the root stack. A root added more than once stays
+ * one until it's been removed as many times.
+ */
 void mem_add_gc_root(mem *m, hval *root) {
-	/*hlog("add_gc_root: %p\n", root);*/
-	ll_node *node = ll_search_simple(m->gc_roots, root);
+	if (root == NULL || hval_is_immediate(root)) {
+		return;
+	}
 
-	ll_insert_head(m->gc_roots, root);
+	intptr_t count = (intptr_t) hash_get(m->gc_roots, root);
+	hash_put(m->gc_roots, root, (void *) (count + 1));
 }
 
 void mem_remove_gc_root(mem *m, hval *root) {
-	int index = ll_remove_first(m->gc_roots, root);
-	assert(index != -1);
+	if (root == NULL || hval_is_immediate(root)) {
+		return;
+	}
+
+	intptr_t count = (intptr_t) hash_get(m->gc_roots, root);
+	assert(count > 0);
+	if (count == 1) {
+		hash_remove(m->gc_roots, root);
+	} else {
+		hash_put(m->gc_roots, root, (void *) (count - 1));
+	}
+}
+
+/*
+ * Roots pushed here are dropped by resetting root_stack_top to where it
+ * was before, rather than one at a time.
+ */
+void mem_push_root(mem *m, hval *root) {
+	if (m->root_stack_top == m->root_stack_limit) {
+		fprintf(stderr, "stack overflow\n");
+		exit(1);
+	}
+
+	*m->root_stack_top++ = root;
+}
+
+void mem_remember(mem *m, hval *holder) {
+	if (m->remembered_count == m->remembered_capacity) {
+		m->remembered_capacity *= 2;
+		m->remembered = srealloc(m->remembered, sizeof(hval *) * m->remembered_capacity);
+	}
+
+	holder->remembered = true;
+	m->remembered[m->remembered_count++] = holder;
 }
 
 void gc_with_temp_root(mem *m, hval *root) {
-	if (root) {
-		mem_add_gc_root(m, root);
-		gc(m);
-		mem_remove_gc_root(m, root);
-	} else {
-		gc(m);
+	hval **base = m->root_stack_top;
+	mem_push_root(m, root);
+	gc(m);
+	m->root_stack_top = base;
+}
+
+/*
+ * A budget of 0 makes full collections stop the world, as they always
+ * used to. Otherwise they run incrementally, pausing for at most about
+ * max_pause_us at a time; the final re-scan of the roots isn't bounded.
+ */
+void mem_set_gc_pause(mem *m, long max_pause_us) {
+	if (max_pause_us <= 0 && m->phase == GC_MARKING) {
+		gc_mark_step(m, NULL);
 	}
+
+	m->pause_us = max_pause_us > 0 ? max_pause_us : 0;
 }
 
 void gc(mem *m) {
 	m->gc = true;
+	if (m->phase == GC_MARKING) {
+		// finish the incremental collection under way instead
+		gc_mark_step(m, NULL);
+		m->gc = false;
+		return;
+	}
+
+	gc_begin_mark(m);
+#if GC_REPORTING
+	fprintf(stderr, "%d gc roots, %ld on the stack\n", m->gc_roots->size, m->root_stack_top - m->root_stack);
+#endif
+	if (m->pool != NULL) {
+		gc_parallel_mark(m);
+	} else {
+		gc_shade_roots(m);
+		gc_drain_gray(m, mem_shade, NULL);
+	}
+	gc_end_mark(m);
+	m->gc = false;
+}
+
+/*
+ * Collects only the hvals allocated since the last collection. Old hvals
+ * count as reachable without being traced, apart from those in the
+ * remembered set, whose members are traced for young hvals. Survivors are
+ * promoted where they are, since nothing can be moved: C code holds
+ * pointers to hvals all over.
+ */
+void gc_minor(mem *m) {
+	m->gc = true;
+	GC_LOG("gc_minor: %d young, %d remembered\n", m->nursery_count, m->remembered_count);
+	for (hash_entry *entry = m->gc_roots->table, *max = entry + m->gc_roots->buckets; entry < max; entry++) {
+		if (entry->key != NULL) {
+			shade_young(m, entry->key);
+		}
+	}
+
+	for (hval **root = m->root_stack; root < m->root_stack_top; root++) {
+		shade_young(m, *root);
+	}
+
+	for (int i = 0; i < m->remembered_count; i++) {
+		hval *hv = m->remembered[i];
+		hv->remembered = false;
+		if (hv->type != free_t && hv->old) {
+			mark_children(m, hv, shade_young);
+		}
+	}
+	m->remembered_count = 0;
+	gc_drain_gray(m, shade_young, NULL);
+
+	sweep_nursery(m);
+	m->gc = false;
+
+	if (m->old_count > m->full_gc_threshold
+			|| (m->heap_bytes > MEM_MIN_HEAP_BYTES && m->allocated_bytes > m->heap_bytes)) {
+		gc_full(m);
+	}
+}
+
+/*
+ * Runs a full collection, or starts one if they're incremental.
+ */
+static void gc_full(mem *m) {
+	if (m->pause_us > 0) {
+		gc_begin_cycle(m);
+	} else {
+		gc(m);
+	}
+}
+
+/*
+ * Starts an incremental full collection. The nursery and remembered set
+ * are folded into it: it marks young and old alike, and everything it
+ * keeps ends up old. Minor collections wait until marking is done.
+ */
+static void gc_begin_cycle(mem *m) {
+	GC_LOG("gc_begin_cycle: %d old\n", m->old_count);
+	gc_begin_mark(m);
+	m->allocs_since_step = 0;
+	gc_shade_roots(m);
+}
+
+/*
+ * Marks start out clear everywhere, so any sweep still pending from the
+ * last collection has to be finished first.
+ */
+static void gc_begin_mark(mem *m) {
+	gc_finish_sweep(m);
+	gc_forget_remembered(m);
+	m->nursery_count = 0;
+	m->marked_count = 0;
+	m->phase = GC_MARKING;
+}
+
+/*
+ * Everything marked has survived and was made old as it was marked, so
+ * old_count and the live bytes are known without sweeping. Chunks with
+ * nothing marked are unmapped while the heap is over its target; the
+ * rest are left to be swept lazily.
+ */
+static void gc_end_mark(mem *m) {
+	GC_LOG("gc mark done: %d marked\n", m->marked_count);
+	size_t live_bytes = gc_sweep_large(m);
 	for (int i = 0; i < sizeof(m->chunks) / sizeof(chunk_list); i++) {
 		for (int j = 0; j < m->chunks[i].num_chunks; j++) {
-			chunk *chunk = m->chunks[i].chunks[j];
-			for (char *pt = chunk->base, *max = chunk->base + chunk->raw_size; pt < max; pt += chunk->element_size) {
-				((hval *) pt)->reachable = false;
+			chunk *chnk = m->chunks[i].chunks[j];
+			live_bytes += chunk_live(chnk) * chnk->element_size;
+		}
+	}
+
+	m->old_count = m->marked_count;
+	gc_end_full(m, live_bytes);
+
+	for (int i = 0; i < sizeof(m->chunks) / sizeof(chunk_list); i++) {
+		chunk_list *list = m->chunks + i;
+		int kept = 0;
+		for (int j = 0; j < list->num_chunks; j++) {
+			chunk *chnk = list->chunks[j];
+			if (m->heap_bytes > m->heap_target && chunk_live(chnk) == 0) {
+				chunk_release(m, chnk);
+			} else {
+				list->chunks[kept++] = chnk;
 			}
 		}
+		list->num_chunks = kept;
+
+		// any chunk may have garbage in it now, so allocation has to be
+		// able to reach them all
+		list->available = NULL;
+		for (int j = list->num_chunks - 1; j >= 0; j--) {
+			chunk *chnk = list->chunks[j];
+			chnk->swept = false;
+			chnk->available = false;
+			chunk_make_available(m, chnk);
+		}
 	}
 
-#if GC_REPORTING
-	fprintf(stderr, "%d gc roots\n", m->gc_roots->size);
-#endif
-	ll_node *node = m->gc_roots->head;
-	while (node) {
-		mark(node->data);
-		node = node->next;
+	// leave room to grow before the heap target calls for another full
+	// collection, even when what's left is too fragmented to give back
+	if (m->heap_target < m->heap_bytes + m->heap_bytes / 4) {
+		m->heap_target = m->heap_bytes + m->heap_bytes / 4;
 	}
 
-	sweep(m);
+	m->sweep_class = 0;
+	m->sweep_chunk = 0;
+	m->phase = GC_SWEEPING;
+}
+
+/*
+ * Does one bounded slice of the collection in progress: some marking,
+ * or sweeping a few chunks ahead of allocation.
+ */
+void gc_step(mem *m) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += (m->pause_us % 1000000) * 1000;
+	deadline.tv_sec += m->pause_us / 1000000 + deadline.tv_nsec / 1000000000;
+	deadline.tv_nsec %= 1000000000;
+	m->gc = true;
+	if (m->phase == GC_MARKING) {
+		gc_mark_step(m, &deadline);
+	} else if (m->phase == GC_SWEEPING) {
+		gc_sweep_step(m, &deadline);
+	}
 	m->gc = false;
 }
 
-void mark(hval *hv) {
-	if (!hv || hv->reachable) {
+/*
+ * Marks until the deadline passes or marking is done. A NULL deadline
+ * runs it to completion.
+ */
+static bool gc_mark_step(mem *m, struct timespec *deadline) {
+	if (!gc_drain_gray(m, mem_shade, deadline)) {
+		return false;
+	}
+
+	// the roots aren't behind a write barrier, so look at them again
+	// now that everything else is black
+	gc_shade_roots(m);
+	gc_drain_gray(m, mem_shade, NULL);
+	gc_end_mark(m);
+	return true;
+}
+
+/*
+ * Sweeps the chunks allocation hasn't reached yet, until the deadline
+ * passes or they're all done.
+ */
+static bool gc_sweep_step(mem *m, struct timespec *deadline) {
+	chunk_list *lists = m->chunks;
+	int classes = sizeof(m->chunks) / sizeof(chunk_list);
+	for (; m->sweep_class < classes; m->sweep_class++, m->sweep_chunk = 0) {
+		for (; m->sweep_chunk < lists[m->sweep_class].num_chunks; m->sweep_chunk++) {
+			chunk *chnk = lists[m->sweep_class].chunks[m->sweep_chunk];
+			if (!chnk->swept) {
+				sweep_chunk(m, chnk);
+			}
+
+			if (gc_deadline_passed(deadline)) {
+				m->sweep_chunk++;
+				return false;
+			}
+		}
+	}
+
+	GC_LOG("gc sweep done\n");
+	m->phase = GC_IDLE;
+	return true;
+}
+
+static void gc_finish_sweep(mem *m) {
+	if (m->phase == GC_SWEEPING) {
+		gc_sweep_step(m, NULL);
+	}
+}
+
+/*
+ * Blackens gray hvals, shading their children with shade_fn, until the
+ * gray stack is empty or the deadline passes. Returns whether it emptied.
+ * The stack replaces recursion, so deep lists and long __parent__ chains
+ * can't run the C stack out.
+ */
+static bool gc_drain_gray(mem *m, void (*shade_fn)(mem *, hval *), struct timespec *deadline) {
+	while (m->gray_count > 0) {
+		for (int n = 0; n < 64 && m->gray_count > 0; n++) {
+			hval *hv = m->gray[--m->gray_count];
+			// the next one out is usually a sibling, so start loading it
+			// while this one is scanned
+			if (m->gray_count > 0) {
+				gc_prefetch(m->gray[m->gray_count - 1]);
+			}
+
+			// freed since it was shaded
+			if (hv->type != free_t) {
+				mark_children(m, hv, shade_fn);
+			}
+		}
+
+		if (gc_deadline_passed(deadline)) {
+			return m->gray_count == 0;
+		}
+	}
+
+	return true;
+}
+
+static bool gc_deadline_passed(struct timespec *deadline) {
+	if (deadline == NULL) {
+		return false;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > deadline->tv_sec
+		|| (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+static void gc_shade_roots(mem *m) {
+	for (hash_entry *entry = m->gc_roots->table, *max = entry + m->gc_roots->buckets; entry < max; entry++) {
+		if (entry->key != NULL) {
+			mem_shade(m, entry->key);
+		}
+	}
+
+	for (hval **root = m->root_stack; root < m->root_stack_top; root++) {
+		mem_shade(m, *root);
+	}
+}
+
+/*
+ * After a full collection everything is old, so there is nothing for the
+ * nursery or the remembered set to track. The next one is due once the
+ * old hvals or the heap have grown by MEM_HEAP_LIVE_RATIO.
+ */
+static void gc_end_full(mem *m, size_t live_bytes) {
+	m->nursery_count = 0;
+	m->allocated_bytes = 0;
+	gc_forget_remembered(m);
+	m->full_gc_threshold = m->old_count * MEM_HEAP_LIVE_RATIO;
+	if (m->full_gc_threshold < MEM_MIN_FULL_GC_THRESHOLD) {
+		m->full_gc_threshold = MEM_MIN_FULL_GC_THRESHOLD;
+	}
+
+	m->heap_target = live_bytes * MEM_HEAP_LIVE_RATIO;
+	if (m->heap_target < MEM_MIN_HEAP_BYTES) {
+		m->heap_target = MEM_MIN_HEAP_BYTES;
+	}
+}
+
+static void gc_forget_remembered(mem *m) {
+	for (int i = 0; i < m->remembered_count; i++) {
+		m->remembered[i]->remembered = false;
+	}
+	m->remembered_count = 0;
+}
+
+/*
+ * Turns a white hval gray. Anything a full collection marks survives it,
+ * so it's made old here rather than in the sweep.
+ */
+void mem_shade(mem *m, hval *hv) {
+	if (!hv || hval_is_immediate(hv) || mem_is_marked(hv)) {
+		return;
+	}
+
+	hv->old = true;
+	m->marked_count++;
+	gc_push_gray(m, hv);
+}
+
+/*
+ * Shading for a minor collection, which stops at old hvals.
+ */
+static void shade_young(mem *m, hval *hv) {
+	if (!hv || hval_is_immediate(hv) || hv->old || mem_is_marked(hv)) {
 		return;
 	}
 
-	hv->reachable = true;
-	if (hv->members) {
-		hash_iterator *iter = hash_iterator_create(hv->members);
-		while (iter->current_key) {
-			mark(iter->current_value);
-			hash_iterator_next(iter);
+	gc_push_gray(m, hv);
+}
+
+static void gc_push_gray(mem *m, hval *hv) {
+	if (m->gray_count == m->gray_capacity) {
+		m->gray_capacity *= 2;
+		m->gray = srealloc(m->gray, sizeof(hval *) * m->gray_capacity);
+	}
+
+	mem_set_mark(hv);
+	m->gray[m->gray_count++] = hv;
+}
+
+/*
+ * Walks the slots or the members table directly rather than through an
+ * iterator: this is the collector's inner loop.
+ */
+static void mark_children(mem *m, hval *hv, void (*mark_fn)(mem *, hval *)) {
+	if (hv->shape != NULL) {
+		for (hval **slot = hv->slots, **max = hv->slots + hv->shape->count; slot < max; slot++) {
+			mark_fn(m, *slot);
 		}
+	} else {
+		hash *members = hv->members;
+		for (hash_entry *entry = members->table, *max = members->table + members->buckets; entry < max; entry++) {
+			if (entry->key) {
+				mark_fn(m, entry->value);
+			}
+		}
+	}
 
-		hash_iterator_destroy(iter);
+	if (hv->type == deferred_expression_t) {
+		// closures keep their defining scope alive
+		mark_fn(m, hv->value.deferred_expression.ctx);
 	}
 
 	if (hv->type == list_t) {
 		/*assert(hv->value.list != NULL);*/
 		ll_node *node = hval_list_head(hv);
 		while (node) {
-			mark((hval *) node->data);
+			mark_fn(m, (hval *) node->data);
 			node = node->next;
 		}
 	}
 }
 
-void sweep(mem *mem)
+/*
+ * Frees the chunk's hvals that are in use but weren't marked, and clears
+ * its marks. Only the dead hvals are touched; the live ones were already
+ * made old by the mark.
+ */
+static void sweep_chunk(mem *m, chunk *chnk)
 {
-	for (int i = 0; i < sizeof(mem->chunks) / sizeof(chunk_list); i++) {
-		for (int j=0; j < mem->chunks[i].num_chunks; j++) {
-			chunk *chnk = mem->chunks[i].chunks[j];
-			GC_LOG("===== SWEEP CHUNK %d %p\n", j, chnk);
-			hval *hv = NULL;
-			for (char *pt = chnk->base, *max = chnk->base + chnk->raw_size; pt < max; pt += chnk->element_size) {
-				hv = (hval *) pt;
-				if (hv->type != free_t && !hv->reachable) {
-					GC_LOG("freeing unreachable %p\n", hv);
-					hval_destroy(hv, mem, false);
-					hv->type = free_t;
-					chnk->allocated--;
-					ll_insert_head(chnk->free_list, hv);
-				}
-			}
+	GC_LOG("===== SWEEP CHUNK %p\n", chnk);
+	for (int i = 0; i < CHUNK_BITMAP_WORDS; i++) {
+		uint64_t dead = chnk->in_use[i] & ~chnk->marks[i];
+		while (dead) {
+			int bit = __builtin_ctzll(dead);
+			dead &= dead - 1;
+			// the slot that starts somewhere in this bit's granule
+			size_t end = (i * 64 + bit + 1) * CHUNK_GRANULE - 1 - (chnk->base - (char *) chnk);
+			sweep_free(m, chnk, (hval *) (chnk->base + end / chnk->element_size * chnk->element_size));
+		}
+	}
+
+	memset(chnk->marks, 0, sizeof(chnk->marks));
+	chnk->swept = true;
+}
+
+/*
+ * Large hvals aren't left for the lazy sweep: each one dead frees a
+ * whole block, so they go as soon as marking is done. Returns the bytes
+ * still in use by the live ones.
+ */
+static size_t gc_sweep_large(mem *m)
+{
+	size_t live_bytes = 0;
+	for (int i = m->large.num_chunks - 1; i >= 0; i--) {
+		chunk *chnk = m->large.chunks[i];
+		hval *hv = (hval *) chnk->base;
+		if (mem_is_marked(hv)) {
+			mem_clear_mark(hv);
+			live_bytes += chnk->bytes;
+		} else if (hv->type != free_t) {
+			sweep_free(m, chnk, hv);
+		}
+	}
+
+	return live_bytes;
+}
+
+static int chunk_live(chunk *chnk)
+{
+	int live = 0;
+	for (int i = 0; i < CHUNK_BITMAP_WORDS; i++) {
+		live += __builtin_popcountll(chnk->marks[i]);
+	}
+
+	return live;
+}
+
+/*
+ * Frees what's left in a chunk with nothing marked in it, and gives its
+ * memory back.
+ */
+static void chunk_release(mem *m, chunk *chnk)
+{
+	GC_LOG("releasing empty chunk %p\n", chnk);
+	sweep_chunk(m, chnk);
+	chunk_destroy(m, chnk);
+}
+
+static void sweep_free(mem *m, chunk *chnk, hval *hv)
+{
+	GC_LOG("freeing unreachable %p\n", hv);
+	// left out of old_count when the mark missed it
+	hv->old = false;
+	hval_destroy(hv, m, false);
+	if (chnk->size_class == MEM_LARGE_CLASS) {
+		mem_release_large(m, chnk);
+		return;
+	}
+
+	hv->type = free_t;
+	chnk->allocated--;
+	hv->value.next_free = chnk->free_list;
+	chnk->free_list = hv;
+	chunk_make_available(m, chnk);
+}
+
+static void chunk_make_available(mem *m, chunk *chnk)
+{
+	if (!chnk->available) {
+		chunk_list *list = m->chunks + chnk->size_class;
+		chnk->next_available = list->available;
+		list->available = chnk;
+		chnk->available = true;
+	}
+}
+
+static void sweep_nursery(mem *m)
+{
+	for (int i = 0; i < m->nursery_count; i++) {
+		hval *hv = m->nursery[i];
+		// already freed, or an earlier entry for the same slot got to it
+		if (hv->type == free_t || hv->old) {
+			continue;
+		}
+
+		if (mem_is_marked(hv)) {
+			mem_clear_mark(hv);
+			hv->old = true;
+			m->old_count++;
+		} else {
+			sweep_free(m, chunk_of(hv), hv);
 		}
 	}
+
+	m->nursery_count = 0;
+}
+
+/*
+ * What a minor collection does with a nursery that's all reachable,
+ * without tracing it.
+ */
+static void promote_nursery(mem *m)
+{
+	for (int i = 0; i < m->nursery_count; i++) {
+		hval *hv = m->nursery[i];
+		if (hv->type != free_t && !hv->old) {
+			hv->old = true;
+			m->old_count++;
+		}
+	}
+
+	m->nursery_count = 0;
+}
+
+/*
+ * For building up a heap that's known to be reachable, such as one read
+ * from an image: while held, nothing is collected, and the nursery is
+ * promoted as it fills rather than traced. Anything that turns out to be
+ * garbage after all is found by the next full collection.
+ */
+void mem_hold_gc(mem *m, bool hold)
+{
+	m->gc_held = hold;
 }
 
 void debug_heap_output(mem *mem)
 {
+	gc_finish_sweep(mem);
 	fprintf(stderr, "Heap status:\n");
-	int total = 0;
-	size_t element_size = 8;
 	for (int i = 0; i < sizeof(mem->chunks) / sizeof(chunk_list); i++) {
-		fprintf(stderr, " %8ld-byte elements: %d\n", element_size, mem->chunks[i].num_chunks);
+		fprintf(stderr, " %8ld-byte elements: %d\n", size_classes[i], mem->chunks[i].num_chunks);
 		for (int j = 0; j < mem->chunks[i].num_chunks; j++) {
 			chunk *chnk = mem->chunks[i].chunks[j];
 			printf("  chunk %p: %6d / %6d\n", chnk, chnk->allocated, chnk->count);
 		}
+	}
+
+	fprintf(stderr, "    large elements: %d\n", mem->large.num_chunks);
+	fprintf(stderr, "heap: %ldK mapped, target %ldK\n", mem->heap_bytes / 1024, mem->heap_target / 1024);
+}
+
+#if MEM_GUARDS
+/*
+ * Fills the rest of the slot after the hval's size bytes with
+ * MEM_GUARD_PATTERN, keeping the size in the slot's last four bytes.
+ */
+static void mem_guard_set(hval *hv, size_t size)
+{
+	size_t slot = chunk_of(hv)->element_size;
+	memset((char *) hv + size, MEM_GUARD_PATTERN, slot - size - sizeof(uint32_t));
+	*(uint32_t *) ((char *) hv + slot - sizeof(uint32_t)) = size;
+}
 
-		element_size = element_size << 1;
+static void mem_guard_check(hval *hv)
+{
+	size_t slot = chunk_of(hv)->element_size;
+	uint32_t size = *(uint32_t *) ((char *) hv + slot - sizeof(uint32_t));
+	for (unsigned char *p = (unsigned char *) hv + size, *max = (unsigned char *) hv + slot - sizeof(uint32_t); p < max; p++) {
+		if (*p != MEM_GUARD_PATTERN) {
+			fprintf(stderr, "heap corruption: write past the %u bytes of hval %p\n", size, hv);
+			abort();
+		}
 	}
 }
+#endif
+
+
+/*
+ * Parallel stop-the-world marking. The thread calling gc() works as
+ * worker 0 alongside gc_threads - 1 pool threads, which sleep between
+ * collections. Sweeping is lazy, so it stays on the allocating thread.
+ *
+ * Each worker marks from a private stack. When that gets deep and the
+ * worker's shared batch is empty, it moves the top GC_STEAL_BATCH
+ * entries to the shared batch, where an idle worker can take them.
+ * Marking is done once every worker is idle at the same time: a worker
+ * takes back its own batch before going idle, so none can be left over.
+ */
+#define GC_STEAL_BATCH 256
+
+typedef enum { GC_JOB_MARK, GC_JOB_EXIT } gc_job;
 
+typedef struct gc_worker {
+	gc_pool *pool;
+	pthread_t thread;
+	hval **stack;
+	int count;
+	int capacity;
+	pthread_mutex_t lock;
+	hval *shared[GC_STEAL_BATCH];
+	int shared_count;
+	int marked;
+} gc_worker;
+
+struct gc_pool {
+	mem *mem;
+	int size;
+	gc_worker *workers;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	int generation;
+	int running;
+	gc_job job;
+	int idle;
+};
+
+static __thread gc_worker *current_worker;
+
+static void *gc_worker_main(void *arg);
+static void gc_worker_run(gc_worker *w);
+static void gc_pool_run(gc_pool *pool, gc_job job);
+
+static gc_pool *gc_pool_create(mem *m, int size)
+{
+	gc_pool *pool = smalloc(sizeof(gc_pool));
+	pool->mem = m;
+	pool->size = size;
+	pool->workers = smalloc(sizeof(gc_worker) * size);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->generation = 0;
+	pool->running = 0;
+	for (int i = 0; i < size; i++) {
+		gc_worker *w = pool->workers + i;
+		w->pool = pool;
+		w->capacity = 1024;
+		w->stack = smalloc(sizeof(hval *) * w->capacity);
+		w->count = 0;
+		pthread_mutex_init(&w->lock, NULL);
+		w->shared_count = 0;
+	}
+
+	// worker 0 is whichever thread runs the collection
+	for (int i = 1; i < size; i++) {
+		if (pthread_create(&pool->workers[i].thread, NULL, gc_worker_main, pool->workers + i) != 0) {
+			perror("Unable to start gc thread");
+			exit(1);
+		}
+	}
+
+	return pool;
+}
+
+static void gc_pool_destroy(gc_pool *pool)
+{
+	gc_pool_run(pool, GC_JOB_EXIT);
+	for (int i = 0; i < pool->size; i++) {
+		gc_worker *w = pool->workers + i;
+		if (i > 0) {
+			pthread_join(w->thread, NULL);
+		}
+		pthread_mutex_destroy(&w->lock);
+		free(w->stack);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+	free(pool->workers);
+	free(pool);
+}
+
+/*
+ * Runs job on every worker and waits for them all to finish it.
+ */
+static void gc_pool_run(gc_pool *pool, gc_job job)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->job = job;
+	pool->idle = 0;
+	pool->running = pool->size - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (job != GC_JOB_EXIT) {
+		gc_worker_run(pool->workers);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->running > 0) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void *gc_worker_main(void *arg)
+{
+	gc_worker *w = arg;
+	gc_pool *pool = w->pool;
+	int seen = 0;
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->generation == seen) {
+			pthread_cond_wait(&pool->start, &pool->lock);
+		}
+		seen = pool->generation;
+		gc_job job = pool->job;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (job != GC_JOB_EXIT) {
+			gc_worker_run(w);
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->running == 0) {
+			pthread_cond_signal(&pool->done);
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		if (job == GC_JOB_EXIT) {
+			return NULL;
+		}
+	}
+}
+
+static void gc_worker_push(gc_worker *w, hval *hv)
+{
+	if (w->count == w->capacity) {
+		w->capacity *= 2;
+		w->stack = srealloc(w->stack, sizeof(hval *) * w->capacity);
+	}
+
+	w->stack[w->count++] = hv;
+}
+
+/*
+ * Shading for a parallel mark. Two workers can reach the same hval, or
+ * hvals sharing a mark word, so the mark is set atomically and only the
+ * worker that set it pushes the hval.
+ */
+static void shade_parallel(mem *m, hval *hv)
+{
+	if (!hv || hval_is_immediate(hv)) {
+		return;
+	}
+
+	uint64_t *word = &chunk_word(chunk_of(hv)->marks, hv);
+	uint64_t mask = chunk_mask(hv);
+	if ((__atomic_load_n(word, __ATOMIC_RELAXED) & mask)
+			|| (__atomic_fetch_or(word, mask, __ATOMIC_RELAXED) & mask)) {
+		return;
+	}
+
+	hv->old = true;
+	current_worker->marked++;
+	gc_worker_push(current_worker, hv);
+}
+
+static void gc_worker_publish(gc_worker *w)
+{
+	pthread_mutex_lock(&w->lock);
+	if (w->shared_count == 0) {
+		w->count -= GC_STEAL_BATCH;
+		memcpy(w->shared, w->stack + w->count, sizeof(hval *) * GC_STEAL_BATCH);
+		__atomic_store_n(&w->shared_count, GC_STEAL_BATCH, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Takes a shared batch, trying the worker's own first.
+ */
+static bool gc_worker_steal(gc_worker *w)
+{
+	gc_pool *pool = w->pool;
+	int self = w - pool->workers;
+	for (int i = 0; i < pool->size; i++) {
+		gc_worker *victim = pool->workers + (self + i) % pool->size;
+		if (__atomic_load_n(&victim->shared_count, __ATOMIC_SEQ_CST) == 0) {
+			continue;
+		}
+
+		pthread_mutex_lock(&victim->lock);
+		int n = victim->shared_count;
+		for (int j = 0; j < n; j++) {
+			gc_worker_push(w, victim->shared[j]);
+		}
+		__atomic_store_n(&victim->shared_count, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&victim->lock);
+		if (n > 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool gc_pool_has_shared(gc_pool *pool)
+{
+	for (int i = 0; i < pool->size; i++) {
+		if (__atomic_load_n(&pool->workers[i].shared_count, __ATOMIC_SEQ_CST) > 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void gc_worker_mark(gc_worker *w)
+{
+	gc_pool *pool = w->pool;
+	while (true) {
+		while (w->count > 0) {
+			hval *hv = w->stack[--w->count];
+			if (w->count > 0) {
+				gc_prefetch(w->stack[w->count - 1]);
+			}
+
+			if (hv->type != free_t) {
+				mark_children(pool->mem, hv, shade_parallel);
+			}
+
+			if (w->count > 2 * GC_STEAL_BATCH && __atomic_load_n(&w->shared_count, __ATOMIC_RELAXED) == 0) {
+				gc_worker_publish(w);
+			}
+		}
+
+		if (gc_worker_steal(w)) {
+			continue;
+		}
+
+		__atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+		while (true) {
+			if (gc_pool_has_shared(pool)) {
+				__atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+				if (gc_worker_steal(w)) {
+					break;
+				}
+				__atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+			} else if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) == pool->size) {
+				return;
+			} else {
+				sched_yield();
+			}
+		}
+	}
+}
+
+static void gc_worker_run(gc_worker *w)
+{
+	current_worker = w;
+	gc_worker_mark(w);
+}
+
+static void gc_parallel_shade_root(mem *m, hval *hv, int *next)
+{
+	if (!hv || hval_is_immediate(hv) || mem_is_marked(hv)) {
+		return;
+	}
+
+	mem_set_mark(hv);
+	hv->old = true;
+	m->marked_count++;
+	gc_worker_push(m->pool->workers + (*next)++ % m->pool->size, hv);
+}
+
+static void gc_parallel_mark(mem *m)
+{
+	gc_pool *pool = m->pool;
+	// deal the roots out between the workers
+	int next = 0;
+	for (hash_entry *entry = m->gc_roots->table, *max = entry + m->gc_roots->buckets; entry < max; entry++) {
+		if (entry->key != NULL) {
+			gc_parallel_shade_root(m, entry->key, &next);
+		}
+	}
+	for (hval **root = m->root_stack; root < m->root_stack_top; root++) {
+		gc_parallel_shade_root(m, *root, &next);
+	}
+
+	for (int i = 0; i < pool->size; i++) {
+		pool->workers[i].marked = 0;
+	}
+	gc_pool_run(pool, GC_JOB_MARK);
+	for (int i = 0; i < pool->size; i++) {
+		m->marked_count += pool->workers[i].marked;
+	}
+}
@@ -1,18 +1,55 @@
 #ifndef MM_H
 #define MM_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include "linked_list.h"
 #include "data.h"
 
-mem *mem_create();
+#define chunk_of(hv) ((chunk *) ((uintptr_t) (hv) & ~((uintptr_t) CHUNK_BYTES - 1)))
+#define chunk_bit(hv) (((uintptr_t) (hv) & (CHUNK_BYTES - 1)) / CHUNK_GRANULE)
+#define chunk_word(bitmap, hv) ((bitmap)[chunk_bit(hv) / 64])
+#define chunk_mask(hv) ((uint64_t) 1 << (chunk_bit(hv) % 64))
+
+#define mem_is_marked(hv) ((chunk_word(chunk_of(hv)->marks, hv) & chunk_mask(hv)) != 0)
+#define mem_set_mark(hv) (chunk_word(chunk_of(hv)->marks, hv) |= chunk_mask(hv))
+#define mem_clear_mark(hv) (chunk_word(chunk_of(hv)->marks, hv) &= ~chunk_mask(hv))
+
+mem *mem_create(int gc_threads);
 void mem_destroy(mem *);
 
 hval *mem_alloc(size_t size, mem *m);
 void mem_free(mem *m, hval *v);
 void mem_add_gc_root(mem *m, hval *root);
 void mem_remove_gc_root(mem *m, hval *root);
+void mem_push_root(mem *m, hval *root);
+void mem_remember(mem *m, hval *holder);
+void mem_shade(mem *m, hval *hv);
+void mem_set_gc_pause(mem *m, long max_pause_us);
+void mem_hold_gc(mem *m, bool hold);
 void gc(mem *m);
+void gc_minor(mem *m);
+void gc_step(mem *m);
 void gc_with_temp_root(mem *m, hval *root);
 void debug_heap_output(mem *mem);
 
+/*
+ * Call after storing value into holder. A minor collection doesn't trace
+ * old hvals, so an old one that now points at a young one has to be
+ * remembered for the young one to be found. While an incremental
+ * collection is marking, a marked hval may already have been scanned, so
+ * anything stored into it is shaded rather than left white.
+ */
+#define mem_write_barrier(m, holder, value) \
+	do { \
+		if ((value) != NULL && !hval_is_immediate(value)) { \
+			if ((holder)->old && !(holder)->remembered && !(value)->old) { \
+				mem_remember((m), (holder)); \
+			} \
+			if ((m)->phase == GC_MARKING && mem_is_marked(holder) && !mem_is_marked(value)) { \
+				mem_shade((m), (value)); \
+			} \
+		} \
+	} while (0)
+
 #endif
@@ -0,0 +1,640 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "ht.h"
+#include "log.h"
+#include "module_cache.h"
+#include "resolve.h"
+#include "smalloc.h"
+#include "type.h"
+#include "modules/list.h"
+
+/*
+ * A cache file is this header followed by its body of 32-bit words: the
+ * string table, then the tree. Each string is its length and its bytes,
+ * padded out to a word. The tree is written depth first, each expression
+ * as its type and then its operands, with NO_EXPR for a missing one.
+ */
+typedef struct module_cache_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t source_size;
+	int64_t source_mtime;
+	int64_t source_mtime_nsec;
+	uint64_t source_hash;
+	uint64_t body_hash;
+	uint32_t string_count;
+	uint32_t word_count;
+} module_cache_header;
+
+#define MODULE_CACHE_MAGIC "HSPC"
+#define NO_EXPR 0xffffffffu
+#define MODULE_CACHE_MAX_BUCKETS (1 << 24)
+
+enum { PRIMITIVE_NUMBER, PRIMITIVE_STRING };
+
+typedef struct word_buffer {
+	uint32_t *words;
+	size_t count;
+	size_t capacity;
+} word_buffer;
+
+typedef struct cache_writer {
+	word_buffer strings;
+	word_buffer tree;
+	// each string written so far, to its index plus one
+	hash *string_index;
+	uint32_t string_count;
+	// each expression written, in order, when they're wanted
+	expression **nodes;
+	uint32_t node_count;
+	uint32_t node_capacity;
+	bool track_nodes;
+	bool failed;
+} cache_writer;
+
+typedef struct cache_reader {
+	runtime *rt;
+	arena *arena;
+	const uint32_t *pos;
+	const uint32_t *end;
+	uint32_t string_count;
+	const char **string_text;
+	uint32_t *string_len;
+	// interned on first use as a name
+	hstr **names;
+	// each expression read, in order, if not NULL, and the primitives to
+	// use by expression number instead of making new ones
+	expression **nodes;
+	hval **primitives;
+	uint32_t node_count;
+	uint32_t node_limit;
+	bool failed;
+} cache_reader;
+
+static char *cache_path(char *filename);
+static uint64_t fnv_hash(uint64_t h, const void *data, size_t size);
+static bool source_matches(module_cache_header *header, char *filename, struct stat *st);
+static void put_expr(cache_writer *w, expression *expr);
+static expression *get_expr(cache_reader *r);
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static char *cache_path(char *filename)
+{
+	size_t len = strlen(filename);
+	const char *suffix = len > 4 && strcmp(filename + len - 4, ".hsp") == 0
+		? MODULE_CACHE_SUFFIX : MODULE_CACHE_ALT_SUFFIX;
+	char *path = smalloc(len + strlen(suffix) + 1);
+	strcpy(path, filename);
+	strcpy(path + len, suffix);
+	return path;
+}
+
+static uint64_t fnv_hash(uint64_t h, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	for (size_t i = 0; i < size; i++) {
+		h = (h ^ p[i]) * FNV_PRIME;
+	}
+
+	return h;
+}
+
+uint64_t module_cache_checksum(const void *data, size_t size)
+{
+	return fnv_hash(FNV_OFFSET_BASIS, data, size);
+}
+
+expression *module_cache_read(runtime *rt, char *filename, struct stat *st)
+{
+	char *path = cache_path(filename);
+	int fd = open(path, O_RDONLY);
+	free(path);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	struct stat cache_st;
+	if (fstat(fd, &cache_st) == -1 || cache_st.st_size < sizeof(module_cache_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	size_t size = cache_st.st_size;
+	module_cache_header *header = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		return NULL;
+	}
+
+	expression *expr = NULL;
+	if (memcmp(header->magic, MODULE_CACHE_MAGIC, 4) == 0
+			&& header->version == MODULE_CACHE_VERSION
+			&& size == sizeof(module_cache_header) + header->word_count * sizeof(uint32_t)
+			&& header->body_hash == fnv_hash(FNV_OFFSET_BASIS, header + 1, size - sizeof(module_cache_header))
+			&& source_matches(header, filename, st)) {
+		expr = module_cache_decode(rt, (const uint32_t *) (header + 1), header->word_count,
+			header->string_count, NULL, NULL, 0);
+	}
+
+	munmap(header, size);
+	hlog("module_cache_read: %s %s\n", filename, expr ? "hit" : "miss");
+	return expr;
+}
+
+/*
+ * A source touched without being changed still has the same text, so when
+ * the mtime is off the text is hashed before the cache is given up on.
+ */
+static bool source_matches(module_cache_header *header, char *filename, struct stat *st)
+{
+	if (header->source_size != st->st_size) {
+		return false;
+	} else if (header->source_mtime == st->st_mtim.tv_sec
+			&& header->source_mtime_nsec == st->st_mtim.tv_nsec) {
+		return true;
+	} else if (st->st_size == 0) {
+		return header->source_hash == FNV_OFFSET_BASIS;
+	}
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+
+	void *text = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (text == MAP_FAILED) {
+		return false;
+	}
+
+	bool matches = header->source_hash == fnv_hash(FNV_OFFSET_BASIS, text, st->st_size);
+	munmap(text, st->st_size);
+	return matches;
+}
+
+static uint32_t get_word(cache_reader *r)
+{
+	if (r->pos >= r->end) {
+		r->failed = true;
+		return NO_EXPR;
+	}
+
+	return *r->pos++;
+}
+
+static uint32_t get_string_index(cache_reader *r)
+{
+	uint32_t index = get_word(r);
+	if (index >= r->string_count) {
+		r->failed = true;
+		return 0;
+	}
+
+	return index;
+}
+
+static hstr *get_name(cache_reader *r)
+{
+	uint32_t index = get_string_index(r);
+	if (r->failed) {
+		return NULL;
+	}
+
+	if (r->names[index] == NULL) {
+		r->names[index] = hstr_intern_len((char *) r->string_text[index], r->string_len[index]);
+	}
+
+	return r->names[index];
+}
+
+static prop_ref *get_prop_ref(cache_reader *r)
+{
+	hstr *name = get_name(r);
+	if (name == NULL) {
+		return NULL;
+	}
+
+	prop_ref *ref = prop_ref_create(r->arena, name);
+	ref->site = get_expr(r);
+	return ref;
+}
+
+/*
+ * Made just as read_string and read_number make them, and kept alive by
+ * the primitive pool in the same way. A primitive the caller already has
+ * is used as it is.
+ */
+static hval *get_primitive(cache_reader *r, uint32_t number)
+{
+	hval *primitive = NULL;
+	uint32_t kind = get_word(r);
+	if (kind == PRIMITIVE_NUMBER) {
+		primitive = hval_number_create((int32_t) get_word(r), r->rt);
+	} else if (kind == PRIMITIVE_STRING) {
+		uint32_t index = get_string_index(r);
+		if (r->failed) {
+			return NULL;
+		} else if (r->primitives != NULL && r->primitives[number] != NULL) {
+			primitive = r->primitives[number];
+			hval_list_insert_head(r->rt->primitive_pool, primitive, r->rt->mem);
+			return primitive;
+		}
+
+		hstr *str = hstr_create_len((char *) r->string_text[index], r->string_len[index]);
+		primitive = hval_string_create(str, r->rt);
+		hstr_release(str);
+	} else {
+		r->failed = true;
+		return NULL;
+	}
+
+	hval_list_insert_head(r->rt->primitive_pool, primitive, r->rt->mem);
+	return primitive;
+}
+
+static linked_list *get_list(cache_reader *r)
+{
+	linked_list *list = expr_list_create(r->arena);
+	uint32_t count = get_word(r);
+	for (uint32_t i = 0; i < count && !r->failed; i++) {
+		expr_list_append(r->arena, list, get_expr(r));
+	}
+
+	return list;
+}
+
+/*
+ * Hash literals are evaluated in the order their tables iterate, so the
+ * table is rebuilt just as it was (see put_hash_literal), and checked.
+ */
+static hash *get_hash_literal(cache_reader *r)
+{
+	hash *hash_literal = expr_hash_literal_create(r->arena);
+	uint32_t buckets = get_word(r);
+	uint32_t count = get_word(r);
+	if (r->failed || count > r->end - r->pos || buckets > MODULE_CACHE_MAX_BUCKETS
+			|| (buckets & (buckets - 1)) != 0 || count > buckets
+			|| (buckets > HASH_SMALL_BUCKETS && count * HASH_LOAD_DEN > buckets * HASH_LOAD_NUM)) {
+		r->failed = true;
+		return hash_literal;
+	}
+	hash_reserve(hash_literal, buckets);
+
+	hstr **keys = smalloc(sizeof(hstr *) * (count + 1));
+	for (uint32_t i = 0; i < count && !r->failed; i++) {
+		keys[i] = get_name(r);
+		expression *value = get_expr(r);
+		if (keys[i] != NULL) {
+			hstr_retain(keys[i]);
+			hash_put(hash_literal, keys[i], value);
+		}
+	}
+
+	// the entries were written from just after an empty bucket, so the
+	// iteration is that order rotated
+	hash_iterator iter;
+	hash_iterator_init(&iter, hash_literal);
+	uint32_t first = 0;
+	while (first < count && !r->failed && keys[first] != iter.current_key) {
+		first++;
+	}
+	for (uint32_t i = 0; i < count && !r->failed; i++) {
+		if (iter.current_key != keys[(first + i) % count]) {
+			r->failed = true;
+		}
+		hash_iterator_next(&iter);
+	}
+	free(keys);
+
+	return hash_literal;
+}
+
+static expression *get_expr(cache_reader *r)
+{
+	uint32_t type = get_word(r);
+	if (r->failed || type == NO_EXPR) {
+		return NULL;
+	} else if (type > expr_function_t) {
+		r->failed = true;
+		return NULL;
+	}
+
+	expression *expr = expr_create(r->arena, type);
+	uint32_t number = r->node_count++;
+	if (r->nodes != NULL) {
+		if (number >= r->node_limit) {
+			r->failed = true;
+			return NULL;
+		}
+		r->nodes[number] = expr;
+	}
+
+	switch (expr->type)
+	{
+		case expr_prop_ref_t:
+			expr->operation.prop_ref = get_prop_ref(r);
+			break;
+		case expr_prop_set_t:
+			expr->operation.prop_set = arena_alloc(r->arena, sizeof(prop_set));
+			expr->operation.prop_set->ref = get_prop_ref(r);
+			expr->operation.prop_set->value = get_expr(r);
+			break;
+		case expr_invocation_t:
+			expr->operation.invocation = arena_alloc(r->arena, sizeof(invocation));
+			expr->operation.invocation->function = get_expr(r);
+			expr->operation.invocation->list_args = get_expr(r);
+			expr->operation.invocation->hash_args = get_expr(r);
+			break;
+		case expr_list_literal_t:
+			expr->operation.list_literal = get_list(r);
+			break;
+		case expr_hash_literal_t:
+			expr->operation.hash_literal = get_hash_literal(r);
+			break;
+		case expr_primitive_t:
+			expr->operation.primitive = get_primitive(r, number);
+			break;
+		case expr_list_t:
+			expr->operation.expr_list = get_list(r);
+			break;
+		case expr_deferred_t:
+			expr->operation.deferred_expression = get_expr(r);
+			break;
+		case expr_function_t:
+			expr->operation.function_declaration = arena_alloc(r->arena, sizeof(function_declaration));
+			expr->operation.function_declaration->args = get_expr(r);
+			expr->operation.function_declaration->body = get_expr(r);
+			break;
+	}
+
+	return r->failed ? NULL : expr;
+}
+
+expression *module_cache_decode(runtime *rt, const uint32_t *words, size_t word_count,
+		uint32_t string_count, hval **primitives, expression **nodes, uint32_t node_count)
+{
+	cache_reader r;
+	r.rt = rt;
+	r.arena = arena_create();
+	r.pos = words;
+	r.end = words + word_count;
+	r.string_count = string_count;
+	r.string_text = smalloc(sizeof(char *) * (r.string_count + 1));
+	r.string_len = smalloc(sizeof(uint32_t) * (r.string_count + 1));
+	r.names = smalloc(sizeof(hstr *) * (r.string_count + 1));
+	memset(r.names, 0, sizeof(hstr *) * (r.string_count + 1));
+	r.nodes = nodes;
+	r.primitives = nodes != NULL ? primitives : NULL;
+	r.node_count = 0;
+	r.node_limit = node_count;
+	r.failed = false;
+
+	for (uint32_t i = 0; i < r.string_count && !r.failed; i++) {
+		uint32_t len = get_word(&r);
+		uint32_t words = (len + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+		if (r.failed || words > r.end - r.pos) {
+			r.failed = true;
+			break;
+		}
+
+		r.string_text[i] = (const char *) r.pos;
+		r.string_len[i] = len;
+		r.pos += words;
+	}
+
+	expression *expr = get_expr(&r);
+	if (r.failed || expr == NULL || expr->type != expr_list_t || r.pos != r.end
+			|| (nodes != NULL && r.node_count != node_count)) {
+		arena_release(r.arena);
+		expr = NULL;
+	} else {
+		resolve_expression(expr);
+	}
+
+	for (uint32_t i = 0; i < r.string_count; i++) {
+		if (r.names[i] != NULL) {
+			hstr_release(r.names[i]);
+		}
+	}
+	free(r.names);
+	free(r.string_len);
+	free(r.string_text);
+
+	return expr;
+}
+
+static void put_word(word_buffer *b, uint32_t word)
+{
+	if (b->count == b->capacity) {
+		b->capacity = b->capacity ? b->capacity * 2 : 1024;
+		b->words = srealloc(b->words, sizeof(uint32_t) * b->capacity);
+	}
+
+	b->words[b->count++] = word;
+}
+
+static void put_string(cache_writer *w, hstr *str)
+{
+	uintptr_t index = (uintptr_t) hash_get(w->string_index, str);
+	if (index == 0) {
+		index = ++w->string_count;
+		hash_put(w->string_index, str, (void *) index);
+
+		uint32_t len = strlen(str->str);
+		put_word(&w->strings, len);
+		for (uint32_t i = 0; i < len; i += sizeof(uint32_t)) {
+			uint32_t word = 0;
+			memcpy(&word, str->str + i, len - i < sizeof(uint32_t) ? len - i : sizeof(uint32_t));
+			put_word(&w->strings, word);
+		}
+	}
+
+	put_word(&w->tree, index - 1);
+}
+
+static void put_prop_ref(cache_writer *w, prop_ref *ref)
+{
+	put_string(w, ref->name);
+	put_expr(w, ref->site);
+}
+
+static void put_list(cache_writer *w, linked_list *list)
+{
+	put_word(&w->tree, list->size);
+	LL_FOREACH(list, node) {
+		put_expr(w, (expression *) node->data);
+	}
+}
+
+/*
+ * Robin Hood placement depends on the order entries went in. Put into a
+ * table already of the final size, starting just after an empty bucket
+ * and going round in bucket order, they land where they are now. Small
+ * maps are packed in insertion order, which is their bucket order.
+ */
+static void put_hash_literal(cache_writer *w, hash *hash_literal)
+{
+	put_word(&w->tree, hash_literal->buckets);
+	put_word(&w->tree, hash_literal->size);
+	int start = 0;
+	if (!hash_is_small(hash_literal)) {
+		while (hash_literal->table[start].key != NULL) {
+			start++;
+		}
+	}
+
+	for (int i = 0; i < hash_literal->buckets; i++) {
+		hash_entry *entry = hash_literal->table + (start + i) % hash_literal->buckets;
+		if (entry->key != NULL) {
+			put_string(w, (hstr *) entry->key);
+			put_expr(w, (expression *) entry->value);
+		}
+	}
+}
+
+static void put_expr(cache_writer *w, expression *expr)
+{
+	if (expr == NULL) {
+		put_word(&w->tree, NO_EXPR);
+		return;
+	}
+
+	if (w->track_nodes) {
+		if (w->node_count == w->node_capacity) {
+			w->node_capacity = w->node_capacity ? w->node_capacity * 2 : 256;
+			w->nodes = srealloc(w->nodes, sizeof(expression *) * w->node_capacity);
+		}
+		w->nodes[w->node_count++] = expr;
+	}
+
+	put_word(&w->tree, expr->type);
+	switch (expr->type)
+	{
+		case expr_prop_ref_t:
+			put_prop_ref(w, expr->operation.prop_ref);
+			break;
+		case expr_prop_set_t:
+			put_prop_ref(w, expr->operation.prop_set->ref);
+			put_expr(w, expr->operation.prop_set->value);
+			break;
+		case expr_invocation_t:
+			put_expr(w, expr->operation.invocation->function);
+			put_expr(w, expr->operation.invocation->list_args);
+			put_expr(w, expr->operation.invocation->hash_args);
+			break;
+		case expr_list_literal_t:
+			put_list(w, expr->operation.list_literal);
+			break;
+		case expr_hash_literal_t:
+			put_hash_literal(w, expr->operation.hash_literal);
+			break;
+		case expr_primitive_t: {
+			hval *primitive = expr->operation.primitive;
+			if (hval_type(primitive) == number_t) {
+				put_word(&w->tree, PRIMITIVE_NUMBER);
+				put_word(&w->tree, (uint32_t) hval_number_value(primitive));
+			} else if (hval_type(primitive) == string_t) {
+				put_word(&w->tree, PRIMITIVE_STRING);
+				put_string(w, primitive->value.str);
+			} else {
+				w->failed = true;
+			}
+			break;
+		}
+		case expr_list_t:
+			put_list(w, expr->operation.expr_list);
+			break;
+		case expr_deferred_t:
+			put_expr(w, expr->operation.deferred_expression);
+			break;
+		case expr_function_t:
+			put_expr(w, expr->operation.function_declaration->args);
+			put_expr(w, expr->operation.function_declaration->body);
+			break;
+	}
+}
+
+static bool write_fully(int fd, const void *data, size_t size)
+{
+	const char *p = data;
+	while (size > 0) {
+		ssize_t n = write(fd, p, size);
+		if (n == -1) {
+			return false;
+		}
+		p += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+bool module_cache_encode(expression *expr, module_cache_body *body, expression ***nodes, uint32_t *node_count)
+{
+	cache_writer w;
+	memset(&w, 0, sizeof(w));
+	w.string_index = hash_create((hash_function) hash_hstr, (key_comparator) hstr_comparator);
+	w.track_nodes = nodes != NULL;
+	put_expr(&w, expr);
+	hash_destroy(w.string_index, NULL, NULL, NULL, NULL);
+
+	// the tree goes after the strings
+	body->string_count = w.string_count;
+	body->word_count = w.strings.count + w.tree.count;
+	body->words = srealloc(w.strings.words, sizeof(uint32_t) * (body->word_count + 1));
+	memcpy(body->words + w.strings.count, w.tree.words, sizeof(uint32_t) * w.tree.count);
+	free(w.tree.words);
+
+	if (nodes != NULL) {
+		*nodes = w.nodes;
+		*node_count = w.node_count;
+	}
+
+	return !w.failed;
+}
+
+/*
+ * Written under a temporary name and renamed into place, so a reader
+ * never sees half a file.
+ */
+void module_cache_write(char *filename, struct stat *st, const char *text, size_t size, expression *expr)
+{
+	module_cache_body body;
+	bool encoded = module_cache_encode(expr, &body, NULL, NULL);
+
+	module_cache_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MODULE_CACHE_MAGIC, 4);
+	header.version = MODULE_CACHE_VERSION;
+	header.source_size = size;
+	header.source_mtime = st->st_mtim.tv_sec;
+	header.source_mtime_nsec = st->st_mtim.tv_nsec;
+	header.source_hash = fnv_hash(FNV_OFFSET_BASIS, text, size);
+	header.string_count = body.string_count;
+	header.word_count = body.word_count;
+	header.body_hash = fnv_hash(FNV_OFFSET_BASIS, body.words, body.word_count * sizeof(uint32_t));
+
+	char *path = cache_path(filename);
+	char *temp = smalloc(strlen(path) + 16);
+	sprintf(temp, "%s.%d", path, (int) getpid());
+	int fd = encoded ? open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+	if (fd != -1) {
+		bool written = write_fully(fd, &header, sizeof(header))
+			&& write_fully(fd, body.words, body.word_count * sizeof(uint32_t));
+		if (close(fd) == -1 || !written || rename(temp, path) == -1) {
+			unlink(temp);
+		}
+	}
+	hlog("module_cache_write: %s %s\n", path, fd != -1 ? "written" : "skipped");
+
+	free(temp);
+	free(path);
+	free(body.words);
+}
@@ -0,0 +1,63 @@
+#ifndef MODULE_CACHE_H
+#define MODULE_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "data.h"
+
+/*
+ * Analyzed modules are saved next to their source, foo.hsp as foo.hspc,
+ * so later runs can skip lexing and parsing them. The file records the
+ * source's size, mtime and a hash of its text: it's used as is while size
+ * and mtime match, and otherwise only if the text still hashes the same.
+ * What's saved is the expression tree, before resolution; bytecode is
+ * still compiled as it's first run.
+ */
+#define MODULE_CACHE_SUFFIX "c"
+#define MODULE_CACHE_ALT_SUFFIX ".hspc"
+#define MODULE_CACHE_VERSION 1
+
+/*
+ * The module saved for the source file filename, stat'ed as st, in a new
+ * arena; NULL if there's no usable cache for it.
+ */
+expression *module_cache_read(runtime *rt, char *filename, struct stat *st);
+
+/*
+ * Saves expr, analyzed from the size bytes of text read from filename.
+ * Failing to is not an error; the module just gets parsed next time.
+ */
+void module_cache_write(char *filename, struct stat *st, const char *text, size_t size, expression *expr);
+
+/*
+ * A cache file's body, without its header; heap images embed one for each
+ * module they hold. Expressions are numbered in the order they're written,
+ * depth first, and images refer to them by number.
+ */
+typedef struct module_cache_body {
+	uint32_t *words;
+	size_t word_count;
+	uint32_t string_count;
+} module_cache_body;
+
+/*
+ * Encodes expr into body, whose words the caller frees. If nodes isn't
+ * NULL it's set to a new array of the expressions by number. Returns false
+ * if expr holds something that can't be saved.
+ */
+bool module_cache_encode(expression *expr, module_cache_body *body, expression ***nodes, uint32_t *node_count);
+
+/*
+ * Reads a body back into a new arena, and resolves it. With nodes, there
+ * must be node_count expressions, which are stored there by number; the
+ * primitives array, if given, then has the string primitive to use for
+ * each number, or NULL to make a new one. NULL if the body is bad.
+ */
+expression *module_cache_decode(runtime *rt, const uint32_t *words, size_t word_count,
+		uint32_t string_count, hval **primitives, expression **nodes, uint32_t node_count);
+
+// the FNV-1a hash cache files check their bodies with
+uint64_t module_cache_checksum(const void *data, size_t size);
+
+#endif
@@ -18,7 +18,7 @@ native_function_spec file_module_functions[] = {
 
 void mod_file_init(runtime *rt, native_function_spec **functions, int *function_count)
 {
-	PATH = hstr_create("path");
+	PATH = hstr_intern("path");
 	*functions = file_module_functions;
 	*function_count = sizeof(file_module_functions) / sizeof(native_function_spec);
 }
@@ -35,8 +35,11 @@ void mod_file_destroy(runtime *rt)
 
 NATIVE_FUNCTION(mod_file_clone)
 {
+	hval **base = CURRENT_RUNTIME->mem->root_stack_top;
 	hval *file = hval_create_custom(sizeof(file_hval), hash_t, CURRENT_RUNTIME);
+	mem_push_root(CURRENT_RUNTIME->mem, file);
 	hval_clone_hash(this, file, CURRENT_RUNTIME);
+	CURRENT_RUNTIME->mem->root_stack_top = base;
 	// TODO Handle cloning an open file
 
 	return file;
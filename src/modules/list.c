@@ -24,10 +24,8 @@ NATIVE_FUNCTION(mod_list_clone)
 
 NATIVE_FUNCTION(mod_list_push)
 {
-	ll_node *argnode = hval_list_head(args);
-	while (argnode) {
-		hval_list_insert_head((list_hval *) this, runtime_get_arg_value(argnode));
-		argnode = argnode->next;
+	for (int i = 0; i < args->count; i++) {
+		hval_list_insert_head((list_hval *) this, args->values[i], CURRENT_RUNTIME->mem);
 	}
 
 	return this;
@@ -47,22 +45,16 @@ NATIVE_FUNCTION(mod_list_pop)
 
 NATIVE_FUNCTION(mod_list_foreach)
 {
-	if (hval_list_size(args) != 1) {
+	if (args->count != 1) {
 		return hval_boolean_create(false, CURRENT_RUNTIME);
 	}
 
-	hval *func = runtime_get_arg_value(hval_list_head(args));
-	list_hval *arglist = (list_hval *) hval_list_create(CURRENT_RUNTIME);
-	hval *argwrap = hval_hash_create(CURRENT_RUNTIME);
-	hval_list_insert_head(arglist, argwrap);
-	ll_node *node = ((list_hval *)this)->list->head;
-	hval *prepared_args = NULL;
-	while (node) {
-		hval_hash_put(argwrap, VALUE, node->data, NULL);
-		prepared_args = runtime_build_function_arguments(CURRENT_RUNTIME, func, arglist);
-		runtime_call_function(CURRENT_RUNTIME, func, prepared_args, CURRENT_RUNTIME->top_level);
-
-		node = node->next;
+	hval *func = args->values[0];
+	hval *item = NULL;
+	arguments item_args = { 1, &item, NULL };
+	LL_FOREACH(((list_hval *)this)->list, node) {
+		item = (hval *) node->data;
+		runtime_call_function(CURRENT_RUNTIME, func, &item_args, CURRENT_RUNTIME->top_level);
 	}
 
 	return hval_boolean_create(true, CURRENT_RUNTIME);
@@ -88,27 +80,24 @@ NATIVE_FUNCTION(mod_list_last)
 
 NATIVE_FUNCTION(mod_list_filter)
 {
-	if (hval_list_size(args) == 0 || hval_list_size(this) == 0) {
+	if (args->count == 0 || hval_list_size(this) == 0) {
 		return hval_list_create(CURRENT_RUNTIME);
 	}
 
-	hval *func = runtime_get_arg_value(hval_list_head(args));
-	list_hval *filter_args = (list_hval *) hval_list_create(CURRENT_RUNTIME);
-	hval *argwrap = hval_hash_create(CURRENT_RUNTIME);
-	hval_list_insert_head(filter_args, argwrap);
-	hval *prepared_args = NULL;
+	hval *func = args->values[0];
+	hval *item = NULL;
+	arguments item_args = { 1, &item, NULL };
+	hval **base = CURRENT_RUNTIME->mem->root_stack_top;
 	list_hval *filtered = (list_hval *) hval_list_create(CURRENT_RUNTIME);
+	mem_push_root(CURRENT_RUNTIME->mem, (hval *) filtered);
 	LL_FOREACH(((list_hval *)this)->list, node) {
-		hval *this_item = (hval *) node->data;
-		hval_hash_put(argwrap, VALUE, this_item, NULL);
-		prepared_args = runtime_build_function_arguments(CURRENT_RUNTIME, func, filter_args);
-		hval *value = runtime_call_function(CURRENT_RUNTIME, func, prepared_args, CURRENT_RUNTIME->top_level);
+		item = (hval *) node->data;
+		hval *value = runtime_call_function(CURRENT_RUNTIME, func, &item_args, CURRENT_RUNTIME->top_level);
 		if (value != NULL && hval_is_true(value)) {
-			hval_list_insert_tail(filtered, this_item);
+			hval_list_insert_tail(filtered, item, CURRENT_RUNTIME->mem);
 		}
-		hval_release(prepared_args, CURRENT_RUNTIME->mem);
-		prepared_args = NULL;
 	}
 
+	CURRENT_RUNTIME->mem->root_stack_top = base;
 	return (hval *) filtered;
 }
@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include "log.h"
+#include "resolve.h"
+#include "smalloc.h"
+#include "type.h"
+
+typedef struct scope scope;
+struct scope {
+	scope *parent;
+	hstr **names;		// names[i] is expected in slot i of the frame
+	int count;
+};
+
+static void resolve(expression *expr, scope *sc);
+static void resolve_ref(prop_ref *ref, scope *sc);
+static void resolve_function(function_declaration *decl, scope *sc);
+
+void resolve_expression(expression *expr)
+{
+	resolve(expr, NULL);
+}
+
+static void resolve(expression *expr, scope *sc)
+{
+	switch (expr->type)
+	{
+		case expr_prop_ref_t:
+			if (expr->operation.prop_ref->site != NULL) {
+				resolve(expr->operation.prop_ref->site, sc);
+			} else {
+				resolve_ref(expr->operation.prop_ref, sc);
+			}
+			break;
+		case expr_prop_set_t:
+			if (expr->operation.prop_set->ref->site != NULL) {
+				resolve(expr->operation.prop_set->ref->site, sc);
+			} else {
+				resolve_ref(expr->operation.prop_set->ref, sc);
+			}
+			resolve(expr->operation.prop_set->value, sc);
+			break;
+		case expr_list_t:
+			LL_FOREACH(expr->operation.expr_list, node) {
+				resolve((expression *) node->data, sc);
+			}
+			break;
+		case expr_list_literal_t:
+			LL_FOREACH(expr->operation.list_literal, node) {
+				resolve((expression *) node->data, sc);
+			}
+			break;
+		case expr_hash_literal_t: {
+			hash_iterator iter;
+			hash_iterator_init(&iter, expr->operation.hash_literal);
+			while (iter.current_key != NULL) {
+				resolve((expression *) iter.current_value, sc);
+				hash_iterator_next(&iter);
+			}
+			break;
+		}
+		case expr_primitive_t:
+			break;
+		case expr_invocation_t:
+			resolve(expr->operation.invocation->function, sc);
+			if (expr->operation.invocation->list_args != NULL) {
+				LL_FOREACH(expr->operation.invocation->list_args->operation.list_literal, node) {
+					expression *arg = (expression *) node->data;
+					// the name of a named argument isn't a reference
+					resolve(arg->type == expr_prop_set_t ? arg->operation.prop_set->value : arg, sc);
+				}
+			} else {
+				resolve(expr->operation.invocation->hash_args, sc);
+			}
+			break;
+		case expr_deferred_t:
+			// deferred expressions normally run in the context they were
+			// created in; when they don't, the VM's checks catch it
+			resolve(expr->operation.deferred_expression, sc);
+			break;
+		case expr_function_t:
+			resolve_function(expr->operation.function_declaration, sc);
+			break;
+		default:
+			hlog("resolve: unknown expression type %d\n", expr->type);
+			break;
+	}
+}
+
+static void resolve_function(function_declaration *decl, scope *sc)
+{
+	linked_list *params = decl->args->operation.list_literal;
+	scope fn_scope = { sc, smalloc(sizeof(hstr *) * (params->size + 2)), 0 };
+	fn_scope.names[fn_scope.count++] = PARENT;
+
+	bool named = true;
+	LL_FOREACH(params, node) {
+		expression *param = (expression *) node->data;
+		if (param->type == expr_prop_ref_t) {
+			fn_scope.names[fn_scope.count++] = param->operation.prop_ref->name;
+		} else if (param->type == expr_prop_set_t) {
+			fn_scope.names[fn_scope.count++] = param->operation.prop_set->ref->name;
+			// defaults are evaluated where the function is declared
+			resolve(param->operation.prop_set->value, sc);
+		} else {
+			resolve(param, sc);
+			named = false;
+		}
+	}
+	fn_scope.names[fn_scope.count++] = FN_SELF;
+
+	if (!named) {
+		// the frame layout isn't known, but it is still a frame
+		fn_scope.count = 0;
+	}
+
+	resolve(decl->body, &fn_scope);
+	free(fn_scope.names);
+}
+
+static void resolve_ref(prop_ref *ref, scope *sc)
+{
+	int depth = 0;
+	for (scope *s = sc; s != NULL; s = s->parent, depth++) {
+		for (int i = 0; i < s->count; i++) {
+			if (hstr_comparator(s->names[i], ref->name)) {
+				ref->depth = depth;
+				ref->index = i;
+				return;
+			}
+		}
+	}
+}
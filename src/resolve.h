@@ -0,0 +1,22 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+#include "data.h"
+
+/*
+ * Resolver pass run over each parsed expression tree. Identifiers inside a
+ * function body that name one of its parameters (or self), or one of an
+ * enclosing function's, get a lexical address in their prop_ref: how many
+ * frames up the parameter lives and which slot of that frame holds it.
+ *
+ * Frames are the function-call contexts built by
+ * eval_expr_folly_invocation, laid out as __parent__, the parameters in
+ * declaration order, then self (undeclared named arguments, when a caller
+ * passes any, go before self). Everything else, including locals (an
+ * assignment may land in any enclosing scope, decided at run time), stays
+ * dynamic. Addresses are hints: the VM checks them against the frame before
+ * using them and falls back to a dynamic lookup when they don't hold.
+ */
+void resolve_expression(expression *expr);
+
+#endif
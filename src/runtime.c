@@ -7,14 +7,18 @@
 #include <unistd.h>
 #include "runtime.h"
 #include "fmt.h"
+#include "image.h"
 #include "lexer.h"
 #include "lexer_io.h"
 #include "linked_list.h"
 #include "log.h"
+#include "module_cache.h"
+#include "smalloc.h"
 #include "type.h"
 #include "ht.h"
-#include "smalloc.h"
+#include "resolve.h"
 #include "str.h"
+#include "vm.h"
 #include "modules/file.h"
 #include "modules/list.h"
 #include "modules/object.h"
@@ -22,10 +26,15 @@
 expression *runtime_analyze(runtime *, lexer *);
 typedef void (*module_initializer)(runtime *, native_function_spec **, int *);
 static void expect_token(token *t, token_type token_type);
-static void register_top_level(runtime *);
+static void register_top_level(runtime *, int);
 static void register_builtin(runtime *, hval *, char *, hval *, bool);
 static void register_builtin_r(runtime *, hval *, char *, hval *);
 static void init_module(runtime *rt, module_initializer init);
+static void add_native_functions(runtime *rt, native_function_spec *spec, int count);
+
+// the arena expressions are read into: one per module, or per line at the
+// interactive prompt
+static arena *parse_arena = NULL;
 
 static expression *read_complete_expression(lexer *);
 static expression *read_identifier(lexer *);
@@ -44,12 +53,16 @@ static hval *eval_expr_list(runtime *, linked_list *, hval *);
 static hval *eval_expr_list_literal(runtime *, expression *, hval *);
 static hval *eval_expr_function_declaration(runtime *, function_declaration *, hval *);
 static hval *eval_expr_invocation(runtime *, invocation *, hval *);
-static hval *eval_expr_folly_invocation(runtime *rt, hval *fn, hval *args, hval *context);
-static list_hval *eval_expr_function_args(runtime *rt, expression *expr, bool for_invocation, hval *context);
+static hval *eval_expr_folly_invocation(runtime *rt, hval *fn, arguments *args, hval *context);
+static list_hval *eval_expr_function_params(runtime *rt, expression *expr, hval *context);
 static hval *eval_expr_deferred(runtime *, expression *, hval *);
 static hval *undefer(runtime *rt, hval *maybe_deferred);
+static void bind_arguments(runtime *, hval *, arguments *, hval *);
+static void bind_parameter(runtime *, hval *, arguments *, int *, hstr *, hval *);
 
 static hval *get_prop_ref_site(runtime *, prop_ref *, hval *);
+static prop_cache_entry *prop_cache_find(prop_ref *, hval *);
+static void prop_cache_fill(prop_ref *, hval *, hval *, int);
 
 static NATIVE_FUNCTION(native_print);
 static NATIVE_FUNCTION(native_add);
@@ -130,28 +143,62 @@ void runtime_init_globals()
 void runtime_destroy_globals()
 {
 	type_destroy_globals();
+	shape_destroy_all();
+	hstr_intern_destroy();
 }
 
 runtime *runtime_create()
 {
 	runtime *r = malloc(sizeof(runtime));
 	CURRENT_RUNTIME = r;
-	r->mem = mem_create();
+	// FOLLY_GC_THREADS spreads full collections over that many threads
+	char *threads = getenv("FOLLY_GC_THREADS");
+	r->mem = mem_create(threads != NULL ? atoi(threads) : 1);
 	r->loaded_modules = NULL;
+	// FOLLY_EVAL=ast selects the tree-walking evaluator
+	char *mode = getenv("FOLLY_EVAL");
+	r->eval_mode = mode != NULL && strcmp(mode, "ast") == 0 ? EVAL_AST : EVAL_VM;
+	// FOLLY_MODULE_CACHE=off parses every module loaded, and saves none
+	char *cache = getenv("FOLLY_MODULE_CACHE");
+	r->module_cache = cache == NULL || strcmp(cache, "off") != 0;
+	// FOLLY_GC_PAUSE_US bounds full collection pauses, making them incremental
+	char *pause = getenv("FOLLY_GC_PAUSE_US");
+	if (pause != NULL) {
+		runtime_set_gc_pause(r, atol(pause));
+	}
+
+	// every module is initialized, and its native functions noted, before
+	// any are registered, so that an image can link them up instead
+	r->natives = NULL;
+	r->native_count = 0;
+	init_module(r, mod_list_init);
+	init_module(r, mod_object_init);
+	int type_natives = r->native_count;
+	add_native_functions(r, native_functions, sizeof(native_functions) / sizeof(native_function_spec));
+	for (int i = 0; i < NUM_DEFAULT_MODULES; i++) {
+		init_module(r, default_modules[i].init);
+	}
 
 	r->object_root = NULL;
+	r->top_level = NULL;
+	r->primitive_pool = NULL;
+	// FOLLY_IMAGE starts from a heap saved by folly --save-image
+	char *image = getenv("FOLLY_IMAGE");
+	if (image != NULL && image_read(r, image)) {
+		return r;
+	}
+
 	r->object_root = hval_hash_create(r);
 	mem_add_gc_root(r->mem, r->object_root);
 
 	r->top_level = hval_hash_create(r);
-	hstr *str = hstr_create("Object");
+	hstr *str = hstr_intern("Object");
 	hval_hash_put(r->top_level, str, r->object_root, r->mem);
 	hstr_release(str);
 	mem_add_gc_root(r->mem, r->top_level);
 
 	// init built-in types early
-	init_module(r, mod_list_init);
-	init_module(r, mod_object_init);
+	register_native_functions(r, r->natives, type_natives);
 
 	// create a separate gc root for primitives creating while parsing
 	// input. these primitives don't start with any other references,
@@ -161,7 +208,7 @@ runtime *runtime_create()
 	/*printf("primitive pool: %p\n", r->primitive_pool);*/
 
 	//hlog("top_level: %p\n", r->top_level);
-	register_top_level(r);
+	register_top_level(r, type_natives);
 	return r;
 }
 
@@ -172,7 +219,12 @@ void runtime_destroy(runtime *r)
 	if (r->loaded_modules) {
 		ll_node *module_node = r->loaded_modules->head;
 		while (module_node) {
-			expr_destroy((expression *) module_node->data, true, r->mem);
+			loaded_module *module = (loaded_module *) module_node->data;
+			if (module->expr != NULL) {
+				expr_release(module->expr);
+			}
+			free(module->filename);
+			free(module);
 			module_node = module_node->next;
 		}
 
@@ -196,11 +248,26 @@ void runtime_destroy(runtime *r)
 	gc(r->mem);
 	mem_destroy(r->mem);
 	r->mem = NULL;
+	free(r->natives);
 	hlog("done releasing top_level\n");
 	free(r);
 }
 
-static void register_top_level(runtime *r)
+void runtime_set_gc_pause(runtime *r, long max_pause_us)
+{
+	mem_set_gc_pause(r->mem, max_pause_us);
+}
+
+void runtime_set_eval_mode(runtime *r, eval_mode mode)
+{
+	r->eval_mode = mode;
+}
+
+/*
+ * Registers the runtime's native functions from first on; the built-in
+ * types' come before that, and are registered already.
+ */
+static void register_top_level(runtime *r, int first)
 {
 	int i = 0;
 	top_level_initializer *init = top_level_initializers;
@@ -211,10 +278,7 @@ static void register_top_level(runtime *r)
 
 	hlog("Registering top levels under %p\n", r->top_level);
 
-	register_native_functions(r, native_functions, sizeof(native_functions) / sizeof(native_function_spec));
-	for (int i = 0; i < NUM_DEFAULT_MODULES; i++) {
-		init_module(r, default_modules[i].init);
-	}
+	register_native_functions(r, r->natives + first, r->native_count - first);
 	/*init_module(r, mod_file_init);*/
 }
 
@@ -223,10 +287,17 @@ void init_module(runtime *rt, module_initializer init) {
 	int count = 0;
 	init(rt, &functions, &count);
 	if (functions != NULL && count != 0) {
-		register_native_functions(rt, functions, count);
+		add_native_functions(rt, functions, count);
 	}
 }
 
+static void add_native_functions(runtime *rt, native_function_spec *spec, int count)
+{
+	rt->natives = srealloc(rt->natives, sizeof(native_function_spec) * (rt->native_count + count));
+	memcpy(rt->natives + rt->native_count, spec, sizeof(native_function_spec) * count);
+	rt->native_count += count;
+}
+
 void register_native_functions(runtime *r, native_function_spec *spec, int count) {
 	hval *func_val = NULL;
 	for (native_function_spec *max = spec + count; spec < max; spec++) {
@@ -252,6 +323,11 @@ static void register_builtin(runtime *rt, hval *site, char *name, hval *value, b
 	int i = 0;
 	hstr *str = NULL;
 	hval *new_site = NULL;
+	hval **base = rt->mem->root_stack_top;
+
+	// value isn't reachable until it's in place, and creating the
+	// sites on the way can trigger a collection
+	mem_push_root(rt->mem, value);
 
 	// for symmetry with the hval_release() below
 	// we create missing values and need to release them,
@@ -261,7 +337,7 @@ static void register_builtin(runtime *rt, hval *site, char *name, hval *value, b
 	while (true)
 	{
 		if (name[i] == '.') {
-			str = hstr_create_len(name + start, i - start);
+			str = hstr_intern_len(name + start, i - start);
 			new_site = hval_hash_get(site, str, rt);
 			if (new_site == NULL) {
 				new_site = hval_hash_create(rt);
@@ -272,7 +348,7 @@ static void register_builtin(runtime *rt, hval *site, char *name, hval *value, b
 			hstr_release(str);
 			start = i + 1;
 		} else if (name[i] == '\0') {
-			str = hstr_create_len(name + start, i - start);
+			str = hstr_intern_len(name + start, i - start);
 			break;
 		}
 
@@ -290,6 +366,7 @@ static void register_builtin(runtime *rt, hval *site, char *name, hval *value, b
 		hval_release(value, rt->mem);
 	}
 	hval_release(site, rt->mem);
+	rt->mem->root_stack_top = base;
 }
 
 hval *runtime_exec_one(runtime *runtime, lexer_input *input, bool *terminated)
@@ -302,13 +379,16 @@ hval *runtime_exec_one(runtime *runtime, lexer_input *input, bool *terminated)
 	}
 
 	hval *result = NULL;
+	arena *a = parse_arena = arena_create();
 	expression *expr = read_complete_expression(lexer);
+	parse_arena = NULL;
 	if (expr != NULL) {
+		resolve_expression(expr);
 		result = runtime_evaluate_expression(runtime, expr, runtime->top_level);
-		expr_destroy(expr, false, runtime->mem);
 	} else {
 		*terminated = true;
 	}
+	arena_release(a);
 
 	lexer_destroy(lexer, false);
 	return result;
@@ -330,7 +410,7 @@ hval *runtime_exec(runtime *runtime, lexer_input *input)
 	hval *ret = runtime_evaluate_expression(runtime, expr, runtime->top_level);
 	hlog("runtime_eval complete - got return value %p\n", ret);
 
-	expr_destroy(expr, true, runtime->mem);
+	expr_release(expr);
 	expr = NULL;
 
 	/*char *str = hval_to_string(ret);*/
@@ -340,26 +420,75 @@ hval *runtime_exec(runtime *runtime, lexer_input *input)
 	return runtime->top_level;
 }
 
-hval *runtime_load_module(runtime *runtime, lexer_input *input)
+/*
+ * Runs the module in filename at the top level, unless it has been run
+ * already. Its expressions come from its .hspc file when that's up to
+ * date, and are saved there when they had to be parsed. Returns false
+ * if filename isn't a readable file.
+ */
+bool runtime_load_module(runtime *runtime, char *filename)
 {
-	lexer *lexer = lexer_create(input);
-	expression *expr = runtime_analyze(runtime, lexer);
-	lexer_destroy(lexer, false);
+	struct stat st;
+	if (stat(filename, &st) == -1) {
+		perror("Unable to open file");
+		return false;
+	} else if (!S_ISREG(st.st_mode)) {
+		return false;
+	}
+
 	if (runtime->loaded_modules == NULL) {
 		runtime->loaded_modules = ll_create();
 	}
+	LL_FOREACH(runtime->loaded_modules, node) {
+		loaded_module *module = (loaded_module *) node->data;
+		if (module->dev == st.st_dev && module->ino == st.st_ino) {
+			return true;
+		}
+	}
 
-	ll_insert_head(runtime->loaded_modules, expr);
+	expression *expr = runtime->module_cache ? module_cache_read(runtime, filename, &st) : NULL;
+	if (expr == NULL) {
+		lexer_input *input = lexer_file_input_create(filename);
+		lexer *lexer = lexer_create(input);
+		expr = runtime_analyze(runtime, lexer);
+		lexer_destroy(lexer, false);
+		if (runtime->module_cache) {
+			lexer_file_input *file = (lexer_file_input *) input;
+			module_cache_write(filename, &st, file->text, file->size, expr);
+		}
+		lexer_input_destroy(input);
+	}
 
-	hval *ret = runtime_evaluate_expression(runtime, expr, runtime->top_level);
-	return ret;
+	// recorded before it runs, so a module loading itself stops there
+	loaded_module *module = smalloc(sizeof(loaded_module));
+	module->filename = smalloc(strlen(filename) + 1);
+	strcpy(module->filename, filename);
+	module->dev = st.st_dev;
+	module->ino = st.st_ino;
+	module->size = st.st_size;
+	module->mtime = st.st_mtim;
+	module->expr = expr;
+	runtime_add_module(runtime, module);
+
+	runtime_evaluate_expression(runtime, expr, runtime->top_level);
+	return true;
+}
+
+void runtime_add_module(runtime *runtime, loaded_module *module)
+{
+	if (runtime->loaded_modules == NULL) {
+		runtime->loaded_modules = ll_create();
+	}
+
+	ll_insert_head(runtime->loaded_modules, module);
 }
 
 expression *runtime_analyze(runtime *rt, lexer *lexer)
 {
 	token *t = NULL;
-	expression *expr_list = expr_create(expr_list_t);
-	expr_list->operation.expr_list = ll_create();
+	parse_arena = arena_create();
+	expression *expr_list = expr_create(parse_arena, expr_list_t);
+	expr_list->operation.expr_list = expr_list_create(parse_arena);
 
 	expression *expr = NULL;
 	while ((t = lexer_get_next_token(lexer)) != NULL)
@@ -370,13 +499,16 @@ expression *runtime_analyze(runtime *rt, lexer *lexer)
 			/*runtime_error("read_complete_expression returned null\n");*/
 			/*exit(1);*/
 		} else {
-			ll_insert_tail(expr_list->operation.expr_list, expr);
+			expr_list_append(parse_arena, expr_list->operation.expr_list, expr);
 		}
 	}
+	parse_arena = NULL;
 
+	resolve_expression(expr_list);
 	return expr_list;
 }
 
+
 expression *read_complete_expression(lexer *lexer)
 {
 	expression *expr = NULL;
@@ -431,8 +563,8 @@ static expression *read_function_declaration(lexer *lexer, expression *args) {
 	expect_token(lexer_current_token(lexer), list_start);
 	expression *body = read_list(lexer);
 
-	expression *fn = expr_create(expr_function_t);
-	fn->operation.function_declaration = smalloc(sizeof(function_declaration));
+	expression *fn = expr_create(parse_arena, expr_function_t);
+	fn->operation.function_declaration = arena_alloc(parse_arena, sizeof(function_declaration));
 	fn->operation.function_declaration->args = args;
 	fn->operation.function_declaration->body = body;
 	return fn;
@@ -441,7 +573,7 @@ static expression *read_function_declaration(lexer *lexer, expression *args) {
 expression *read_quoted(lexer *lexer)
 {
 	
-	expression *expr = expr_create(expr_deferred_t);
+	expression *expr = expr_create(parse_arena, expr_deferred_t);
 	lexer_get_next_token(lexer);
 	expression *deferred = read_complete_expression(lexer);
 	expr->operation.deferred_expression = deferred;
@@ -453,24 +585,15 @@ expression *read_identifier(lexer *lexer)
 	expression *expr = NULL;
 
 	token *t = lexer->current;
-	prop_ref *ref = malloc(sizeof(prop_ref));
-	if (ref == NULL)
-	{
-		perror("read_identifier unable to allocate memory for prop_ref");
-		exit(1);
-	}
-
-	ref->name = t->value.string;
-	ref->site = NULL;
-	hstr_retain(t->value.string);
+	prop_ref *ref = prop_ref_create(parse_arena, t->value.string);
 
 	token *next = lexer_peek_token(lexer);
 	if (next->type == assignment) {
 		// consume the assignment and advance to the next
 		lexer_get_next_token(lexer);
 		lexer_get_next_token(lexer);
-		expression *assgn = expr_create(expr_prop_set_t);
-		assgn->operation.prop_set = malloc(sizeof(prop_set));
+		expression *assgn = expr_create(parse_arena, expr_prop_set_t);
+		assgn->operation.prop_set = arena_alloc(parse_arena, sizeof(prop_set));
 		assgn->operation.prop_set->ref = ref;
 		assgn->operation.prop_set->value = read_complete_expression(lexer);
 		expr = assgn;
@@ -480,7 +603,7 @@ expression *read_identifier(lexer *lexer)
 		lexer_get_next_token(lexer);
 		lexer_get_next_token(lexer);
 		expr = read_complete_expression(lexer);
-		expression *parent = expr_create(expr_prop_ref_t);
+		expression *parent = expr_create(parse_arena, expr_prop_ref_t);
 		parent->operation.prop_ref = ref;
 		if (expr->type == expr_invocation_t)
 		{
@@ -496,15 +619,9 @@ expression *read_identifier(lexer *lexer)
 		}
 	} else if (next->type == list_start || next->type == hash_start) {
 		lexer_get_next_token(lexer);
-		expr = expr_create(expr_invocation_t);
-		invocation *inv = malloc(sizeof(invocation));
-		if (inv == NULL)
-		{
-			perror("Unable to allocate memory for invocation\n");
-			exit(1);
-		}
-		
-		expression *func = expr_create(expr_prop_ref_t);
+		expr = expr_create(parse_arena, expr_invocation_t);
+		invocation *inv = arena_alloc(parse_arena, sizeof(invocation));
+		expression *func = expr_create(parse_arena, expr_prop_ref_t);
 		func->operation.prop_ref = ref;
 		inv->function = func;
 		if (next->type == list_start)
@@ -519,7 +636,7 @@ expression *read_identifier(lexer *lexer)
 		}
 		expr->operation.invocation = inv;
 	} else {
-		expr = expr_create(expr_prop_ref_t);
+		expr = expr_create(parse_arena, expr_prop_ref_t);
 		expr->operation.prop_ref = ref;
 	}
 
@@ -529,25 +646,25 @@ expression *read_identifier(lexer *lexer)
 expression *read_string(lexer *lexer)
 {
 	token *t = lexer_current_token(lexer);
-	expression *expr = expr_create(expr_primitive_t);
+	expression *expr = expr_create(parse_arena, expr_primitive_t);
 	expr->operation.primitive = hval_string_create(t->value.string, CURRENT_RUNTIME);
-	hval_list_insert_head(CURRENT_RUNTIME->primitive_pool, expr->operation.primitive);
+	hval_list_insert_head(CURRENT_RUNTIME->primitive_pool, expr->operation.primitive, CURRENT_RUNTIME->mem);
 	return expr;
 }
 
 expression *read_number(lexer *lexer)
 {
 	token *t = lexer_current_token(lexer);
-	expression *expr = expr_create(expr_primitive_t);
+	expression *expr = expr_create(parse_arena, expr_primitive_t);
 	expr->operation.primitive = hval_number_create(t->value.number, CURRENT_RUNTIME);
-	hval_list_insert_head(CURRENT_RUNTIME->primitive_pool, expr->operation.primitive);
+	hval_list_insert_head(CURRENT_RUNTIME->primitive_pool, expr->operation.primitive, CURRENT_RUNTIME->mem);
 	return expr;
 }
 
 expression *read_list(lexer *lexer)
 {
-	expression *list = expr_create(expr_list_literal_t);
-	list->operation.list_literal = ll_create();
+	expression *list = expr_create(parse_arena, expr_list_literal_t);
+	list->operation.list_literal = expr_list_create(parse_arena);
 
 	lexer_get_next_token(lexer);
 	token *t = lexer_current_token(lexer);
@@ -556,7 +673,7 @@ expression *read_list(lexer *lexer)
 	{
 		/*fprintf(stderr, " read_list got token: %s\n", token_type_string(t->type));*/
 		expr = read_complete_expression(lexer);
-		ll_insert_tail(list->operation.list_literal, expr);
+		expr_list_append(parse_arena, list->operation.list_literal, expr);
 		do {
 			t = lexer_get_next_token(lexer);
 		} while (t && t->type == sequence_break);
@@ -567,11 +684,13 @@ expression *read_list(lexer *lexer)
 
 static expression *read_hash(lexer *lexer)
 {
-	expression *hash_lit = expr_create(expr_hash_literal_t);
-	hash_lit->operation.hash_literal = hash_create((hash_function) hash_hstr, (key_comparator) hstr_comparator);
-	// consume the hash_start
-	lexer_get_next_token(lexer);
-	token *t = lexer_current_token(lexer);
+	expression *hash_lit = expr_create(parse_arena, expr_hash_literal_t);
+	hash_lit->operation.hash_literal = expr_hash_literal_create(parse_arena);
+	// consume the hash_start and any line breaks following it
+	token *t = NULL;
+	do {
+		t = lexer_get_next_token(lexer);
+	} while (t && t->type == sequence_break);
 	while (t != NULL && t->type != hash_end)
 	{
 		expect_token(t, identifier);
@@ -592,6 +711,10 @@ static expression *read_hash(lexer *lexer)
 
 static hval *runtime_evaluate_expression(runtime *rt, expression *expr, hval *context)
 {
+	if (rt->eval_mode == EVAL_VM) {
+		return vm_evaluate(rt, expr, context);
+	}
+
 	switch (expr->type)
 	{
 		case expr_prop_ref_t:
@@ -621,20 +744,34 @@ static hval *runtime_evaluate_expression(runtime *rt, expression *expr, hval *co
 
 static hval *eval_expr_function_declaration(runtime *rt, function_declaration *decl, hval *context)
 {
+	hval **base = rt->mem->root_stack_top;
+	hval *args = (hval *) eval_expr_function_params(rt, decl->args, context);
+	hval *fn = runtime_create_function(rt, args, decl->body, context);
+	rt->mem->root_stack_top = base;
+	return fn;
+}
+
+hval *runtime_create_function(runtime *rt, hval *args, expression *body, hval *context)
+{
+	hval **base = rt->mem->root_stack_top;
 	hval *fn = hval_hash_create(rt);
-	expression *expr = decl->body;
-	hval *args = (hval *) eval_expr_function_args(rt, decl->args, false, context);
+	mem_push_root(rt->mem, fn);
 	hval_hash_put(fn, FN_ARGS, args, rt->mem);
-	mem_remove_gc_root(rt->mem, args);
-	hval *body = eval_expr_deferred(rt, expr, context);
-	hval_hash_put(fn, FN_EXPR, body, rt->mem);
+	hval *deferred = runtime_defer(rt, body, context);
+	hval_hash_put(fn, FN_EXPR, deferred, rt->mem);
+	rt->mem->root_stack_top = base;
 
 	return fn;
 }
 
-static list_hval *eval_expr_function_args(runtime *rt, expression *expr, bool for_invocation, hval *context) {
+/*
+ * Builds a function's parameter list: one NAME/VALUE hash per parameter,
+ * where VALUE is the default, if any. The list, and the names of any
+ * parameters with defaults, are left on the root stack for the caller to pop.
+ */
+static list_hval *eval_expr_function_params(runtime *rt, expression *expr, hval *context) {
 	list_hval *arglist = (list_hval *) hval_list_create(rt);
-	mem_add_gc_root(rt->mem, (hval *) arglist);
+	mem_push_root(rt->mem, (hval *) arglist);
 	ll_node *arg_node = expr->operation.list_literal->head;
 	expression *arg_expr = NULL;
 	hval *arg = NULL;
@@ -647,19 +784,17 @@ static list_hval *eval_expr_function_args(runtime *rt, expression *expr, bool fo
 		arg_expr = (expression *) arg_node->data;
 		arg = hval_hash_create(rt);
 		/*fprintf(stderr, "  created arg %d: %p\n", i, arg);*/
-		hval_list_insert_tail(arglist, arg);
+		hval_list_insert_tail(arglist, arg, rt->mem);
 		switch (arg_expr->type) {
 		case expr_prop_ref_t:
-			if (for_invocation) {
-				value = runtime_evaluate_expression(rt, arg_expr, context);
-			} else {
-				name = hval_string_create(arg_expr->operation.prop_ref->name, rt);
-			}
+			name = hval_string_create(arg_expr->operation.prop_ref->name, rt);
 			break;
 		case expr_prop_set_t:
 			set = arg_expr->operation.prop_set;
 			name = hval_string_create(set->ref->name, rt);
-			value = runtime_evaluate_expression(rt, set->value, context);
+			// the default may allocate, so name needs a root until it's put
+			mem_push_root(rt->mem, name);
+			value =runtime_evaluate_expression(rt, set->value, context);
 			break;
 		case expr_primitive_t:
 			value = arg_expr->operation.primitive;
@@ -710,8 +845,9 @@ static hval *eval_expr_list(runtime *rt, linked_list *expr_list, hval *context)
 static hval *eval_expr_list_literal(runtime *rt, expression *expr_list, hval *context)
 {
 	hlog("eval_expr_list_literal\n");
+	hval **base = rt->mem->root_stack_top;
 	list_hval *list = (list_hval *) hval_list_create(rt);
-	mem_add_gc_root(rt->mem, (hval *) list);
+	mem_push_root(rt->mem, (hval *) list);
 	ll_node *current = expr_list->operation.list_literal->head;
 	expression *expr = NULL;
 	hval *result = NULL;
@@ -720,22 +856,23 @@ static hval *eval_expr_list_literal(runtime *rt, expression *expr_list, hval *co
 		expr = (expression *) current->data;
 		result = runtime_evaluate_expression(rt, expr, context);
 		if (result) {
-			hval_list_insert_tail(list, result);
+			hval_list_insert_tail(list, result, rt->mem);
 			hval_release(result, rt->mem);
 		}
 		result = NULL;
 		current = current->next;
 	}
 
-	mem_remove_gc_root(rt->mem, (hval *) list);
+	rt->mem->root_stack_top = base;
 
 	return (hval *) list;
 }
 
 static hval *eval_expr_hash_literal(runtime *rt, hash *def, hval *context)
 {
+	hval **base = rt->mem->root_stack_top;
 	hval *result = hval_hash_create(rt);
-	mem_add_gc_root(rt->mem, result);
+	mem_push_root(rt->mem, result);
 	hash_iterator *iter = hash_iterator_create(def);
 	while (iter->current_key != NULL)
 	{
@@ -746,14 +883,49 @@ static hval *eval_expr_hash_literal(runtime *rt, hash *def, hval *context)
 	}
 
 	hash_iterator_destroy(iter);
-	mem_remove_gc_root(rt->mem, result);
+	rt->mem->root_stack_top = base;
 	return result;
 }
 
 static hval *eval_prop_ref(runtime *rt, prop_ref *ref, hval *context)
 {
 	hval *site = get_prop_ref_site(rt, ref, context);
-	hval *val = hval_hash_get(site, ref->name, rt);
+	return runtime_get_property(rt, ref, site);
+}
+
+static hval *eval_prop_set(runtime *rt, prop_set *set, hval *context)
+{
+	hval **base = rt->mem->root_stack_top;
+	hval *site = get_prop_ref_site(rt, set->ref, context);
+	mem_push_root(rt->mem, site);
+	hval *value = runtime_evaluate_expression(rt, set->value, context);
+	runtime_set_property(rt, set->ref, site, value);
+	rt->mem->root_stack_top = base;
+	return value;
+}
+
+hval *runtime_get_property(runtime *rt, prop_ref *ref, hval *site)
+{
+	hval *val = NULL;
+	prop_cache_entry *entry = prop_cache_find(ref, site);
+	if (entry != NULL) {
+		val = (entry->holder ? entry->holder : site)->slots[entry->slot];
+		if (entry->holder != NULL && hval_is_callable(val)) {
+			val = NULL;
+		}
+	}
+
+	if (val == NULL) {
+		int slot;
+		hval *holder = hval_hash_find_holder(site, ref->name, &slot, rt);
+		val = hval_hash_get(site, ref->name, rt);
+		// inherited functions come back bound to the receiver, so they
+		// always go through hval_hash_get
+		if (holder != NULL && slot >= 0 && (holder == site || !hval_is_callable(val))) {
+			prop_cache_fill(ref, site, holder, slot);
+		}
+	}
+
 	if (val != NULL) {
 		hval_retain(val);
 	} else {
@@ -763,35 +935,104 @@ static hval *eval_prop_ref(runtime *rt, prop_ref *ref, hval *context)
 	return val;
 }
 
-static hval *eval_prop_set(runtime *rt, prop_set *set, hval *context)
+void runtime_set_property(runtime *rt, prop_ref *ref, hval *site, hval *value)
 {
-	hval *site = get_prop_ref_site(rt, set->ref, context);
-	mem_add_gc_root(rt->mem, site);
-	if (site->type != hash_t)
+	if (hval_type(site) != hash_t)
 	{
 		hlog("eval_prop_set expected a hash");
 		exit(1);
 	}
 
-	hval *value = runtime_evaluate_expression(rt, set->value, context);
-	bool found = false;
-	hval *assign_site = site;
-	while (assign_site != NULL) {
-		if (hval_hash_get_direct(assign_site, set->ref->name, rt) != NULL) {
-			break;
-		} else {
-			assign_site = hval_hash_get_direct(assign_site, PARENT, rt);
+	prop_cache_entry *entry = prop_cache_find(ref, site);
+	hval *assign_site = NULL;
+	if (entry != NULL) {
+		assign_site = entry->holder ? entry->holder : site;
+		if (assign_site->slots[entry->slot] == NULL) {
+			assign_site = NULL;
+		}
+	}
+
+	if (assign_site != NULL) {
+		hval_slot_put(assign_site, entry->slot, value, rt->mem);
+	} else {
+		int slot;
+		assign_site = hval_hash_find_holder(site, ref->name, &slot, rt);
+		if (assign_site == NULL) {
+			assign_site = site;
+		} else if (slot >= 0) {
+			prop_cache_fill(ref, site, assign_site, slot);
 		}
+
+		hval_hash_put(assign_site, ref->name, value, rt->mem);
 	}
+}
 
-	if (assign_site == NULL) {
-		assign_site = site;
+/*
+ * Inline caches for prop_refs. An entry for the receiver's own member is
+ * good for as long as the receiver has the same shape. An entry for an
+ * inherited member also needs the receiver's parent to be unchanged and
+ * hval_prototype_epoch to match: every hval between the parent and the
+ * holder is flagged as a prototype when the entry is filled, and the
+ * epoch moves whenever one of those gains a member or a new parent.
+ */
+static prop_cache_entry *prop_cache_find(prop_ref *ref, hval *site)
+{
+	if (hval_is_immediate(site) || site->shape == NULL) {
+		return NULL;
 	}
 
-	hval_hash_put(assign_site, set->ref->name, value, rt->mem);
+	for (prop_cache_entry *entry = ref->cache, *max = ref->cache + PROP_CACHE_WAYS; entry < max; entry++) {
+		if (entry->shape != site->shape) {
+			continue;
+		}
 
-	mem_remove_gc_root(rt->mem, site);
-	return value;
+		if (entry->holder == NULL
+				|| (entry->epoch == hval_prototype_epoch && site->slots[entry->parent_slot] == entry->parent)) {
+			return entry;
+		}
+
+		return NULL;
+	}
+
+	return NULL;
+}
+
+static void prop_cache_fill(prop_ref *ref, hval *site, hval *holder, int slot)
+{
+	if (hval_is_immediate(site) || site->shape == NULL) {
+		return;
+	}
+
+	prop_cache_entry *entry = NULL;
+	for (int i = 0; i < PROP_CACHE_WAYS; i++) {
+		if (ref->cache[i].shape == site->shape) {
+			entry = ref->cache + i;
+			break;
+		}
+	}
+
+	if (entry == NULL) {
+		entry = ref->cache + ref->cache_next;
+		ref->cache_next = (ref->cache_next + 1) % PROP_CACHE_WAYS;
+	}
+
+	entry->shape = site->shape;
+	entry->slot = slot;
+	entry->holder = NULL;
+	entry->parent = NULL;
+	entry->parent_slot = -1;
+	if (holder != site) {
+		entry->holder = holder;
+		entry->parent_slot = shape_lookup(site->shape, PARENT);
+		entry->parent = site->slots[entry->parent_slot];
+		for (hval *hv = entry->parent; hv != holder; hv = hval_hash_get_direct(hv, PARENT, NULL)) {
+			if (!hval_is_immediate(hv)) {
+				hv->prototype = true;
+			}
+		}
+		holder->prototype = true;
+		entry->epoch = hval_prototype_epoch;
+	}
 }
 
 static hval *get_prop_ref_site(runtime *rt, prop_ref *ref, hval *context)
@@ -808,148 +1049,187 @@ static hval *get_prop_ref_site(runtime *rt, prop_ref *ref, hval *context)
 
 static hval *eval_expr_invocation(runtime *rt, invocation *inv, hval *context)
 {
+	mem *m = rt->mem;
 	hval *fn = runtime_evaluate_expression(rt, inv->function, context);
-	/*fprintf(stderr, "================== eval_expr_invocation\n");*/
-	mem_add_gc_root(rt->mem, fn);
 	if (fn == NULL)
 	{
 		return NULL;
 	}
 
-	// coalesce the provided args and the defaults into a hash
-	// for function invocation, order is irrelevent
-	list_hval *in_args = eval_expr_function_args(rt, inv->list_args, true, context);
-	/*mem_add_gc_root(rt->mem, in_args);*/
-	hval *args = runtime_build_function_arguments(rt, fn, in_args);
-	mem_add_gc_root(rt->mem, args);
+	// the argument values go on the root stack, which keeps them alive
+	// and doubles as the argv
+	hval **base = m->root_stack_top;
+	mem_push_root(m, fn);
+	int count = inv->list_args != NULL
+		? inv->list_args->operation.list_literal->size
+		: inv->hash_args->operation.hash_literal->size;
+	hstr *names[count + 1];
+	arguments args = { count, m->root_stack_top, NULL };
+	int i = 0;
+	if (inv->list_args != NULL) {
+		LL_FOREACH(inv->list_args->operation.list_literal, node) {
+			expression *arg_expr = (expression *) node->data;
+			names[i] = NULL;
+			if (arg_expr->type == expr_prop_set_t) {
+				names[i] = arg_expr->operation.prop_set->ref->name;
+				arg_expr = arg_expr->operation.prop_set->value;
+				args.names = names;
+			}
+			mem_push_root(m, runtime_evaluate_expression(rt, arg_expr, context));
+			i++;
+		}
+	} else {
+		// f{a: 1} passes the members of the hash literal as named arguments
+		hash_iterator iter;
+		hash_iterator_init(&iter, inv->hash_args->operation.hash_literal);
+		while (iter.current_key != NULL) {
+			names[i++] = iter.current_key;
+			mem_push_root(m, runtime_evaluate_expression(rt, iter.current_value, context));
+			hash_iterator_next(&iter);
+		}
+		args.names = names;
+	}
 
-	hval *result = runtime_call_function(rt, fn, args, context);
-	mem_remove_gc_root(rt->mem, (hval *) in_args);
-	mem_remove_gc_root(rt->mem, args);
-	mem_remove_gc_root(rt->mem, fn);
+	hval *result = runtime_call_function(rt, fn, &args, context);
+	m->root_stack_top = base;
 	return result;
 }
 
-hval *runtime_build_function_arguments(runtime *rt, hval *fn, list_hval *in_args) {
-	hval *args = NULL;
-	/*mem_add_gc_root(rt->mem, fn);*/
-	if (fn->type == native_function_t) {
-		// Native functions can manually extract named functions,
-		// but default values aren't supported yet.
-		args = (hval *) in_args;
+/*
+ * Binds the arguments into a new function's frame. Declared parameters
+ * are bound in declaration order, so every call lays out its frame the
+ * same way and the resolver's slot indexes hold.
+ */
+static void bind_arguments(runtime *rt, hval *fn, arguments *args, hval *frame)
+{
+	hval *declared = hval_hash_get(fn, FN_ARGS, rt);
+	int next_unnamed = 0;
+
+	if (hval_type(declared) == list_t) {
+		LL_FOREACH(hval_list_list(declared), defnode) {
+			hval *name = runtime_get_arg_name(defnode);
+			bind_parameter(rt, frame, args, &next_unnamed, name->value.str, runtime_get_arg_value(defnode));
+		}
 	} else {
-		args = hval_hash_create(rt);
-		list_hval *default_args = (list_hval *) hval_hash_get(fn, FN_ARGS, rt);
-		hval *name = NULL;
-		hval *value = NULL;
-		ll_node *node;
-		linked_list *unnamed = ll_create();
-
-		if (in_args) {
-			node = in_args->list->head;
-			while (node) {
-				value = runtime_get_arg_value(node);
-				name = runtime_get_arg_name(node);
-				if (name) {
-					hval_hash_put(args, name->value.str, value, rt->mem);
-				} else {
-					ll_insert_tail(unnamed, value);
-				}
-				node = node->next;
+		// fn({a: 1} ...) declares parameters and their defaults as a hash
+		hval_member_iterator iter;
+		hval_member_iterator_init(&iter, declared);
+		while (iter.current_key != NULL) {
+			if (iter.current_key != PARENT) {
+				bind_parameter(rt, frame, args, &next_unnamed, iter.current_key, iter.current_value);
 			}
+			hval_member_iterator_next(&iter);
 		}
+	}
 
-		/*fprintf(stderr, "++++++++++++++++++ fn: %p\tdefault_args: %p\n", fn, default_args);*/
-		node = default_args->list->head;
-		ll_node *unnamed_node = unnamed->head;
-		LL_FOREACH(default_args->list, defnode) {
-			name = runtime_get_arg_name(defnode);
-			value = hval_hash_get(args, name->value.str, rt);
-			// if a named argument was already bound for this, skip it
-			if (value) continue;
-
-			// otherwise, if there are any remaining unbound args, consume one
-			if (unnamed_node) {
-				value = (hval *) unnamed_node->data;
-				unnamed_node = unnamed_node->next;
-				ll_remove_first(unnamed, value);
-			} else {
-				// or just use the default, which may be null
-				value = runtime_get_arg_value(defnode);
-			}
+	// named arguments the function doesn't declare are still passed along
+	for (int i = 0; i < args->count; i++) {
+		hstr *name = runtime_arg_name(args, i);
+		if (name && hval_hash_get_direct(frame, name, rt) == NULL) {
+			hval_hash_put(frame, name, args->values[i], rt->mem);
+		}
+	}
+}
 
-			if (value == NULL) {
-				runtime_error("No value provided for parameter %s\n", name->value.str->str);
+/*
+ * Binds one declared parameter: a named argument wins, then the next
+ * unnamed one, then the default.
+ */
+static void bind_parameter(runtime *rt, hval *frame, arguments *args, int *next_unnamed, hstr *name, hval *default_value)
+{
+	hval *value = NULL;
+	int i = 0;
+	if (args->names != NULL) {
+		for (i = 0; i < args->count; i++) {
+			if (args->names[i] && hstr_comparator(args->names[i], name)) {
+				value = args->values[i];
+				break;
 			}
-			hval_hash_put(args, name->value.str, value, rt->mem);
 		}
+	}
+
+	if (value == NULL) {
+		for (i = *next_unnamed; i < args->count && runtime_arg_name(args, i); i++)
+			;
+
+		if (i < args->count) {
+			value = args->values[i];
+			*next_unnamed = i + 1;
+		} else {
+			*next_unnamed = args->count;
+			// or just use the default, which may be null
+			value = default_value;
+		}
+	}
 
-		ll_destroy(unnamed, NULL, NULL);
+	if (value == NULL) {
+		runtime_error("No value provided for parameter %s\n", name->str);
 	}
-	/*mem_remove_gc_root(rt->mem, fn);*/
 
-	return args;
+	hval_hash_put(frame, name, value, rt->mem);
 }
 
-hval *runtime_call_function(runtime *rt, hval *fn, hval *args, hval *context)
+/*
+ * The caller keeps fn and the argument values alive for the duration of
+ * the call. args may be NULL when there are none.
+ */
+hval *runtime_call_function(runtime *rt, hval *fn, arguments *args, hval *context)
 {
-	/*static int gc_count = 0;*/
-	if (!args &&  fn->type == native_function_t) {
-		args = hval_list_create(rt);
-	}
-
-	if (args) {
-		mem_add_gc_root(rt->mem, args);
+	arguments none = { 0, NULL, NULL };
+	if (args == NULL) {
+		args = &none;
 	}
 
-	hval *result = NULL;
-	if (fn->type == native_function_t) {
+	if (hval_type(fn) == native_function_t) {
 		hval *self = hval_get_self(fn);
-		result = fn->value.native_fn(self, args);
-	} else {
-		result = eval_expr_folly_invocation(rt, fn, args, context);
+		return fn->value.native_fn(self, args);
 	}
 
-	if (args) {
-		mem_remove_gc_root(rt->mem, args);
-	}
-	/*if (++gc_count == 1000) {*/
-		/*gc_count = 0;*/
-		/*gc_with_temp_root(rt->mem, result);*/
-	/*}*/
-	return result;
+	return eval_expr_folly_invocation(rt, fn, args, context);
 }
 
-hval *runtime_call_hnamed_function(runtime *rt, hstr *name, hval *site, list_hval *args, hval *context) {
+hval *runtime_call_hnamed_function(runtime *rt, hstr *name, hval *site, arguments *args, hval *context) {
+	hval **base = rt->mem->root_stack_top;
 	hval *func = hval_hash_get(site, name, rt);
-	hval *prepared_args = runtime_build_function_arguments(rt, func, args);
-	return runtime_call_function(rt, func, prepared_args, context);
-	//return runtime_call_function(rt, func, args, context);
+	mem_push_root(rt->mem, func);
+	hval *result = runtime_call_function(rt, func, args, context);
+	rt->mem->root_stack_top = base;
+	return result;
 }
 
-static hval *eval_expr_folly_invocation(runtime *rt, hval *fn, hval *args, hval *context)
+static hval *eval_expr_folly_invocation(runtime *rt, hval *fn, arguments *args, hval *context)
 {
+	hval **base = rt->mem->root_stack_top;
 	hval *expr = hval_hash_get(fn, FN_EXPR, rt);
 	hval *fn_context = hval_hash_create_child(expr->value.deferred_expression.ctx, rt);
-	mem_add_gc_root(rt->mem, fn_context);
-	if (args->type == hash_t) {
-		hval_hash_put_all(fn_context, args, rt->mem);
-		hval *self = hval_get_self(fn);
-		hval_hash_put(fn_context, FN_SELF, self, rt->mem);
-	}
+	mem_push_root(rt->mem, fn_context);
+	bind_arguments(rt, fn, args, fn_context);
+	hval *self = hval_get_self(fn);
+	hval_hash_put(fn_context, FN_SELF, self, rt->mem);
 
-	hval *result = eval_expr_list(rt, expr->value.deferred_expression.expr->operation.list_literal, fn_context);
-	mem_remove_gc_root(rt->mem, fn_context);
+	hval *result = NULL;
+	if (rt->eval_mode == EVAL_VM) {
+		result = vm_evaluate_body(rt, expr->value.deferred_expression.expr, fn_context);
+	} else {
+		result = eval_expr_list(rt, expr->value.deferred_expression.expr->operation.list_literal, fn_context);
+	}
+	rt->mem->root_stack_top = base;
 
 	return result;
 }
 
 static hval *eval_expr_deferred(runtime *rt, expression *deferred, hval *context)
+{
+	return runtime_defer(rt, deferred, context);
+}
+
+hval *runtime_defer(runtime *rt, expression *deferred, hval *context)
 {
 	hval *val = hval_create(deferred_expression_t, rt);
 	val->value.deferred_expression.expr = deferred;
 	expr_retain(deferred);
 	val->value.deferred_expression.ctx = context;
+	mem_write_barrier(rt->mem, val, context);
 	return val;
 }
 
@@ -992,30 +1272,20 @@ static void expect_token(token *t, token_type token_type)
 
 NATIVE_FUNCTION(native_print)
 {
-	hstr *name = hstr_create("to_string");
+	hstr *name = hstr_intern("to_string");
 	hval *str = NULL;
-	if (args->type == hash_t) {
-		printf("can't print a hash yet");
-	} else {
-		ll_node *node = ((list_hval *)args)->list->head;
-		hval *arg = NULL;
-		bool printed_any = false;
-		while (node) {
-			if (printed_any) {
-				printf(" ");
-			}
-			printed_any = true;
-
-			arg = runtime_get_arg_value(node);
-			str = runtime_call_hnamed_function(CURRENT_RUNTIME, name, arg, NULL, CURRENT_RUNTIME->top_level);
-			fputs(str->value.str->str, stdout);
-			hval_release(str, CURRENT_RUNTIME->mem);
-			str = NULL;
-			node = node->next;
-		}
-		if (printed_any) {
-			fputc('\n', stdout);
+	for (int i = 0; i < args->count; i++) {
+		if (i > 0) {
+			printf(" ");
 		}
+
+		str = runtime_call_hnamed_function(CURRENT_RUNTIME, name, args->values[i], NULL, CURRENT_RUNTIME->top_level);
+		fputs(str->value.str->str, stdout);
+		hval_release(str, CURRENT_RUNTIME->mem);
+		str = NULL;
+	}
+	if (args->count > 0) {
+		fputc('\n', stdout);
 	}
 
 	hstr_release(name);
@@ -1026,12 +1296,8 @@ NATIVE_FUNCTION(native_print)
 NATIVE_FUNCTION(native_add)
 {
 	int sum = 0;
-	ll_node *current = ((list_hval *)args)->list->head;
-	hval *item = NULL;
-	while (current) {
-		item = runtime_get_arg_value(current);
-		sum += item->value.number;
-		current = current->next;
+	for (int i = 0; i < args->count; i++) {
+		sum += hval_number_value(args->values[i]);
 	}
 
 	return hval_number_create(sum, CURRENT_RUNTIME);
@@ -1040,21 +1306,14 @@ NATIVE_FUNCTION(native_add)
 NATIVE_FUNCTION(native_subtract)
 {
 	int val = 0;
-	linked_list *arglist = hval_list_list(args);
-	hval *hv = NULL;
-	if (arglist->size == 0) {
+	if (args->count == 0) {
 		val = 0;
-	} else if (arglist->size == 1) {
-		hv = runtime_get_arg_value(arglist->head);
-		val = -hval_number_value(hv);
+	} else if (args->count == 1) {
+		val = -hval_number_value(args->values[0]);
 	} else 	{
-		hv = runtime_get_arg_value(arglist->head);
-		val = hval_number_value(hv);
-		ll_node *current = arglist->head->next;
-		while (current) {
-			hv = runtime_get_arg_value(current);
-			val = val - hval_number_value(hv);
-			current = current->next;
+		val = hval_number_value(args->values[0]);
+		for (int i = 1; i < args->count; i++) {
+			val = val - hval_number_value(args->values[i]);
 		}
 	}
 
@@ -1062,26 +1321,25 @@ NATIVE_FUNCTION(native_subtract)
 }
 
 NATIVE_FUNCTION(native_equals) {
-	if (args->type != list_t || hval_list_size(args) < 2) {
-		runtime_error("native_equals: arguments must be a list with at least 2 elements\n");
+	if (args->count < 2) {
+		runtime_error("native_equals: expected at least 2 arguments\n");
 	}
 
 	// TODO Make this polymorphic, using an = method on objects
-	hval *ref = runtime_get_arg_value(hval_list_head(args));
+	hval *ref = args->values[0];
 	hval *candidate = NULL;
 	bool equals = true;
-	ll_node *node = hval_list_head(args)->next;
-	while (node && equals) {
-		candidate = runtime_get_arg_value(node);
-		if (ref->type != candidate->type) {
+	for (int i = 1; i < args->count && equals; i++) {
+		candidate = args->values[i];
+		if (hval_type(ref) != hval_type(candidate)) {
 			/*runtime_error("type mismatch in native_equals\n");*/
 			equals = false;
 			break;
 		}
 
-		switch (ref->type) {
+		switch (hval_type(ref)) {
 		case number_t:
-			equals = ref->value.number == candidate->value.number;
+			equals = hval_number_value(ref) == hval_number_value(candidate);
 			break;
 		case string_t:
 			equals = strcmp(ref->value.str->str, candidate->value.str->str) == 0;
@@ -1090,8 +1348,6 @@ NATIVE_FUNCTION(native_equals) {
 			equals = ref == candidate;
 			break;
 		}
-
-		node = node->next;
 	}
 
 	return hval_number_create(equals ? 1 : 0, CURRENT_RUNTIME);
@@ -1108,7 +1364,7 @@ static NATIVE_FUNCTION(native_lt)
 	hval *arg2 = NULL;
 	extract_arg_list(CURRENT_RUNTIME, args, &arg1, number_t, &arg2, number_t, NULL);
 	
-	bool lt = arg1->value.number < arg2->value.number;
+	bool lt = hval_number_value(arg1) < hval_number_value(arg2);
 	return hval_number_create(lt ? 1 : 0, CURRENT_RUNTIME);
 }
 
@@ -1117,7 +1373,7 @@ static NATIVE_FUNCTION(native_gt)
 	hval *arg1 = NULL;
 	hval *arg2 = NULL;
 	extract_arg_list(CURRENT_RUNTIME, args, &arg1, number_t, &arg2, number_t, NULL);
-	bool gt = arg1->value.number > arg2->value.number;
+	bool gt = hval_number_value(arg1) > hval_number_value(arg2);
 	return hval_number_create(gt ? 1 : 0, CURRENT_RUNTIME);
 }
 
@@ -1125,8 +1381,12 @@ static NATIVE_FUNCTION(native_fn)
 {
 	hval *fn = hval_hash_create(CURRENT_RUNTIME);
 
-	hval_hash_put(fn, FN_ARGS, hval_list_head_hval(args), CURRENT_RUNTIME->mem);
-	hval_hash_put(fn, FN_EXPR, hval_list_tail_hval(args), CURRENT_RUNTIME->mem);
+	if (args->count == 0) {
+		runtime_error("fn: expected parameters and a body\n");
+	}
+
+	hval_hash_put(fn, FN_ARGS, args->values[0], CURRENT_RUNTIME->mem);
+	hval_hash_put(fn, FN_EXPR, args->values[args->count - 1], CURRENT_RUNTIME->mem);
 	return fn;
 }
 
@@ -1139,15 +1399,13 @@ static NATIVE_FUNCTION(native_extend)
 {
 	hlog("native_extend: %p\n", this);
 	hval *sub = hval_hash_create_child(this, CURRENT_RUNTIME);
-	hash_iterator *iter = hash_iterator_create(args->members);
-	while (iter->current_key) {
-		if (iter->current_key != PARENT) {
-			hval_hash_put(sub, iter->current_key, iter->current_value, CURRENT_RUNTIME->mem);
+	for (int i = 0; i < args->count; i++) {
+		hstr *name = runtime_arg_name(args, i);
+		if (name != NULL && name != PARENT) {
+			hval_hash_put(sub, name, args->values[i], CURRENT_RUNTIME->mem);
 		}
-		hash_iterator_next(iter);
 	}
 
-	hash_iterator_destroy(iter);
 	return sub;
 
 }
@@ -1170,7 +1428,7 @@ static NATIVE_FUNCTION(native_string_to_string) {
 
 static NATIVE_FUNCTION(native_number_to_string)
 {
-	char *str = fmt("%d", this->value.number);
+	char *str = fmt("%d", hval_number_value(this));
 	hstr *hs = hstr_create(str);
 	free(str);
 	str = NULL;
@@ -1181,16 +1439,11 @@ static NATIVE_FUNCTION(native_number_to_string)
 
 static NATIVE_FUNCTION(native_cond)
 {
-	if (args->type != list_t) {
-		runtime_error("native_cond: argument mismatch: expected list");
-	}
-
-	ll_node *test_node = hval_list_head(args);
-	while (test_node) {
-		/*hval *cond_hval = (hval *) test_node->data;*/
-		/*fprintf(stderr, " getting arg value from %p %p\n", test_node, test_node->data);*/
-		list_hval *cond_hval = (list_hval *) runtime_get_arg_value(test_node);
-		/*fprintf(stderr, " test_node: %p %p; cond_hval: %p\n", test_node, test_node->data, cond_hval);*/
+	for (int i = 0; i < args->count; i++) {
+		list_hval *cond_hval = (list_hval *) args->values[i];
+		if (hval_type((hval *) cond_hval) != list_t) {
+			runtime_error("native_cond: argument mismatch: expected list");
+		}
 		linked_list *cond_pair = cond_hval->list;
 
 		/*hval *test = undefer(CURRENT_RUNTIME, hval_list_head_hval(cond_pair));*/
@@ -1200,8 +1453,6 @@ static NATIVE_FUNCTION(native_cond)
 			return cond_pair->head != cond_pair->tail ? undefer(CURRENT_RUNTIME, (hval *) cond_pair->tail->data) : test;
 			break;
 		}
-
-		test_node = test_node->next;
 	}
 	fprintf(stderr, "-- native_cond %p done", args);
 	
@@ -1224,33 +1475,26 @@ NATIVE_FUNCTION(native_while)
 }
 
 static hval *undefer(runtime *rt, hval *maybe_deferred) {
-	mem_add_gc_root(CURRENT_RUNTIME->mem, maybe_deferred);
-	if (maybe_deferred->type == deferred_expression_t) {
+	if (hval_type(maybe_deferred) == deferred_expression_t) {
+		hval **base = CURRENT_RUNTIME->mem->root_stack_top;
+		mem_push_root(CURRENT_RUNTIME->mem, maybe_deferred);
 		deferred_expression *def = &(maybe_deferred->value.deferred_expression);
 		hval *result = runtime_evaluate_expression(CURRENT_RUNTIME, def->expr, def->ctx);
-		mem_remove_gc_root(CURRENT_RUNTIME->mem, maybe_deferred);
+		CURRENT_RUNTIME->mem->root_stack_top = base;
 		return result;
 	}
 
-	mem_remove_gc_root(CURRENT_RUNTIME->mem, maybe_deferred);
 	return maybe_deferred;
 }
 
 NATIVE_FUNCTION(native_and)
 {
-	if (args->type != list_t) {
-		runtime_error("argument mismatch: expected list\n");
-	}
-
-	ll_node *node = hval_list_head(args);
 	bool result = true;
-	while (node && result) {
-		hval *current = runtime_get_arg_value(node);
-		current = undefer(CURRENT_RUNTIME, current);
+	for (int i = 0; i < args->count && result; i++) {
+		hval *current = undefer(CURRENT_RUNTIME, args->values[i]);
 		if (!hval_is_true(current)) {
 			result = false;
 		}
-		node = node->next;
 	}
 
 	return hval_number_create(result ? 1 : 0, CURRENT_RUNTIME);
@@ -1258,19 +1502,12 @@ NATIVE_FUNCTION(native_and)
 
 NATIVE_FUNCTION(native_or)
 {
-	if (args->type != list_t) {
-		runtime_error("argument mismatch: expected list\n");
-	}
-
-	ll_node *node = hval_list_head(args);
 	bool result = false;
-	while (node && !result) {
-		hval *current = runtime_get_arg_value(node);
-		current = undefer(CURRENT_RUNTIME, current);
+	for (int i = 0; i < args->count && !result; i++) {
+		hval *current = undefer(CURRENT_RUNTIME, args->values[i]);
 		if (hval_is_true(current)) {
 			result = true;
 		}
-		node = node->next;
 	}
 
 	return hval_number_create(result ? 1 : 0, CURRENT_RUNTIME);
@@ -1278,35 +1515,24 @@ NATIVE_FUNCTION(native_or)
 
 NATIVE_FUNCTION(native_not)
 {
-	if (args->type != list_t) {
-		runtime_error("argument mismatch: expected list\n");
-	}
-
-	if (hval_list_size(args) != 1) {
+	if (args->count != 1) {
 		runtime_error("argument count mismatch: not() accepts exactly 1\n");
 	}
 
-	hval *value = runtime_get_arg_value(hval_list_head(args));
+	hval *value = args->values[0];
 	return hval_number_create(hval_is_true(value) ? 0 : 1, CURRENT_RUNTIME);
 }
 
 NATIVE_FUNCTION(native_xor)
 {
-	if (args->type != list_t) {
-		runtime_error("argument mismatch: expected list\n");
-	}
-	ll_node *node = hval_list_head(args);
 	int truths = 0;
-	while (node) {
-		hval *val = runtime_get_arg_value(node);
-		if (hval_is_true(val)) {
+	for (int i = 0; i < args->count; i++) {
+		if (hval_is_true(args->values[i])) {
 			++truths;
 			if (truths > 1) {
 				break;
 			}
 		}
-
-		node = node->next;
 	}
 
 	return hval_number_create(truths == 1 ? 1 : 0, CURRENT_RUNTIME);
@@ -1327,20 +1553,8 @@ NATIVE_FUNCTION(native_load)
 		/*context = hval_hash_get(args, key_into, CURRENT_RUNTIME);*/
 	/*}*/
 
-	char *filename = file->value.str->str;
-	struct stat stat_buf;
-	int err = stat(filename, &stat_buf);
-	if (err == -1) {
-		perror("Unable to open file");
-		return hval_hash_get(CURRENT_RUNTIME->top_level, FALSE, CURRENT_RUNTIME);
-	} else if (!S_ISREG(stat_buf.st_mode)) {
-		return hval_hash_get(CURRENT_RUNTIME->top_level, FALSE, CURRENT_RUNTIME);
-	}
-
-	lexer_input *input = lexer_file_input_create(filename);
-	runtime_load_module(CURRENT_RUNTIME, input);
-	lexer_input_destroy(input);
-	return hval_hash_get(CURRENT_RUNTIME->top_level, TRUE, CURRENT_RUNTIME);
+	bool loaded = runtime_load_module(CURRENT_RUNTIME, file->value.str->str);
+	return hval_hash_get(CURRENT_RUNTIME->top_level, loaded ? TRUE : FALSE, CURRENT_RUNTIME);
 }
 
 NATIVE_FUNCTION(native_show_heap)
@@ -1352,13 +1566,12 @@ NATIVE_FUNCTION(native_show_heap)
 
 static NATIVE_FUNCTION(native_string_concat)
 {
-	hstr *name = hstr_create("to_string");
+	hstr *name = hstr_intern("to_string");
 	buffer *buf = buffer_create(128);
-	hval *arg = NULL, *arg_str;
+	hval *arg_str = NULL;
 	/*char *arg_str = NULL;*/
-	LL_FOREACH(hval_list_list(args), arg_node) {
-		arg = runtime_get_arg_value(arg_node);
-		arg_str = runtime_call_hnamed_function(CURRENT_RUNTIME, name, arg, NULL, CURRENT_RUNTIME->top_level);
+	for (int i = 0; i < args->count; i++) {
+		arg_str = runtime_call_hnamed_function(CURRENT_RUNTIME, name, args->values[i], NULL, CURRENT_RUNTIME->top_level);
 		/*arg_str = hval_to_string(arg);*/
 		buffer_append_string(buf, arg_str->value.str->str);
 		hval_release(arg_str, CURRENT_RUNTIME->mem);
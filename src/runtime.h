@@ -1,6 +1,8 @@
 #ifndef RUNTIME_H
 #define RUNTIME_H
 
+#include <sys/types.h>
+#include <time.h>
 #include "type.h"
 #include "lexer.h"
 #include "mm.h"
@@ -30,18 +32,39 @@ typedef struct _native_function_spec {
 
 runtime *__current_runtime;
 
+/*
+ * A module run by sys.load, identified by its file so that loading it
+ * again does nothing. The source's size and mtime are kept for heap
+ * images, which are only used while their modules are unchanged. expr
+ * is NULL for a module restored from an image that didn't need it.
+ */
+typedef struct loaded_module {
+	char *filename;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	expression *expr;
+} loaded_module;
+
 runtime *runtime_create();
 void runtime_destroy();
 hval *runtime_exec(runtime *runtime, lexer_input *lexer);
-hval *runtime_load_module(runtime *runtime, lexer_input *lexer);
+bool runtime_load_module(runtime *runtime, char *filename);
+void runtime_add_module(runtime *runtime, loaded_module *module);
 hval *runtime_exec_one(runtime *runtime, lexer_input *input, bool *terminated);
 hval *runtime_eval_token(token *token, runtime *runtime, hval *context, hval *last_result);
 hval *runtime_eval_identifier(token *token, runtime *runtime, hval *context);
-hval *runtime_call_function(runtime *runtime, hval *fn, hval *args, hval *context);
-hval *runtime_call_hnamed_function(runtime *runtime, hstr *name, hval *site, list_hval *args, hval *context);
+hval *runtime_call_function(runtime *runtime, hval *fn, arguments *args, hval *context);
+hval *runtime_call_hnamed_function(runtime *runtime, hstr *name, hval *site, arguments *args, hval *context);
 void runtime_init_globals();
 void runtime_destroy_globals();
-hval *runtime_build_function_arguments(runtime *runtime, hval *fn, list_hval *in_args);
+hval *runtime_get_property(runtime *runtime, prop_ref *ref, hval *site);
+void runtime_set_property(runtime *runtime, prop_ref *ref, hval *site, hval *value);
+hval *runtime_create_function(runtime *runtime, hval *args, expression *body, hval *context);
+hval *runtime_defer(runtime *runtime, expression *expr, hval *context);
+void runtime_set_eval_mode(runtime *runtime, eval_mode mode);
+void runtime_set_gc_pause(runtime *runtime, long max_pause_us);
 
 #define CURRENT_RUNTIME __current_runtime
 #endif
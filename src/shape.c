@@ -0,0 +1,127 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+#include "shape.h"
+#include "smalloc.h"
+
+static shape *root_shape = NULL;
+
+static shape *shape_create(shape *parent, hstr *key);
+static void shape_destroy(shape *s);
+static void shape_build_index(shape *s);
+
+shape *shape_root()
+{
+	if (root_shape == NULL) {
+		root_shape = shape_create(NULL, NULL);
+	}
+
+	return root_shape;
+}
+
+static shape *shape_create(shape *parent, hstr *key)
+{
+	shape *s = smalloc(sizeof(shape));
+	s->parent = parent;
+	s->key = key;
+	s->index = NULL;
+	s->transitions = NULL;
+	if (parent == NULL) {
+		s->count = 0;
+		s->keys = NULL;
+	} else {
+		s->count = parent->count + 1;
+		s->keys = smalloc(sizeof(hstr *) * s->count);
+		// the root shape has no keys to copy
+		if (parent->count > 0) {
+			memcpy(s->keys, parent->keys, sizeof(hstr *) * parent->count);
+		}
+		s->keys[parent->count] = key;
+	}
+
+	return s;
+}
+
+shape *shape_add(shape *s, hstr *key)
+{
+	if (s->transitions == NULL) {
+		s->transitions = hash_create((hash_function) hstr_hash, (key_comparator) hstr_comparator);
+	}
+
+	shape *child = hash_get(s->transitions, key);
+	if (child == NULL) {
+		// shapes are shared runtime-wide, so hold on to an interned key
+		hstr *interned = key->interned ? key : hstr_intern(key->str);
+		if (interned == key) {
+			hstr_retain(key);
+		}
+
+		child = shape_create(s, interned);
+		hash_put(s->transitions, interned, child);
+		hlog("shape_add: %p + %s -> %p (%d slots)\n", s, key->str, child, child->count);
+	}
+
+	return child;
+}
+
+int shape_lookup(shape *s, hstr *key)
+{
+	if (s->count <= SHAPE_LINEAR_LOOKUP_MAX) {
+		for (int i = s->count - 1; i >= 0; i--) {
+			if (hstr_comparator(s->keys[i], key)) {
+				return i;
+			}
+		}
+
+		return -1;
+	}
+
+	if (s->index == NULL) {
+		shape_build_index(s);
+	}
+
+	intptr_t slot = (intptr_t) hash_get(s->index, key);
+	return (int) slot - 1;
+}
+
+static void shape_build_index(shape *s)
+{
+	s->index = hash_create((hash_function) hstr_hash, (key_comparator) hstr_comparator);
+	for (intptr_t i = 0; i < s->count; i++) {
+		hash_put(s->index, s->keys[i], (void *) (i + 1));
+	}
+}
+
+void shape_destroy_all()
+{
+	if (root_shape != NULL) {
+		shape_destroy(root_shape);
+		root_shape = NULL;
+	}
+}
+
+static void shape_destroy(shape *s)
+{
+	if (s->transitions != NULL) {
+		hash_iterator *iter = hash_iterator_create(s->transitions);
+		while (iter->current_key) {
+			shape_destroy(iter->current_value);
+			hash_iterator_next(iter);
+		}
+
+		hash_iterator_destroy(iter);
+		hash_destroy(s->transitions, NULL, NULL, NULL, NULL);
+	}
+
+	if (s->index != NULL) {
+		hash_destroy(s->index, NULL, NULL, NULL, NULL);
+	}
+
+	if (s->key != NULL) {
+		hstr_release(s->key);
+	}
+
+	free(s->keys);
+	free(s);
+}
@@ -0,0 +1,41 @@
+#ifndef SHAPE_H
+#define SHAPE_H
+
+#include "ht.h"
+#include "str.h"
+
+/*
+ * Once an object holds more than this many members it leaves the shape
+ * tree and keeps its members in a private hash instead (dictionary mode).
+ */
+#define SHAPE_MAX_SLOTS 32
+
+/*
+ * Shapes above this size build a key -> slot hash on first lookup; smaller
+ * ones are searched linearly.
+ */
+#define SHAPE_LINEAR_LOOKUP_MAX 8
+
+/*
+ * A shape (hidden class) describes the key layout of a family of objects:
+ * every object that received the same keys in the same order shares one
+ * shape and only stores its values, in slot order. Shapes form a tree
+ * rooted at the empty shape; adding a key follows (or creates) a cached
+ * transition to a child shape. Shapes are never mutated once created.
+ */
+typedef struct shape shape;
+struct shape {
+	shape *parent;
+	hstr *key;		// key added by the transition from parent; NULL for the root
+	int count;		// number of slots
+	hstr **keys;		// keys[i] is the key stored in slot i
+	hash *index;		// key -> slot + 1, built lazily for larger shapes
+	hash *transitions;	// key -> child shape, created lazily
+};
+
+shape *shape_root();
+shape *shape_add(shape *s, hstr *key);
+int shape_lookup(shape *s, hstr *key);
+void shape_destroy_all();
+
+#endif
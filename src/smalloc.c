@@ -13,3 +13,15 @@ smalloc(size_t size)
 
 	return m;
 }
+
+void *
+srealloc(void *ptr, size_t size)
+{
+	void *m = realloc(ptr, size);
+	if (m == NULL) {
+		perror("Unable to allocate memory");
+		exit(1);
+	}
+
+	return m;
+}
@@ -3,4 +3,7 @@
 void *
 smalloc(size_t size);
 
+void *
+srealloc(void *ptr, size_t size);
+
 #endif
@@ -1,8 +1,17 @@
 #include "str.h"
 #include <stdlib.h>
 #include <string.h>
+#include "ht.h"
+#include "ht_builtins.h"
 #include "smalloc.h"
 
+static hash *intern_table = NULL;
+
+typedef struct intern_probe {
+	const char *chars;
+	size_t len;
+} intern_probe;
+
 hstr *hstr_create(char *chars)
 {
 	return hstr_create_len(chars, strlen(chars));
@@ -17,11 +26,15 @@ hstr *hstr_create_len(char *src, size_t size)
 
 void hstr_init(hstr *hs, char *chars, size_t len)
 {
+	// copied up to the first NUL, as strncpy would
+	len = strnlen(chars, len);
 	hs->refs = 1;
+	memcpy(hs->str, chars, len);
 	hs->str[len] = '\0';
+	hs->len = len;
 	hs->hash_calculated = false;
+	hs->interned = false;
 	hs->hash = 0;
-	strncpy(hs->str, chars, len);
 }
 
 void hstr_retain(hstr *hs)
@@ -45,7 +58,71 @@ char *hstr_to_str(hstr *hs)
 	return str;
 }
 
+unsigned int hstr_hash(hstr *hs)
+{
+	if (!hs->hash_calculated) {
+		hs->hash = hash_bytes(hs->str, hs->len);
+		hs->hash_calculated = true;
+	}
+	return hs->hash;
+}
+
 bool hstr_comparator(hstr *h1, hstr *h2)
 {
+	if (h1 == h2) {
+		return true;
+	}
+
+	// distinct interned strings never have the same contents
+	if (h1->interned && h2->interned) {
+		return false;
+	}
+
 	return strcmp(h1->str, h2->str) == 0;
 }
+
+hstr *hstr_intern(char *chars)
+{
+	return hstr_intern_len(chars, strlen(chars));
+}
+
+static bool intern_matches(hstr *interned, intern_probe *probe)
+{
+	return interned->len == probe->len && memcmp(interned->str, probe->chars, probe->len) == 0;
+}
+
+hstr *hstr_intern_len(char *chars, size_t len)
+{
+	if (intern_table == NULL) {
+		intern_table = hash_create((hash_function) hstr_hash, (key_comparator) hstr_comparator);
+	}
+
+	// most names are already interned, so they're looked up by their
+	// characters, and an hstr only made for a new one
+	intern_probe probe = { chars, len };
+	hstr *interned = hash_get_hashed(intern_table, hash_bytes(chars, len), (key_comparator) intern_matches, &probe);
+	if (interned == NULL) {
+		// chars with a NUL in them are found here, as what's before it
+		hstr *candidate = hstr_create_len(chars, len);
+		interned = hash_get(intern_table, candidate);
+		if (interned != NULL) {
+			hstr_release(candidate);
+		} else {
+			// the table keeps the initial reference
+			interned = candidate;
+			interned->interned = true;
+			hash_put(intern_table, interned, interned);
+		}
+	}
+
+	hstr_retain(interned);
+	return interned;
+}
+
+void hstr_intern_destroy()
+{
+	if (intern_table != NULL) {
+		hash_destroy(intern_table, (destructor) hstr_release, NULL, NULL, NULL);
+		intern_table = NULL;
+	}
+}
@@ -6,7 +6,10 @@
 typedef struct {
 	int refs;
 	bool hash_calculated;
-	int hash;
+	bool interned;
+	unsigned int hash;
+	// the length of str, which ends at its first NUL
+	unsigned int len;
 	char str[];
 } hstr;
 
@@ -16,6 +19,17 @@ void hstr_init(hstr *, char *, size_t);
 void hstr_retain(hstr *);
 void hstr_release(hstr *);
 char *hstr_to_str(hstr *);
+unsigned int hstr_hash(hstr *);
 bool hstr_comparator(hstr *, hstr *);
 
+/*
+ * Interned strings are shared runtime-wide: every call with the same
+ * characters returns the same hstr (retained for the caller), so two
+ * interned keys are equal exactly when their pointers are. Identifiers,
+ * member names and the type globals are interned.
+ */
+hstr *hstr_intern(char *);
+hstr *hstr_intern_len(char *, size_t);
+void hstr_intern_destroy();
+
 #endif
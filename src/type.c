@@ -12,17 +12,15 @@
 #include "log.h"
 #include "mm.h"
 #include "type.h"
+#include "vm.h"
 #include "modules/list.h"
 
-typedef struct {
-	mem *mem;
-	bool destroy_hvals;
-} expr_destructor_context;
-
-static char *hval_hash_to_string(hash *h);
+static char *hval_hash_to_string(hval *hv);
 static char *hval_list_to_string(linked_list *h);
 void print_hash_member(hash *h, hstr *key, hval *value, buffer *b);
-static void prop_ref_destroy(prop_ref *ref, bool destroy_hvals, mem *m);
+static hval *hval_immediate_prototype(hval *hv, runtime *rt);
+static void hval_ensure_slots(hval *hv, int count);
+static void hval_members_to_dictionary(hval *hv);
 
 #if HVAL_STATS
 static int hval_create_count = 0;
@@ -33,19 +31,19 @@ static int hval_reuse_count = 0;
 
 void type_init_globals()
 {
-	FN_SELF = hstr_create("self");
-	FN_ARGS = hstr_create("__args__");
-	FN_EXPR = hstr_create("__expr__");
-	PARENT = hstr_create("__parent__");
-	STRING = hstr_create("String");
-	NUMBER = hstr_create("Number");
-	BOOLEAN = hstr_create("Boolean");
-	TRUE = hstr_create("true");
-	FALSE = hstr_create("false");
-	NAME = hstr_create("name");
-	VALUE = hstr_create("value");
-	LENGTH = hstr_create("length");
-	LIST = hstr_create("List");
+	FN_SELF = hstr_intern("self");
+	FN_ARGS = hstr_intern("__args__");
+	FN_EXPR = hstr_intern("__expr__");
+	PARENT = hstr_intern("__parent__");
+	STRING = hstr_intern("String");
+	NUMBER = hstr_intern("Number");
+	BOOLEAN = hstr_intern("Boolean");
+	TRUE = hstr_intern("true");
+	FALSE = hstr_intern("false");
+	NAME = hstr_intern("name");
+	VALUE = hstr_intern("value");
+	LENGTH = hstr_intern("length");
+	LIST = hstr_intern("List");
 }
 
 void type_destroy_globals()
@@ -75,16 +73,24 @@ const char *hval_type_string(type t)
 		case hash_t:			return "hash";
 		case native_function_t:		return "native function";
 		case deferred_expression_t:	return "deferred expression";
+		case boolean_t:			return "boolean";
 		default:			return "unknown";
 	}
 }
 
 hval *hval_clone(hval *val, runtime *rt) {
 	hlog("hval_clone: %p\n", val);
+	if (hval_is_immediate(val)) {
+		return val;
+	}
+
 #if HVAL_STATS
 	hval_clone_count++;
 #endif
+	hval **base = rt->mem->root_stack_top;
 	hval *clone = hval_create(val->type, rt);
+	// binding the members clones functions, which can trigger a collection
+	mem_push_root(rt->mem, clone);
 	switch (val->type) {
 	case hash_t:
 		hval_clone_hash(val, clone, rt);
@@ -99,25 +105,24 @@ hval *hval_clone(hval *val, runtime *rt) {
 		break;
 	}
 
+	rt->mem->root_stack_top = base;
 	return clone;
 }
 
 void hval_clone_hash(hval *src, hval *dest, runtime *rt) {
-	hash_iterator *iter = hash_iterator_create(src->members);
-	while (iter->current_key) {
-		hval *value = iter->current_value;
+	hval_member_iterator iter;
+	hval_member_iterator_init(&iter, src);
+	while (iter.current_key) {
+		hval *value = iter.current_value;
 
 		if (value && hval_is_callable(value) && (hval_get_self(value) == src || hval_get_self(value) == NULL)) {
 			/*fprintf(stderr, "bind func %p; default args %p\n", value, hval_hash_get(value, FN_ARGS, rt));*/
-			value = hval_clone(value, rt);
-			hval_bind_function(value, dest, rt->mem);
+			value = hval_bind_method(value, dest, rt);
 		}
-		hval_hash_put(dest, iter->current_key, value, rt->mem);
+		hval_hash_put(dest, iter.current_key, value, rt->mem);
 
-		hash_iterator_next(iter);
+		hval_member_iterator_next(&iter);
 	}
-
-	hash_iterator_destroy(iter);
 }
 
 hval *hval_string_create(hstr *str, runtime *rt)
@@ -133,19 +138,21 @@ hval *hval_string_create(hstr *str, runtime *rt)
 
 hval *hval_number_create(int number, runtime *rt)
 {
-	hval *hv = hval_hash_create_child(hval_hash_get(rt->top_level, NUMBER, rt), rt);
-	hv->type = number_t;
-	/*hval *hv = hval_create(number_t, rt);*/
-	hv->value.number = number;
-	return hv;
+	return hval_number_immediate(number);
 }
 
 hval *hval_boolean_create(bool value, runtime *rt)
 {
-	hval *hv = hval_hash_create_child(hval_hash_get(rt->top_level, BOOLEAN, rt), rt);
-	hv->value.boolean = value;
-	hv->type = boolean_t;
-	return hv;
+	return hval_boolean_immediate(value);
+}
+
+static hval *hval_immediate_prototype(hval *hv, runtime *rt)
+{
+	if (rt == NULL) {
+		rt = CURRENT_RUNTIME;
+	}
+
+	return hval_hash_get_direct(rt->top_level, hval_is_number_immediate(hv) ? NUMBER : BOOLEAN, rt);
 }
 
 hval *hval_hash_create(runtime *rt)
@@ -183,9 +190,11 @@ hval *hval_hash_get(hval *hv, hstr *key, runtime *rt)
 		hval *self = hval_get_self(val);
 		// TODO This will probably cause a bug at some point
 		if (rt && val && hval_is_callable(val) && (self == NULL || (self == parent && self != rt->top_level))) {
-			val = hval_clone(val, rt);
-			hval_bind_function(val, hv, rt->mem);
-			hval_hash_put(hv, key, val, rt->mem);
+			val = hval_bind_method(val, hv, rt);
+			// immediates have nowhere to cache the bound copy
+			if (!hval_is_immediate(hv)) {
+				hval_hash_put(hv, key, val, rt->mem);
+			}
 		}
 
 	}
@@ -199,29 +208,221 @@ hval *hval_hash_get_direct(hval *hv, hstr *key, runtime *rt)
 		return NULL;
 	}
 
+	if (hval_is_immediate(hv)) {
+		return hstr_comparator(key, PARENT) ? hval_immediate_prototype(hv, rt) : NULL;
+	}
+
+	if (hv->shape != NULL) {
+		int slot = shape_lookup(hv->shape, key);
+		return slot >= 0 ? hv->slots[slot] : NULL;
+	}
+
 	return hash_get(hv->members, key);
 }
 
 hval *hval_hash_put(hval *hv, hstr *key, hval *value, mem *m)
 {
 	hlog("hval_hash_put: %p %s -> %p\n", hv, key->str, value);
-	hstr_retain(key);
+	if (hval_is_immediate(hv)) {
+		runtime_error("cannot set property %s on a %s\n", key->str, hval_type_string(hval_type(hv)));
+	}
+
 	if (value != NULL)
 	{
 		hval_retain(value);
 	}
 
-	hval *previous = hash_get(hv->members, key);
-	hash_put(hv->members, key, value);
+	hval *previous = NULL;
+	if (hv->shape != NULL) {
+		int slot = shape_lookup(hv->shape, key);
+		if (slot >= 0) {
+			previous = hv->slots[slot];
+			hv->slots[slot] = value;
+		} else if (hv->shape->count < SHAPE_MAX_SLOTS) {
+			// the shape owns the key, so there's nothing to retain here
+			shape *next = shape_add(hv->shape, key);
+			hval_ensure_slots(hv, next->count);
+			hv->slots[next->count - 1] = value;
+			hv->shape = next;
+		} else {
+			hval_members_to_dictionary(hv);
+		}
+	}
+
+	if (hv->shape == NULL) {
+		hstr_retain(key);
+		previous = hash_get(hv->members, key);
+		hash_put(hv->members, key, value);
+		if (previous != NULL)
+		{
+			hstr_release(key);
+		}
+	}
+
+	if (hv->prototype && (previous == NULL || key == PARENT)) {
+		hval_prototype_epoch++;
+	}
+
+	mem_write_barrier(m, hv, value);
+
 	if (previous != NULL)
 	{
 		hval_release(previous, m);
-		hstr_release(key);
 	}
 
 	return value;
 }
 
+/*
+ * Walks hv and its ancestors for the hval that holds key directly. *slot
+ * is set to the key's slot when the holder keeps its members in slots, or
+ * to -1 otherwise.
+ */
+hval *hval_hash_find_holder(hval *hv, hstr *key, int *slot, runtime *rt)
+{
+	*slot = -1;
+	while (hv != NULL) {
+		if (!hval_is_immediate(hv)) {
+			if (hv->shape != NULL) {
+				int i = shape_lookup(hv->shape, key);
+				if (i >= 0 && hv->slots[i] != NULL) {
+					*slot = i;
+					return hv;
+				}
+			} else if (hash_get(hv->members, key) != NULL) {
+				return hv;
+			}
+		}
+
+		hv = hval_hash_get_direct(hv, PARENT, rt);
+	}
+
+	return NULL;
+}
+
+/*
+ * Overwrites an existing slot, for callers that already know where the
+ * member lives.
+ */
+void hval_slot_put(hval *hv, int slot, hval *value, mem *m)
+{
+	hval_retain(value);
+	hval *previous = hv->slots[slot];
+	hv->slots[slot] = value;
+	if (hv->prototype && hv->shape->keys[slot] == PARENT) {
+		hval_prototype_epoch++;
+	}
+
+	mem_write_barrier(m, hv, value);
+
+	if (previous != NULL) {
+		hval_release(previous, m);
+	}
+}
+
+static void hval_ensure_slots(hval *hv, int count)
+{
+	if (count <= hv->slot_capacity) {
+		return;
+	}
+
+	int capacity = hv->slot_capacity ? hv->slot_capacity : 4;
+	while (capacity < count) {
+		capacity <<= 1;
+	}
+
+	hv->slots = realloc(hv->slots, sizeof(hval *) * capacity);
+	if (hv->slots == NULL) {
+		perror("Unable to allocate memory for hval slots");
+		exit(1);
+	}
+	hv->slot_capacity = capacity;
+}
+
+/*
+ * Moves an hval that has outgrown SHAPE_MAX_SLOTS into a private hash.
+ */
+static void hval_members_to_dictionary(hval *hv)
+{
+	hlog("hval_members_to_dictionary: %p (%d members)\n", hv, hv->shape->count);
+	if (hv->members == NULL) {
+		hv->members = hash_create((hash_function) hash_hstr, (key_comparator) hstr_comparator);
+	}
+
+	shape *s = hv->shape;
+	for (int i = 0; i < s->count; i++) {
+		hstr_retain(s->keys[i]);
+		hash_put(hv->members, s->keys[i], hv->slots[i]);
+		hv->slots[i] = NULL;
+	}
+
+	hv->shape = NULL;
+}
+
+/*
+ * Puts hv, which has no members yet, straight into a members hash of the
+ * given size, so that the members put into it go where they did in the
+ * hash they're copied from.
+ */
+void hval_members_reserve(hval *hv, int buckets)
+{
+	if (hv->members == NULL) {
+		hv->members = hash_create((hash_function) hash_hstr, (key_comparator) hstr_comparator);
+	}
+
+	hv->shape = NULL;
+	hash_reserve(hv->members, buckets);
+}
+
+int hval_member_count(hval *hv)
+{
+	if (hval_is_immediate(hv)) {
+		return 0;
+	}
+
+	return hv->shape != NULL ? hv->shape->count : hv->members->size;
+}
+
+void hval_member_iterator_init(hval_member_iterator *iter, hval *hv)
+{
+	iter->hval = hv;
+	iter->shape = NULL;
+	iter->slot = -1;
+	iter->current_key = NULL;
+	iter->current_value = NULL;
+	if (hv == NULL || hval_is_immediate(hv)) {
+		return;
+	}
+
+	iter->shape = hv->shape;
+	if (iter->shape == NULL) {
+		hash_iterator_init(&iter->hash_iter, hv->members);
+		iter->current_key = iter->hash_iter.current_key;
+		iter->current_value = iter->hash_iter.current_value;
+	} else {
+		hval_member_iterator_next(iter);
+	}
+}
+
+void hval_member_iterator_next(hval_member_iterator *iter)
+{
+	if (iter->shape == NULL) {
+		hash_iterator_next(&iter->hash_iter);
+		iter->current_key = iter->hash_iter.current_key;
+		iter->current_value = iter->hash_iter.current_value;
+		return;
+	}
+
+	iter->slot++;
+	if (iter->slot < iter->shape->count) {
+		iter->current_key = iter->shape->keys[iter->slot];
+		iter->current_value = iter->hval->slots[iter->slot];
+	} else {
+		iter->current_key = NULL;
+		iter->current_value = NULL;
+	}
+}
+
 hval *hval_list_create(runtime *rt)
 {
 	list_hval *hv = (list_hval *) hval_create_custom(sizeof(list_hval), list_t, rt);
@@ -231,7 +432,7 @@ hval *hval_list_create(runtime *rt)
 	return (hval *) hv;
 }
 
-void hval_list_insert_tail(list_hval *list, hval *val)
+void hval_list_insert_tail(list_hval *list, hval *val, mem *m)
 {
 	if (val)
 	{
@@ -239,15 +440,17 @@ void hval_list_insert_tail(list_hval *list, hval *val)
 	}
 
 	ll_insert_tail(list->list, val);
+	mem_write_barrier(m, (hval *) list, val);
 }
 
-void hval_list_insert_head(list_hval *list, hval *val)
+void hval_list_insert_head(list_hval *list, hval *val, mem *m)
 {
 	if (val)
 	{
 		hval_retain(val);
 	}
 	ll_insert_head(list->list, val);
+	mem_write_barrier(m, (hval *) list, val);
 }
 
 hval *hval_native_function_create(native_function fn, runtime *rt)
@@ -263,9 +466,37 @@ hval *hval_bind_function(hval *function, hval *site, mem *m)
 	return function;
 }
 
+/*
+ * Makes a method: a child of the function holding just FN_SELF, which
+ * inherits everything else from it, so binding doesn't copy the
+ * function's members. Rebinding a method binds the function it was made
+ * from, rather than stacking methods on top of each other.
+ */
+hval *hval_bind_method(hval *function, hval *site, runtime *rt)
+{
+	hval *target = hval_method_function(function);
+	hval *method = hval_create(target->type, rt);
+	if (target->type == native_function_t) {
+		method->value.native_fn = target->value.native_fn;
+	}
+	hval_hash_put(method, PARENT, target, rt->mem);
+	hval_hash_put(method, FN_SELF, site, rt->mem);
+	return method;
+}
+
+/*
+ * The function a method was made from, or the function itself if it
+ * isn't one; only methods have a callable parent.
+ */
+hval *hval_method_function(hval *function)
+{
+	hval *parent = hval_hash_get_direct(function, PARENT, NULL);
+	return hval_is_callable(parent) ? parent : function;
+}
+
 bool hval_is_callable(hval *test)
 {
-	return test != NULL &&
+	return test != NULL && !hval_is_immediate(test) &&
 		(test->type == native_function_t
 		|| (hval_hash_get(test, FN_EXPR, NULL) != NULL && hval_hash_get(test, FN_ARGS, NULL) != NULL));
 }
@@ -282,7 +513,7 @@ char *hval_to_string(hval *hval)
 		return fmt("(null hval)");
 	}
 
-	const type t = hval->type;
+	const type t = hval_type(hval);
 	const char *type_str = hval_type_string(t);
 	char *contents = NULL;
 	char *str = NULL;
@@ -291,9 +522,9 @@ char *hval_to_string(hval *hval)
 		case string_t:
 			return fmt("%s@%p: %s", type_str, hval, hval->value.str->str);
 		case number_t:
-			return fmt("%s@%p: %d", type_str, hval, hval->value.number);
+			return fmt("%s@%p: %d", type_str, hval, hval_number_value(hval));
 		case hash_t:
-			contents = hval_hash_to_string(hval->members);
+			contents = hval_hash_to_string(hval);
 			str = fmt("%s@%p: %s", type_str, hval, contents);
 			free(contents);
 			return str;
@@ -307,7 +538,7 @@ char *hval_to_string(hval *hval)
 		case deferred_expression_t:
 			return fmt("deferred expression");
 		case boolean_t:
-			return fmt("boolean (%s)", hval->value.boolean ? "true" : "false");
+			return fmt("boolean (%s)", hval_boolean_value(hval) ? "true" : "false");
 		default:
 			return fmt("[?]");
 
@@ -316,10 +547,10 @@ char *hval_to_string(hval *hval)
 	return "hval_to_string_error";
 }
 
-char *hval_hash_to_string(hash *h)
+char *hval_hash_to_string(hval *hv)
 {
 	buffer *b = buffer_create(128);
-	buffer_printf(b, "size: %d {", h->size);
+	buffer_printf(b, "size: %d {", hval_member_count(hv));
 
 	/*hash_iterate(h, (key_value_callback) print_hash_member, b);*/
 	/*if (h->size > 0)*/
@@ -381,14 +612,13 @@ hval *hval_create_custom(size_t size, type hval_type, runtime *rt)
 #if HVAL_STATS
 	hval_create_count++;
 #endif
-	hval *hv = mem_alloc(sizeof(hval), rt->mem);
-	if (hv->members == NULL) {
-		hv->members = hash_create((hash_function) hash_hstr, (key_comparator) hstr_comparator);
+	hval *hv = mem_alloc(size, rt->mem);
 #ifdef HVAL_STATS
-	} else {
+	if (hv->slots != NULL) {
 		hval_reuse_count++;
-#endif
 	}
+#endif
+	hv->shape = shape_root();
 	if (rt->object_root) {
 		hval_hash_put(hv, PARENT, rt->object_root, rt->mem);
 	} else {
@@ -396,18 +626,23 @@ hval *hval_create_custom(size_t size, type hval_type, runtime *rt)
 	}
 	hv->type = hval_type;
 	hv->refs = 1;
-	hv->reachable = false;
 	hlog("hval_create: %p: %s\n", hv, hval_type_string(hval_type));
 	return hv;
 }
 
 void hval_retain(hval *hv)
 {
-	hv->refs++;
+	if (!hval_is_immediate(hv)) {
+		hv->refs++;
+	}
 }
 
 void hval_release(hval *hv, mem *m)
 {
+	if (hval_is_immediate(hv)) {
+		return;
+	}
+
 	hv->refs--;
 	hlog("hval_release: %p %d\n", hv, hv->refs);
 	if (hv->refs == 0)
@@ -442,7 +677,10 @@ void hval_destroy(hval *hv, mem *m, bool recursive)
 			if (recursive) {
 				hval_release(hv->value.deferred_expression.ctx, m);
 			}
-			expr_destroy(hv->value.deferred_expression.expr, recursive, m);
+			// only missing from one left behind by a bad image
+			if (hv->value.deferred_expression.expr != NULL) {
+				expr_release(hv->value.deferred_expression.expr);
+			}
 			break;
 		default:
 			fprintf(stderr, "Unhandled type in hval_destroy()\n");
@@ -453,11 +691,26 @@ void hval_destroy(hval *hv, mem *m, bool recursive)
 
 	}
 
-	if (recursive) {
-		hash_destroy(hv->members, (destructor) hstr_release, NULL, (destructor) hval_release, m);
-		hv->members = NULL;
+	if (hv->prototype) {
+		hv->prototype = false;
+		hval_prototype_epoch++;
+	}
+
+	// detach the members before releasing them; the slots array and
+	// members hash stay allocated for the next occupant of this hval
+	shape *s = hv->shape;
+	hv->shape = shape_root();
+	if (s != NULL) {
+		for (int i = 0; i < s->count; i++) {
+			hval *value = hv->slots[i];
+			hv->slots[i] = NULL;
+			if (recursive && value != NULL) {
+				hval_release(value, m);
+			}
+		}
+	} else if (recursive) {
+		hash_empty(hv->members, (destructor) hstr_release, NULL, (destructor) hval_release, m);
 	} else {
-		/*hash_destroy(hv->members, (destructor) hstr_release, NULL, NULL, NULL);*/
 		hash_empty(hv->members, (destructor) hstr_release, NULL, NULL, NULL);
 	}
 
@@ -466,122 +719,103 @@ void hval_destroy(hval *hv, mem *m, bool recursive)
 
 
 
-int hash_hstr(hstr *hs)
+unsigned int hash_hstr(hstr *hs)
 {
-	if (!hs->hash_calculated) {
-		hs->hash = hash_string(hs->str);
-		hs->hash_calculated = true;
-	}
-	return hs->hash;
+	return hstr_hash(hs);
 }
 
-expression *expr_create(expression_type type)
+/*
+ * Expressions live in the arena of the module they were read from, and
+ * references to any of them keep the whole arena alive.
+ */
+expression *expr_create(arena *a, expression_type type)
 {
-	expression *expr = malloc(sizeof(expression));
-	if (expr == NULL)
-	{
-		perror("Unable to allocate memory for expression");
-		exit(1);
-	}
-	expr->refs = 1;
+	expression *expr = arena_alloc(a, sizeof(expression));
+	expr->arena = a;
 	expr->type = type;
+	expr->code = NULL;
+	expr->body_code = NULL;
 
 	return expr;
 }
 
 void expr_retain(expression *expr)
 {
-	expr->refs++;
+	arena_retain(expr->arena);
 }
 
-void expr_destructor(expression *expr, void *context) {
-	expr_destructor_context *ctx = (expr_destructor_context *) context;
-
-	expr_destroy(expr, ctx->destroy_hvals, ctx->mem);
+void expr_release(expression *expr)
+{
+	arena_release(expr->arena);
 }
 
-void expr_destroy(expression *expr, bool destroy_hvals, mem *m)
+/*
+ * Expression and list literal lists are never changed once read, so they
+ * and their nodes are allocated in the arena too.
+ */
+linked_list *expr_list_create(arena *a)
 {
-	expr->refs--;
-	if (expr->refs > 0)
-	{
-		return;
-	}
-
-	expr_destructor_context dest_context = { m, destroy_hvals };
+	linked_list *list = arena_alloc(a, sizeof(linked_list));
+	list->head = list->tail = NULL;
+	list->size = 0;
+	return list;
+}
 
-	hlog("expr_destroy %p %d\n", expr, expr->type);
-	switch (expr->type)
-	{
-		case expr_prop_ref_t:
-			prop_ref_destroy(expr->operation.prop_ref, destroy_hvals, m);
-			break;
-		case expr_prop_set_t:
-			prop_ref_destroy(expr->operation.prop_set->ref, destroy_hvals, m);
-			expr_destroy(expr->operation.prop_set->value, destroy_hvals, m);
-			free(expr->operation.prop_set);
-			break;
-		case expr_list_literal_t:
-			ll_destroy(expr->operation.list_literal, (destructor) expr_destructor, &dest_context);
-			break;
-		case expr_list_t:
-			ll_destroy(expr->operation.expr_list, (destructor) expr_destructor, &dest_context);
-			break;
-		case expr_primitive_t:
-			if (destroy_hvals) {
-				hval_release(expr->operation.primitive, m);
-			}
-			break;
-		case expr_hash_literal_t:
-			hash_destroy(expr->operation.hash_literal, (destructor) hstr_release, NULL, (destructor) expr_destructor, &dest_context);
-			break;
-		case expr_invocation_t:
-			if (expr->operation.invocation->list_args != NULL) {
-				expr_destroy(expr->operation.invocation->list_args, destroy_hvals, m);
-			} else if (expr->operation.invocation->hash_args != NULL) {
-				expr_destroy(expr->operation.invocation->hash_args, destroy_hvals, m);
-			}
-			expr_destroy(expr->operation.invocation->function, destroy_hvals, m);
-			free(expr->operation.invocation);
-			break;
-		case expr_deferred_t:
-			expr_destroy(expr->operation.deferred_expression, destroy_hvals, m);
-			break;
-		case expr_function_t:
-			expr_destroy(expr->operation.function_declaration->args, destroy_hvals, m);
-			expr_destroy(expr->operation.function_declaration->body, destroy_hvals, m);
-			free(expr->operation.function_declaration);
-			break;
-		default:
-			hlog("ERROR: unexpected type passed to expr_destroy\n");
-			break;
+void expr_list_append(arena *a, linked_list *list, expression *expr)
+{
+	ll_node *node = arena_alloc(a, sizeof(ll_node));
+	node->data = expr;
+	node->next = NULL;
+	if (list->tail) {
+		list->tail->next = node;
+	} else {
+		list->head = node;
 	}
+	list->tail = node;
+	list->size++;
+}
 
-	free(expr);
+prop_ref *prop_ref_create(arena *a, hstr *name)
+{
+	prop_ref *ref = arena_alloc(a, sizeof(prop_ref));
+	ref->name = name;
+	ref->site = NULL;
+	ref->depth = 0;
+	ref->index = -1;
+	memset(ref->cache, 0, sizeof(ref->cache));
+	ref->cache_next = 0;
+	hstr_retain(name);
+	arena_on_release(a, (destructor) hstr_release, name);
+	return ref;
 }
 
-static void prop_ref_destroy(prop_ref *ref, bool destroy_hvals, mem *m)
+static void hash_literal_destroy(hash *hash_literal, void *context)
 {
-	if (ref->site)
-	{
-		expr_destroy(ref->site, destroy_hvals, m);
-	}
+	hash_destroy(hash_literal, (destructor) hstr_release, NULL, NULL, NULL);
+}
 
-	hstr_release(ref->name);
-	free(ref);
+/*
+ * The table itself is malloced, as it may grow; its keys are retained
+ * names and its values expressions from the same arena.
+ */
+hash *expr_hash_literal_create(arena *a)
+{
+	hash *hash_literal = hash_create((hash_function) hash_hstr, (key_comparator) hstr_comparator);
+	arena_on_release(a, (destructor) hash_literal_destroy, hash_literal);
+	return hash_literal;
 }
 
 hval *hval_hash_put_all(hval *dest, hval *src, mem *m)
 {
-	hash_iterator *iter = hash_iterator_create(src->members);
-	while (iter->current_key != NULL) {
-		if (iter->current_key != PARENT) {
-			hval_hash_put(dest, iter->current_key, iter->current_value, m);
+	hval_member_iterator iter;
+	hval_member_iterator_init(&iter, src);
+	while (iter.current_key != NULL) {
+		if (iter.current_key != PARENT) {
+			hval_hash_put(dest, iter.current_key, iter.current_value, m);
 		}
-		hash_iterator_next(iter);
+		hval_member_iterator_next(&iter);
 	}
 
-	hash_iterator_destroy(iter);
 	return dest;
 }
 
@@ -590,13 +824,13 @@ bool hval_is_true(hval *test) {
 		return false;
 	}
 
-	switch (test->type) {
+	switch (hval_type(test)) {
 	case number_t:
-		return test->value.number != 0;
+		return hval_number_value(test) != 0;
 	case string_t:
 		return strcasecmp("true", test->value.str->str) == 0;
 	case boolean_t:
-		return test->value.boolean;
+		return hval_boolean_value(test);
 	default:
 		return true;
 	}
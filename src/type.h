@@ -1,10 +1,12 @@
 #ifndef TYPE_H
 #define TYPE_H
 #include <stdbool.h>
+#include <stdint.h>
 #include "config.h"
 #include "linked_list.h"
 #include "data.h"
 #include "ht.h"
+#include "shape.h"
 #include "str.h"
 #include "runtime.h"
 
@@ -24,6 +26,22 @@ hstr *VALUE;
 hstr *LENGTH;
 hstr *LIST;
 
+// bumped whenever a prototype gains a member or changes its parent
+unsigned int hval_prototype_epoch;
+
+/*
+ * Iterates the members of an hval whether they are stored in shape slots
+ * or in a members hash. Lives on the caller's stack; no cleanup needed.
+ */
+typedef struct {
+	hval *hval;
+	shape *shape;
+	int slot;
+	hash_iterator hash_iter;
+	hstr *current_key;
+	hval *current_value;
+} hval_member_iterator;
+
 hval *hval_create_custom(size_t size, type t, runtime *rt);
 hval *hval_create(type t, runtime *rt);
 void hval_retain(hval *hv);
@@ -40,24 +58,58 @@ hval *hval_hash_create_child(hval *parent, runtime *rt);
 hval *hval_hash_get(hval *hv, hstr *str, runtime *rt);
 hval *hval_hash_get_direct(hval *hv, hstr *key, runtime *rt);
 hval *hval_hash_put(hval *hv, hstr *str, hval *value, mem *m);
+hval *hval_hash_find_holder(hval *hv, hstr *key, int *slot, runtime *rt);
+void hval_slot_put(hval *hv, int slot, hval *value, mem *m);
 hval *hval_hash_put_all(hval *dest, hval *src, mem *m);
+void hval_members_reserve(hval *hv, int buckets);
+int hval_member_count(hval *hv);
+void hval_member_iterator_init(hval_member_iterator *iter, hval *hv);
+void hval_member_iterator_next(hval_member_iterator *iter);
 hval *hval_native_function_create(native_function fn, runtime *rt);
-void hval_list_insert_head(list_hval *list, hval *val);
-void hval_list_insert_tail(list_hval *list, hval *val);
+void hval_list_insert_head(list_hval *list, hval *val, mem *m);
+void hval_list_insert_tail(list_hval *list, hval *val, mem *m);
 char *hval_to_string(hval *);
 const char *hval_type_string(type t);
-int hash_hstr(hstr *);
-expression *expr_create(expression_type);
+unsigned int hash_hstr(hstr *);
+expression *expr_create(arena *, expression_type);
 void expr_retain(expression *);
-void expr_destroy(expression *, bool recursive, mem *);
+void expr_release(expression *);
+linked_list *expr_list_create(arena *);
+void expr_list_append(arena *, linked_list *, expression *);
+prop_ref *prop_ref_create(arena *, hstr *name);
+hash *expr_hash_literal_create(arena *);
 void type_init_globals();
 void type_destroy_globals();
 hval *hval_bind_function(hval *, hval *, mem *);
+hval *hval_bind_method(hval *function, hval *site, runtime *rt);
+hval *hval_method_function(hval *function);
 hval *hval_get_self(hval *);
 bool hval_is_callable(hval *test);
 bool hval_is_true(hval *test);
 
-#define hval_number_value(hv) ((hv ? hv->value.number : 0))
+/*
+ * Numbers and booleans are immediates: the value is packed into the hval
+ * pointer itself and tagged in the low bits, so creating one never touches
+ * the heap. Heap hvals are always at least 4-byte aligned, so their low
+ * bits are clear. Immediates have no members; property lookups on them
+ * resolve through the Number/Boolean prototypes instead.
+ */
+#define HVAL_TAG_BITS 2
+#define HVAL_TAG_MASK ((uintptr_t) 0x3)
+#define HVAL_TAG_NUMBER ((uintptr_t) 0x1)
+#define HVAL_TAG_BOOLEAN ((uintptr_t) 0x2)
+
+#define hval_is_immediate(hv) ((((uintptr_t) (hv)) & HVAL_TAG_MASK) != 0)
+#define hval_is_number_immediate(hv) ((((uintptr_t) (hv)) & HVAL_TAG_MASK) == HVAL_TAG_NUMBER)
+#define hval_is_boolean_immediate(hv) ((((uintptr_t) (hv)) & HVAL_TAG_MASK) == HVAL_TAG_BOOLEAN)
+#define hval_number_immediate(num) ((hval *) ((((uintptr_t) (intptr_t) (num)) << HVAL_TAG_BITS) | HVAL_TAG_NUMBER))
+#define hval_boolean_immediate(b) ((hval *) ((((uintptr_t) ((b) ? 1 : 0)) << HVAL_TAG_BITS) | HVAL_TAG_BOOLEAN))
+
+#define hval_type(hv) (hval_is_number_immediate(hv) ? number_t \
+		: hval_is_boolean_immediate(hv) ? boolean_t \
+		: (hv)->type)
+#define hval_number_value(hv) (hval_is_number_immediate(hv) ? (int) (((intptr_t) (hv)) >> HVAL_TAG_BITS) : 0)
+#define hval_boolean_value(hv) (hval_is_boolean_immediate(hv) && (((uintptr_t) (hv)) >> HVAL_TAG_BITS) != 0)
 
 #if HVAL_STATS
 void print_hval_stats();
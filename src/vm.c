@@ -0,0 +1,592 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "log.h"
+#include "mm.h"
+#include "runtime.h"
+#include "smalloc.h"
+#include "type.h"
+#include "vm.h"
+
+/*
+ * Room for what an instruction pushes while it runs, on top of the depth
+ * the compiler tracked: the context pushed on entry, plus the list an
+ * instruction builds while its items are still on the stack.
+ */
+#define VM_STACK_SLACK 3
+
+#if defined(__GNUC__) && !defined(VM_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO 1
+#endif
+
+// only used by vm_code_dump, which logs
+#ifdef LOG_ENABLED
+static const char *opcode_names[] = {
+	[OP_NIL] = "NIL",
+	[OP_PRIMITIVE] = "PRIMITIVE",
+	[OP_LOAD] = "LOAD",
+	[OP_LOAD_LOCAL] = "LOAD_LOCAL",
+	[OP_PROP_REF] = "PROP_REF",
+	[OP_STORE] = "STORE",
+	[OP_STORE_LOCAL] = "STORE_LOCAL",
+	[OP_PROP_SET] = "PROP_SET",
+	[OP_POP] = "POP",
+	[OP_LIST] = "LIST",
+	[OP_HASH] = "HASH",
+	[OP_HASH_PUT] = "HASH_PUT",
+	[OP_DEFERRED] = "DEFERRED",
+	[OP_ARG] = "ARG",
+	[OP_NAMED_ARG] = "NAMED_ARG",
+	[OP_PARAM] = "PARAM",
+	[OP_FUNCTION] = "FUNCTION",
+	[OP_INVOKE] = "INVOKE",
+	[OP_INVOKE_NAMED] = "INVOKE_NAMED",
+	[OP_RETURN] = "RETURN"
+};
+#endif
+
+typedef struct compiler {
+	vm_code *code;
+	int depth;
+} compiler;
+
+static hval *vm_execute(runtime *rt, vm_code *code, hval *context);
+static hval *vm_resolve_frame(prop_ref *ref, hval *context);
+static void compile_expression(compiler *c, expression *expr);
+static void compile_sequence(compiler *c, linked_list *exprs);
+static void compile_invocation(compiler *c, invocation *inv);
+static void compile_param(compiler *c, expression *param);
+static void emit(compiler *c, vm_opcode op, int arg, int stack_effect);
+static int add_constant(compiler *c, void *constant);
+
+hval *vm_evaluate(runtime *rt, expression *expr, hval *context)
+{
+	if (expr->code == NULL) {
+		expr->code = vm_compile(expr, false);
+		arena_on_release(expr->arena, (destructor) vm_code_destroy, expr->code);
+	}
+
+	return vm_execute(rt, expr->code, context);
+}
+
+hval *vm_evaluate_body(runtime *rt, expression *body, hval *context)
+{
+	if (body->body_code == NULL) {
+		body->body_code = vm_compile(body, true);
+		arena_on_release(body->arena, (destructor) vm_code_destroy, body->body_code);
+	}
+
+	return vm_execute(rt, body->body_code, context);
+}
+
+/*
+ * Compiles expr into a self-contained code unit. Function bodies are list
+ * literals, but calling one evaluates the items in sequence rather than
+ * building a list, hence as_body.
+ */
+vm_code *vm_compile(expression *expr, bool as_body)
+{
+	compiler c;
+	c.code = smalloc(sizeof(vm_code));
+	c.code->count = 0;
+	c.code->capacity = 16;
+	c.code->instructions = smalloc(sizeof(vm_instruction) * c.code->capacity);
+	c.code->constant_count = 0;
+	c.code->constant_capacity = 8;
+	c.code->constants = smalloc(sizeof(void *) * c.code->constant_capacity);
+	c.code->call_sites = NULL;
+	c.code->call_site_count = 0;
+	c.code->max_stack = 0;
+	c.depth = 0;
+
+	if (as_body) {
+		compile_sequence(&c, expr->operation.list_literal);
+	} else {
+		compile_expression(&c, expr);
+	}
+	emit(&c, OP_RETURN, 0, -1);
+	assert(c.depth == 0);
+
+	c.code->max_stack += VM_STACK_SLACK;
+	hlog("vm_compile: %p -> %d instructions\n", expr, c.code->count);
+	return c.code;
+}
+
+void vm_code_destroy(vm_code *code)
+{
+	if (code == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < code->call_site_count; i++) {
+		free(code->call_sites[i].names);
+	}
+
+	free(code->instructions);
+	free(code->constants);
+	free(code->call_sites);
+	free(code);
+}
+
+void vm_code_dump(vm_code *code)
+{
+#ifdef LOG_ENABLED
+	hlog("vm_code %p: %d instructions, max stack %d\n", code, code->count, code->max_stack);
+	for (int i = 0; i < code->count; i++) {
+		hlog("  %04d %-12s %d\n", i, opcode_names[code->instructions[i].op], code->instructions[i].arg);
+	}
+#endif
+}
+
+static void compile_expression(compiler *c, expression *expr)
+{
+	prop_ref *ref = NULL;
+	prop_set *set = NULL;
+	function_declaration *decl = NULL;
+	int count = 0;
+
+	switch (expr->type)
+	{
+		case expr_prop_ref_t:
+			ref = expr->operation.prop_ref;
+			if (ref->site != NULL) {
+				compile_expression(c, ref->site);
+				emit(c, OP_PROP_REF, add_constant(c, ref), 0);
+			} else {
+				emit(c, ref->index >= 0 ? OP_LOAD_LOCAL : OP_LOAD, add_constant(c, ref), 1);
+			}
+			break;
+		case expr_prop_set_t:
+			set = expr->operation.prop_set;
+			if (set->ref->site != NULL) {
+				compile_expression(c, set->ref->site);
+				compile_expression(c, set->value);
+				emit(c, OP_PROP_SET, add_constant(c, set->ref), -1);
+			} else {
+				compile_expression(c, set->value);
+				emit(c, set->ref->index >= 0 ? OP_STORE_LOCAL : OP_STORE, add_constant(c, set->ref), 0);
+			}
+			break;
+		case expr_list_t:
+			compile_sequence(c, expr->operation.expr_list);
+			break;
+		case expr_list_literal_t:
+			LL_FOREACH(expr->operation.list_literal, node) {
+				compile_expression(c, (expression *) node->data);
+				count++;
+			}
+			emit(c, OP_LIST, count, 1 - count);
+			break;
+		case expr_hash_literal_t: {
+			emit(c, OP_HASH, 0, 1);
+			hash_iterator iter;
+			hash_iterator_init(&iter, expr->operation.hash_literal);
+			while (iter.current_key != NULL) {
+				compile_expression(c, (expression *) iter.current_value);
+				emit(c, OP_HASH_PUT, add_constant(c, iter.current_key), -1);
+				hash_iterator_next(&iter);
+			}
+			break;
+		}
+		case expr_primitive_t:
+			emit(c, OP_PRIMITIVE, add_constant(c, expr->operation.primitive), 1);
+			break;
+		case expr_invocation_t:
+			compile_invocation(c, expr->operation.invocation);
+			break;
+		case expr_deferred_t:
+			emit(c, OP_DEFERRED, add_constant(c, expr->operation.deferred_expression), 1);
+			break;
+		case expr_function_t:
+			decl = expr->operation.function_declaration;
+			LL_FOREACH(decl->args->operation.list_literal, node) {
+				compile_param(c, (expression *) node->data);
+				count++;
+			}
+			emit(c, OP_FUNCTION, add_constant(c, decl), 1 - count);
+			break;
+		default:
+			hlog("Error: unknown expression type");
+			exit(1);
+	}
+}
+
+/*
+ * Evaluates each expression for its side effects and keeps the last value,
+ * or NULL for an empty sequence.
+ */
+static void compile_sequence(compiler *c, linked_list *exprs)
+{
+	if (exprs->head == NULL) {
+		emit(c, OP_NIL, 0, 1);
+		return;
+	}
+
+	LL_FOREACH(exprs, node) {
+		compile_expression(c, (expression *) node->data);
+		if (node->next != NULL) {
+			emit(c, OP_POP, 0, -1);
+		}
+	}
+}
+
+/*
+ * Argument values are left on the stack, where they make up the argv for
+ * the call. f{a: 1} passes the members of the hash literal as named
+ * arguments, so it compiles the same way as f(a: 1).
+ */
+static void compile_invocation(compiler *c, invocation *inv)
+{
+	int count = inv->list_args != NULL
+		? inv->list_args->operation.list_literal->size
+		: inv->hash_args->operation.hash_literal->size;
+	hstr **names = smalloc(sizeof(hstr *) * (count + 1));
+	bool named = false;
+	int i = 0;
+
+	compile_expression(c, inv->function);
+	if (inv->list_args != NULL) {
+		LL_FOREACH(inv->list_args->operation.list_literal, node) {
+			expression *arg = (expression *) node->data;
+			names[i] = NULL;
+			if (arg->type == expr_prop_set_t) {
+				names[i] = arg->operation.prop_set->ref->name;
+				arg = arg->operation.prop_set->value;
+				named = true;
+			}
+			compile_expression(c, arg);
+			i++;
+		}
+	} else {
+		hash_iterator iter;
+		hash_iterator_init(&iter, inv->hash_args->operation.hash_literal);
+		while (iter.current_key != NULL) {
+			names[i++] = iter.current_key;
+			compile_expression(c, (expression *) iter.current_value);
+			hash_iterator_next(&iter);
+		}
+		named = true;
+	}
+
+	if (!named) {
+		free(names);
+		emit(c, OP_INVOKE, count, -count);
+		return;
+	}
+
+	vm_code *code = c->code;
+	code->call_sites = srealloc(code->call_sites, sizeof(vm_call_site) * (code->call_site_count + 1));
+	code->call_sites[code->call_site_count].count = count;
+	code->call_sites[code->call_site_count].names = names;
+	emit(c, OP_INVOKE_NAMED, code->call_site_count++, -count);
+}
+
+/*
+ * Parameters are wrapped in NAME/VALUE hashes, as
+ * eval_expr_function_params does. A bare identifier names a parameter
+ * without a default.
+ */
+static void compile_param(compiler *c, expression *param)
+{
+	switch (param->type) {
+	case expr_prop_ref_t:
+		emit(c, OP_PARAM, add_constant(c, param->operation.prop_ref->name), 1);
+		break;
+	case expr_prop_set_t:
+		compile_expression(c, param->operation.prop_set->value);
+		emit(c, OP_NAMED_ARG, add_constant(c, param->operation.prop_set->ref->name), 0);
+		break;
+	default:
+		compile_expression(c, param);
+		emit(c, OP_ARG, 0, 0);
+		break;
+	}
+}
+
+static void emit(compiler *c, vm_opcode op, int arg, int stack_effect)
+{
+	vm_code *code = c->code;
+	if (code->count == code->capacity) {
+		code->capacity *= 2;
+		code->instructions = srealloc(code->instructions, sizeof(vm_instruction) * code->capacity);
+	}
+
+	code->instructions[code->count].op = op;
+	code->instructions[code->count].arg = arg;
+	code->count++;
+
+	c->depth += stack_effect;
+	if (c->depth > code->max_stack) {
+		code->max_stack = c->depth;
+	}
+}
+
+static int add_constant(compiler *c, void *constant)
+{
+	vm_code *code = c->code;
+	if (code->constant_count == code->constant_capacity) {
+		code->constant_capacity *= 2;
+		code->constants = srealloc(code->constants, sizeof(void *) * code->constant_capacity);
+	}
+
+	code->constants[code->constant_count] = constant;
+	return code->constant_count++;
+}
+
+/*
+ * The operand stack is the mem root stack, so everything on it survives a
+ * collection without being registered as a gc root. Reference counting
+ * follows the tree walker: each instruction retains and releases exactly
+ * what the corresponding eval_* function does.
+ */
+// v is evaluated before the slot is claimed: it may allocate, and a
+// collection then must not find an unwritten slot on the stack
+#define PUSH(v) do { hval *pushed = (v); *m->root_stack_top++ = pushed; } while (0)
+#define POP() (*--m->root_stack_top)
+#define DROP() ((void) --m->root_stack_top)
+#define TOP() (m->root_stack_top[-1])
+#define PEEK(n) (m->root_stack_top[-1 - (n)])
+
+#if VM_COMPUTED_GOTO
+#define VM_BEGIN VM_NEXT();
+#define VM_END
+#define VM_OP(op) do_##op:
+#define VM_NEXT() do { ins = ip++; goto *dispatch[ins->op]; } while (0)
+#else
+#define VM_BEGIN for (;;) { ins = ip++; switch (ins->op) {
+#define VM_END default: runtime_error("unknown opcode %d\n", ins->op); } }
+#define VM_OP(op) case op:
+#define VM_NEXT() continue
+#endif
+
+static hval *vm_execute(runtime *rt, vm_code *code, hval *context)
+{
+#if VM_COMPUTED_GOTO
+	static void *dispatch[] = {
+		[OP_NIL] = &&do_OP_NIL,
+		[OP_PRIMITIVE] = &&do_OP_PRIMITIVE,
+		[OP_LOAD] = &&do_OP_LOAD,
+		[OP_LOAD_LOCAL] = &&do_OP_LOAD_LOCAL,
+		[OP_PROP_REF] = &&do_OP_PROP_REF,
+		[OP_STORE] = &&do_OP_STORE,
+		[OP_STORE_LOCAL] = &&do_OP_STORE_LOCAL,
+		[OP_PROP_SET] = &&do_OP_PROP_SET,
+		[OP_POP] = &&do_OP_POP,
+		[OP_LIST] = &&do_OP_LIST,
+		[OP_HASH] = &&do_OP_HASH,
+		[OP_HASH_PUT] = &&do_OP_HASH_PUT,
+		[OP_DEFERRED] = &&do_OP_DEFERRED,
+		[OP_ARG] = &&do_OP_ARG,
+		[OP_NAMED_ARG] = &&do_OP_NAMED_ARG,
+		[OP_PARAM] = &&do_OP_PARAM,
+		[OP_FUNCTION] = &&do_OP_FUNCTION,
+		[OP_INVOKE] = &&do_OP_INVOKE,
+		[OP_INVOKE_NAMED] = &&do_OP_INVOKE_NAMED,
+		[OP_RETURN] = &&do_OP_RETURN
+	};
+#endif
+
+	mem *m = rt->mem;
+	if (m->root_stack_top + code->max_stack > m->root_stack_limit) {
+		runtime_error("stack overflow\n");
+	}
+
+	hval **base = m->root_stack_top;
+	void **constants = code->constants;
+	vm_instruction *ip = code->instructions;
+	vm_instruction *ins = NULL;
+	hval **argv = NULL;
+	hval *value = NULL;
+	hval *arg = NULL;
+	list_hval *list = NULL;
+
+	// deferred contexts aren't traced by mark, so keep ours alive
+	PUSH(context);
+
+	VM_BEGIN
+
+	VM_OP(OP_NIL)
+		PUSH(NULL);
+		VM_NEXT();
+
+	VM_OP(OP_PRIMITIVE)
+		value = constants[ins->arg];
+		hval_retain(value);
+		PUSH(value);
+		VM_NEXT();
+
+	VM_OP(OP_LOAD)
+		value = runtime_get_property(rt, constants[ins->arg], context);
+		PUSH(value);
+		VM_NEXT();
+
+	VM_OP(OP_LOAD_LOCAL) {
+		prop_ref *ref = constants[ins->arg];
+		hval *frame = vm_resolve_frame(ref, context);
+		value = frame != NULL ? frame->slots[ref->index] : NULL;
+		// functions found further up come back bound to the receiver,
+		// which only the dynamic lookup does
+		if (value == NULL || (ref->depth > 0 && hval_is_callable(value))) {
+			value = runtime_get_property(rt, ref, context);
+		} else {
+			hval_retain(value);
+		}
+		PUSH(value);
+		VM_NEXT();
+	}
+
+	VM_OP(OP_PROP_REF)
+		TOP() = runtime_get_property(rt, constants[ins->arg], TOP());
+		VM_NEXT();
+
+	VM_OP(OP_STORE)
+		runtime_set_property(rt, constants[ins->arg], context, TOP());
+		VM_NEXT();
+
+	VM_OP(OP_STORE_LOCAL) {
+		prop_ref *ref = constants[ins->arg];
+		hval *frame = vm_resolve_frame(ref, context);
+		if (frame != NULL) {
+			hval_slot_put(frame, ref->index, TOP(), m);
+		} else {
+			runtime_set_property(rt, ref, context, TOP());
+		}
+		VM_NEXT();
+	}
+
+	VM_OP(OP_PROP_SET)
+		value = TOP();
+		runtime_set_property(rt, constants[ins->arg], PEEK(1), value);
+		DROP();
+		TOP() = value;
+		VM_NEXT();
+
+	VM_OP(OP_POP)
+		DROP();
+		VM_NEXT();
+
+	VM_OP(OP_LIST)
+		argv = m->root_stack_top - ins->arg;
+		list = (list_hval *) hval_list_create(rt);
+		PUSH((hval *) list);
+		for (int i = 0; i < ins->arg; i++) {
+			if (argv[i] != NULL) {
+				hval_list_insert_tail(list, argv[i], m);
+				hval_release(argv[i], m);
+			}
+		}
+		m->root_stack_top = argv;
+		PUSH((hval *) list);
+		VM_NEXT();
+
+	VM_OP(OP_HASH)
+		PUSH(hval_hash_create(rt));
+		VM_NEXT();
+
+	VM_OP(OP_HASH_PUT)
+		value = POP();
+		hval_hash_put(TOP(), constants[ins->arg], value, m);
+		if (value != NULL) {
+			hval_release(value, m);
+		}
+		VM_NEXT();
+
+	VM_OP(OP_DEFERRED)
+		PUSH(runtime_defer(rt, constants[ins->arg], context));
+		VM_NEXT();
+
+	VM_OP(OP_ARG)
+		arg = hval_hash_create(rt);
+		if (TOP() != NULL) {
+			hval_hash_put(arg, VALUE, TOP(), m);
+		}
+		TOP() = arg;
+		VM_NEXT();
+
+	VM_OP(OP_NAMED_ARG)
+		arg = hval_hash_create(rt);
+		PUSH(arg);
+		hval_hash_put(arg, NAME, hval_string_create(constants[ins->arg], rt), m);
+		if (PEEK(1) != NULL) {
+			hval_hash_put(arg, VALUE, PEEK(1), m);
+		}
+		DROP();
+		TOP() = arg;
+		VM_NEXT();
+
+	VM_OP(OP_PARAM)
+		arg = hval_hash_create(rt);
+		PUSH(arg);
+		hval_hash_put(arg, NAME, hval_string_create(constants[ins->arg], rt), m);
+		VM_NEXT();
+
+	VM_OP(OP_FUNCTION) {
+		function_declaration *decl = constants[ins->arg];
+		argv = m->root_stack_top - decl->args->operation.list_literal->size;
+		list = (list_hval *) hval_list_create(rt);
+		PUSH((hval *) list);
+		for (hval **param = argv; param < m->root_stack_top - 1; param++) {
+			hval_list_insert_tail(list, *param, m);
+		}
+		value = runtime_create_function(rt, (hval *) list, decl->body, context);
+		m->root_stack_top = argv;
+		PUSH(value);
+		VM_NEXT();
+	}
+
+	VM_OP(OP_INVOKE) {
+		arguments args = { ins->arg, m->root_stack_top - ins->arg, NULL };
+		value = args.values[-1] != NULL ? runtime_call_function(rt, args.values[-1], &args, context) : NULL;
+		m->root_stack_top = args.values;
+		TOP() = value;
+		VM_NEXT();
+	}
+
+	VM_OP(OP_INVOKE_NAMED) {
+		vm_call_site *site = code->call_sites + ins->arg;
+		arguments args = { site->count, m->root_stack_top - site->count, site->names };
+		value = args.values[-1] != NULL ? runtime_call_function(rt, args.values[-1], &args, context) : NULL;
+		m->root_stack_top = args.values;
+		TOP() = value;
+		VM_NEXT();
+	}
+
+	VM_OP(OP_RETURN)
+		value = POP();
+		DROP();
+		assert(m->root_stack_top == base);
+		return value;
+
+	VM_END
+
+	return NULL;
+}
+
+/*
+ * Follows a resolved prop_ref's lexical address from context, checking on
+ * the way that it still agrees with a dynamic lookup: no frame in between
+ * has the name, and the target frame holds it, set, in the expected slot.
+ * Returns NULL when the name has to be looked up dynamically instead.
+ */
+static hval *vm_resolve_frame(prop_ref *ref, hval *context)
+{
+	hval *frame = context;
+	for (int depth = ref->depth; depth > 0; depth--) {
+		if (frame == NULL || hval_is_immediate(frame) || frame->shape == NULL
+				|| frame->shape->count == 0 || frame->shape->keys[0] != PARENT
+				|| shape_lookup(frame->shape, ref->name) >= 0) {
+			return NULL;
+		}
+
+		frame = frame->slots[0];
+	}
+
+	if (frame == NULL || hval_is_immediate(frame) || frame->shape == NULL
+			|| ref->index >= frame->shape->count
+			|| frame->shape->keys[ref->index] != ref->name
+			|| frame->slots[ref->index] == NULL) {
+		return NULL;
+	}
+
+	return frame;
+}
@@ -0,0 +1,67 @@
+#ifndef VM_H
+#define VM_H
+
+#include "data.h"
+
+/*
+ * Bytecode for the stack VM. Expressions are compiled lazily, the first
+ * time they are evaluated, and the code is cached on the expression node.
+ * Operands index into the code's constant table. Stack effects are noted
+ * as (before -- after).
+ */
+typedef enum {
+	OP_NIL,			// ( -- NULL)
+	OP_PRIMITIVE,		// ( -- primitive)
+	OP_LOAD,		// ( -- value) prop_ref looked up on the context
+	OP_LOAD_LOCAL,		// ( -- value) prop_ref with a lexical address
+	OP_PROP_REF,		// (site -- value)
+	OP_STORE,		// (value -- value) prop_ref assigned on the context
+	OP_STORE_LOCAL,		// (value -- value) prop_ref with a lexical address
+	OP_PROP_SET,		// (site value -- value)
+	OP_POP,			// (value -- )
+	OP_LIST,		// (v1 .. vn -- list) n is the operand
+	OP_HASH,		// ( -- hash)
+	OP_HASH_PUT,		// (hash value -- hash)
+	OP_DEFERRED,		// ( -- deferred) over the current context
+	OP_ARG,			// (value -- param) a parameter without a name
+	OP_NAMED_ARG,		// (value -- param) a parameter with a default
+	OP_PARAM,		// ( -- param) a parameter without a default
+	OP_FUNCTION,		// (param1 .. paramn -- fn)
+	OP_INVOKE,		// (fn v1 .. vn -- result) positional, n is the operand
+	OP_INVOKE_NAMED,	// (fn v1 .. vn -- result) operand indexes call_sites
+	OP_RETURN		// (value -- )
+} vm_opcode;
+
+/*
+ * Argument names for an invocation with named arguments; names[i] is NULL
+ * for a positional one.
+ */
+typedef struct vm_call_site {
+	int count;
+	hstr **names;
+} vm_call_site;
+
+typedef struct vm_instruction {
+	vm_opcode op;
+	int arg;
+} vm_instruction;
+
+struct vm_code {
+	vm_instruction *instructions;
+	int count;
+	int capacity;
+	void **constants;
+	int constant_count;
+	int constant_capacity;
+	vm_call_site *call_sites;
+	int call_site_count;
+	int max_stack;		// deepest the operand stack gets while running this
+};
+
+hval *vm_evaluate(runtime *rt, expression *expr, hval *context);
+hval *vm_evaluate_body(runtime *rt, expression *body, hval *context);
+vm_code *vm_compile(expression *expr, bool as_body);
+void vm_code_destroy(vm_code *code);
+void vm_code_dump(vm_code *code);
+
+#endif
@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "ht.h"
+#include "ht_builtins.h"
+
+/*
+ * Collision/distribution benchmark for hash_string and the hash table.
+ * For each generated key set it reports how evenly the keys land in a
+ * power-of-two table, the average and worst probe distance once they are
+ * inserted into a hash, and lookup throughput. Hashing throughput is
+ * measured separately over short and long keys.
+ */
+
+#define KEY_LEN 96
+
+typedef void (*key_generator)(char *key, int i);
+
+static void gen_sequential(char *key, int i)
+{
+	sprintf(key, "key-%d", i);
+}
+
+static void gen_shared_prefix(char *key, int i)
+{
+	sprintf(key, "a_rather_long_generated_module_prefix_shared_by_everything.member_%d", i);
+}
+
+static void gen_anagram(char *key, int i)
+{
+	// distinct permutations of the same multiset of characters
+	static const char alphabet[] = "abcdefgh";
+	char pool[sizeof(alphabet)];
+	memcpy(pool, alphabet, sizeof(alphabet));
+	int n = sizeof(alphabet) - 1;
+	for (int pos = 0; pos < n; pos++) {
+		int radix = n - pos;
+		int pick = i % radix;
+		i /= radix;
+		key[pos] = pool[pick];
+		memmove(pool + pick, pool + pick + 1, radix - pick);
+	}
+	key[n] = '\0';
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_distribution(const char *name, key_generator gen, int count)
+{
+	char *keys = malloc((size_t) count * KEY_LEN);
+	for (int i = 0; i < count; i++) {
+		gen(keys + (size_t) i * KEY_LEN, i);
+	}
+
+	int buckets = 1;
+	while (buckets < count) {
+		buckets <<= 1;
+	}
+
+	int *load = calloc(buckets, sizeof(int));
+	int used = 0, max_load = 0;
+	for (int i = 0; i < count; i++) {
+		unsigned int b = hash_string(keys + (size_t) i * KEY_LEN) & (buckets - 1);
+		if (load[b]++ == 0) {
+			++used;
+		}
+		if (load[b] > max_load) {
+			max_load = load[b];
+		}
+	}
+
+	hash *h = hash_create(hash_string, hash_string_comparator);
+	for (int i = 0; i < count; i++) {
+		hash_put(h, keys + (size_t) i * KEY_LEN, keys + (size_t) i * KEY_LEN);
+	}
+
+	long total_distance = 0;
+	unsigned int max_distance = 0;
+	unsigned int mask = h->buckets - 1;
+	for (int i = 0; i < h->buckets; i++) {
+		if (h->table[i].key) {
+			unsigned int d = (i - (h->table[i].hash_code & mask)) & mask;
+			total_distance += d;
+			if (d > max_distance) {
+				max_distance = d;
+			}
+		}
+	}
+
+	const int rounds = 20;
+	double start = now();
+	long found = 0;
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < count; i++) {
+			found += hash_get(h, keys + (size_t) i * KEY_LEN) != NULL;
+		}
+	}
+	double elapsed = now() - start;
+
+	printf("%-14s %7d keys  buckets used %5.1f%% (uniform %4.1f%%)  max load %2d  "
+			"probe avg %.2f max %2u  %6.1f M lookups/s\n",
+			name, count, 100.0 * used / buckets,
+			100.0 * (1.0 - pow(1.0 - 1.0 / buckets, count)),
+			max_load, (double) total_distance / count, max_distance,
+			found / elapsed / 1e6);
+
+	hash_destroy(h, NULL, NULL, NULL, NULL);
+	free(load);
+	free(keys);
+}
+
+static void bench_throughput(size_t len)
+{
+	const size_t total = 256 * 1024 * 1024;
+	char *buf = malloc(len + 1);
+	memset(buf, 'k', len);
+	buf[len] = '\0';
+
+	unsigned int sink = 0;
+	size_t iterations = total / len;
+	double start = now();
+	for (size_t i = 0; i < iterations; i++) {
+		buf[i % len] ^= 1;
+		sink += hash_bytes(buf, len);
+	}
+	double elapsed = now() - start;
+
+	printf("hash_bytes %5zu-byte keys: %8.1f MB/s  %7.1f M hashes/s (%x)\n",
+			len, total / elapsed / (1024 * 1024), iterations / elapsed / 1e6, sink);
+	free(buf);
+}
+
+int main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 65536;
+
+	bench_distribution("sequential", gen_sequential, count);
+	bench_distribution("shared prefix", gen_shared_prefix, count);
+	bench_distribution("anagrams", gen_anagram, count < 40320 ? count : 40320);
+
+	bench_throughput(8);
+	bench_throughput(32);
+	bench_throughput(1024);
+	return 0;
+}
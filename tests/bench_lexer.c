@@ -0,0 +1,69 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "buffer.h"
+#include "lexer.h"
+#include "lexer_io.h"
+
+/*
+ * Lexer throughput benchmark. A corpus of generated source, shaped
+ * like the tests' programs, is lexed from memory a few times over; the
+ * tokens are read and thrown away. Reports MB of source lexed per
+ * second.
+ */
+
+static const char *LINES[] = {
+	"counter: 0\n",
+	"add_item: fn({list: 0 item: 0} `(\n",
+	"\tlist.push(item)\n",
+	"\tcounter: +(counter 1)\n",
+	"))\n",
+	"config: {name: 'example' retries: 3 ratio: 75 tags: (\"a\" \"b\" \"c\")}\n",
+	"message: \"a longer string, with \\\"escaped\\\" quotes and some padding in it\"\n",
+	"        indented: config.name\n",
+	"values: (1 2 3 4 5 6 7 8 9 10 100 1000 10000)\n",
+	"io.print(add_item(values counter))\n",
+};
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static buffer *build_corpus(size_t bytes)
+{
+	buffer *corpus = buffer_create(bytes + 128);
+	int lines = sizeof(LINES) / sizeof(LINES[0]);
+	for (int i = 0; corpus->len < bytes; i++) {
+		buffer_append_string(corpus, (char *) LINES[i % lines]);
+	}
+
+	return corpus;
+}
+
+int main(int argc, char **argv)
+{
+	size_t bytes = (argc > 1 ? atoi(argv[1]) : 16) * 1024 * 1024;
+	buffer *corpus = build_corpus(bytes);
+
+	const int rounds = 5;
+	long tokens = 0;
+	double start = now();
+	for (int r = 0; r < rounds; r++) {
+		lexer *l = lexer_create(lexer_string_input_create(corpus->data, corpus->len));
+		while (lexer_get_next_token(l)) {
+			tokens++;
+		}
+		lexer_destroy(l, true);
+	}
+	double elapsed = now() - start;
+
+	printf("%8.1f MB  %10ld tokens  %7.2f ms/pass  %6.1f MB/s\n",
+			corpus->len / 1e6, tokens / rounds, elapsed / rounds * 1e3,
+			corpus->len * rounds / elapsed / 1e6);
+
+	buffer_destroy(corpus);
+	return 0;
+}
@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "mm.h"
+#include "runtime.h"
+#include "str.h"
+#include "type.h"
+
+/*
+ * Mark throughput benchmark for the collector. Each synthetic heap is
+ * built under its own gc root, then full collections are timed over it;
+ * every object survives, so the sweep frees nothing and the time is
+ * mostly marking. Reports objects marked per second.
+ */
+
+typedef hval *(*heap_builder)(runtime *rt, hval *holder, int count);
+
+static hstr *HEAD;
+static hstr *NEXT;
+static hstr *LEFT;
+static hstr *RIGHT;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * A list of small hashes, as built up by List.push.
+ */
+static hval *build_list(runtime *rt, hval *holder, int count)
+{
+	hval *list = hval_list_create(rt);
+	hval_hash_put(holder, HEAD, list, rt->mem);
+	for (int i = 0; i < count; i++) {
+		hval *item = hval_hash_create(rt);
+		hval_list_insert_tail((list_hval *) list, item, rt->mem);
+		hval_hash_put(item, NEXT, hval_string_create(HEAD, rt), rt->mem);
+	}
+
+	return list;
+}
+
+/*
+ * A singly linked chain, as deep as it is long.
+ */
+static hval *build_chain(runtime *rt, hval *holder, int count)
+{
+	for (int i = 0; i < count; i++) {
+		hval *link = hval_hash_create(rt);
+		hval_hash_put(link, NEXT, hval_hash_get_direct(holder, HEAD, rt), rt->mem);
+		hval_hash_put(holder, HEAD, link, rt->mem);
+	}
+
+	return hval_hash_get_direct(holder, HEAD, rt);
+}
+
+/*
+ * One hash with count members, big enough to live in a members table.
+ */
+static hval *build_wide(runtime *rt, hval *holder, int count)
+{
+	hval *wide = hval_hash_create(rt);
+	hval_hash_put(holder, HEAD, wide, rt->mem);
+	char key[32];
+	for (int i = 0; i < count; i++) {
+		sprintf(key, "member_%d", i);
+		hstr *str = hstr_intern(key);
+		hval_hash_put(wide, str, hval_hash_create(rt), rt->mem);
+		hstr_release(str);
+	}
+
+	return wide;
+}
+
+static hval *build_subtree(runtime *rt, hval *parent, hstr *side, int count)
+{
+	if (count <= 0) {
+		return NULL;
+	}
+
+	hval *node = hval_hash_create(rt);
+	hval_hash_put(parent, side, node, rt->mem);
+	build_subtree(rt, node, LEFT, (count - 1) / 2);
+	build_subtree(rt, node, RIGHT, count - 1 - (count - 1) / 2);
+	return node;
+}
+
+/*
+ * A balanced binary tree.
+ */
+static hval *build_tree(runtime *rt, hval *holder, int count)
+{
+	return build_subtree(rt, holder, HEAD, count);
+}
+
+static void bench_mark(runtime *rt, const char *name, heap_builder build, int count)
+{
+	hval *holder = hval_hash_create(rt);
+	mem_add_gc_root(rt->mem, holder);
+	build(rt, holder, count);
+	gc(rt->mem);
+
+	const int rounds = 10;
+	double start = now();
+	for (int r = 0; r < rounds; r++) {
+		gc(rt->mem);
+	}
+	double elapsed = now() - start;
+
+	int live = rt->mem->old_count;
+	printf("%-8s %8d objects  %8d live  %7.2f ms/gc  %6.1f M objects/s\n",
+			name, count, live, elapsed / rounds * 1e3, (double) live * rounds / elapsed / 1e6);
+
+	mem_remove_gc_root(rt->mem, holder);
+	gc(rt->mem);
+}
+
+int main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 1000000;
+
+	runtime_init_globals();
+	runtime *rt = runtime_create();
+	HEAD = hstr_intern("head");
+	NEXT = hstr_intern("next");
+	LEFT = hstr_intern("left");
+	RIGHT = hstr_intern("right");
+
+	bench_mark(rt, "list", build_list, count);
+	bench_mark(rt, "chain", build_chain, count);
+	bench_mark(rt, "wide", build_wide, count);
+	bench_mark(rt, "tree", build_tree, count);
+
+	runtime_destroy(rt);
+	runtime_destroy_globals();
+	return 0;
+}
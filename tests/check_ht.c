@@ -1,6 +1,7 @@
 #include <check.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "ht.h"
 #include "ht_builtins.h"
 
@@ -46,7 +47,7 @@ START_TEST(test_hash_iterator)
 		indexes[i] = i;
 		marks[i] = false;
 		sprintf(keys[i], "key-%d", i);
-		hash_put(h, keys[i], &indexes + i);
+		hash_put(h, keys[i], indexes + i);
 	}
 
 	fail_unless(h->size == count, "Failed to create all elements");
@@ -87,6 +88,203 @@ START_TEST(test_hash_empty)
 }
 END_TEST
 
+START_TEST(test_hash_grow)
+{
+	const int count = 4096;
+	int indexes[count];
+	char keys[count][16];
+	hash *h = hash_create(hash_string, hash_string_comparator);
+	for (int i = 0; i < count; i++) {
+		indexes[i] = i;
+		sprintf(keys[i], "key-%d", i);
+		hash_put(h, keys[i], indexes + i);
+	}
+
+	fail_unless(h->size == count, "Failed to create all elements");
+	fail_unless(h->buckets >= count, "hash did not grow with its contents");
+	fail_unless((h->buckets & (h->buckets - 1)) == 0, "bucket count is not a power of two");
+	for (int i = 0; i < count; i++) {
+		fail_unless(hash_get(h, keys[i]) == indexes + i, "lost key %s after growing", keys[i]);
+	}
+
+	hash_destroy(h, NULL, NULL, NULL, NULL);
+}
+END_TEST
+
+START_TEST(test_hash_reserve)
+{
+	const int count = 700;
+	int indexes[count];
+	char keys[count][16];
+	hash *h = hash_create(hash_string, hash_string_comparator);
+	for (int i = 0; i < count; i++) {
+		indexes[i] = i;
+		sprintf(keys[i], "key-%d", i);
+		hash_put(h, keys[i], indexes + i);
+	}
+
+	// filled from just after an empty bucket, round in bucket order, a
+	// table reserved at the same size comes out laid out the same
+	hash *copy = hash_create(hash_string, hash_string_comparator);
+	hash_reserve(copy, h->buckets);
+	fail_unless(copy->buckets == h->buckets, "hash did not reserve %d buckets", h->buckets);
+	int start = 0;
+	while (h->table[start].key != NULL) {
+		start++;
+	}
+	for (int i = 0; i < h->buckets; i++) {
+		hash_entry *entry = h->table + (start + i) % h->buckets;
+		if (entry->key != NULL) {
+			hash_put(copy, entry->key, entry->value);
+		}
+	}
+
+	fail_unless(copy->buckets == h->buckets, "reserved hash grew");
+	for (int i = 0; i < h->buckets; i++) {
+		fail_unless(copy->table[i].key == h->table[i].key, "bucket %d differs", i);
+	}
+
+	hash_reserve(copy, h->buckets * 2);
+	fail_unless(copy->buckets == h->buckets, "reserving grew a hash with contents");
+
+	hash_destroy(copy, NULL, NULL, NULL, NULL);
+	hash_destroy(h, NULL, NULL, NULL, NULL);
+}
+END_TEST
+
+START_TEST(test_hash_remove)
+{
+	const int count = 512;
+	int indexes[count];
+	char keys[count][16];
+	hash *h = hash_create(hash_string, hash_string_comparator);
+	for (int i = 0; i < count; i++) {
+		indexes[i] = i;
+		sprintf(keys[i], "key-%d", i);
+		hash_put(h, keys[i], indexes + i);
+	}
+
+	fail_unless(hash_remove(h, "missing") == NULL, "removing a missing key returned a value");
+	fail_unless(h->size == count, "removing a missing key changed the hash size");
+
+	for (int i = 0; i < count; i += 2) {
+		fail_unless(hash_remove(h, keys[i]) == indexes + i, "hash_remove() returned the wrong value for %s", keys[i]);
+	}
+
+	fail_unless(h->size == count / 2, "hash_remove() did not decrement size");
+	for (int i = 0; i < count; i++) {
+		if (i % 2 == 0) {
+			fail_unless(hash_get(h, keys[i]) == NULL, "removed key %s is still present", keys[i]);
+		} else {
+			fail_unless(hash_get(h, keys[i]) == indexes + i, "lost key %s after removing its neighbours", keys[i]);
+		}
+	}
+
+	int seen = 0;
+	hash_iterator *iter = hash_iterator_create(h);
+	while (iter->current_key) {
+		++seen;
+		hash_iterator_next(iter);
+	}
+	hash_iterator_destroy(iter);
+	fail_unless(seen == count / 2, "hash_iterator yielded removed entries");
+
+	hash_destroy(h, NULL, NULL, NULL, NULL);
+}
+END_TEST
+
+START_TEST(test_hash_small)
+{
+	hash *h = hash_create(hash_string, hash_string_comparator);
+	char keys[HASH_SMALL_BUCKETS + 1][16];
+	fail_unless(hash_is_small(h), "new hashes should start as a small map");
+	for (int i = 0; i < HASH_SMALL_BUCKETS; i++) {
+		sprintf(keys[i], "key-%d", i);
+		hash_put(h, keys[i], keys[i]);
+	}
+	fail_unless(hash_is_small(h), "small map was promoted before it was full");
+
+	hash_remove(h, keys[0]);
+	fail_unless(hash_get(h, keys[0]) == NULL, "removed key is still present");
+	for (int i = 1; i < HASH_SMALL_BUCKETS; i++) {
+		fail_unless(hash_get(h, keys[i]) == keys[i], "lost key %s after removal", keys[i]);
+	}
+
+	hash_put(h, keys[0], keys[0]);
+	sprintf(keys[HASH_SMALL_BUCKETS], "key-%d", HASH_SMALL_BUCKETS);
+	hash_put(h, keys[HASH_SMALL_BUCKETS], keys[HASH_SMALL_BUCKETS]);
+	fail_unless(!hash_is_small(h), "small map was not promoted when it overflowed");
+	fail_unless(h->size == HASH_SMALL_BUCKETS + 1, "promotion changed the hash size");
+	for (int i = 0; i <= HASH_SMALL_BUCKETS; i++) {
+		fail_unless(hash_get(h, keys[i]) == keys[i], "lost key %s after promotion", keys[i]);
+	}
+
+	hash_empty(h, NULL, NULL, NULL, NULL);
+	fail_unless(hash_is_small(h), "hash_empty() should return to a small map");
+	hash_destroy(h, NULL, NULL, NULL, NULL);
+}
+END_TEST
+
+static bool prefix_matches(void *key, void *probe)
+{
+	size_t len = strlen(key);
+	return strncmp(key, probe, len) == 0 && ((char *) probe)[len] == '/';
+}
+
+START_TEST(test_hash_get_hashed)
+{
+	hash *h = hash_create(hash_string, hash_string_comparator);
+	char keys[100][16];
+	for (int i = 0; i < 100; i++) {
+		sprintf(keys[i], "key-%d", i);
+		hash_put(h, keys[i], keys[i]);
+		// looked up both while the hash is small and once it's a table
+		char probe[32];
+		for (int j = 0; j <= i; j++) {
+			sprintf(probe, "key-%d/rest", j);
+			fail_unless(hash_get_hashed(h, hash_bytes(probe, strlen(keys[j])), prefix_matches, probe) == keys[j],
+				"key %s not found by probe %s", keys[j], probe);
+		}
+	}
+
+	fail_unless(hash_get_hashed(h, hash_string("key-100"), prefix_matches, "key-100/") == NULL,
+		"found a key that was never added");
+	hash_destroy(h, NULL, NULL, NULL, NULL);
+}
+END_TEST
+
+START_TEST(test_hash_string_distribution)
+{
+	fail_unless(hash_string("abc") != hash_string("cba"), "anagrams should not collide");
+	fail_unless(hash_string("abc") != hash_string("bac"), "anagrams should not collide");
+
+	char long_a[64], long_b[64];
+	memset(long_a, 'x', sizeof(long_a));
+	memcpy(long_b, long_a, sizeof(long_b));
+	long_a[62] = 'a';
+	long_b[62] = 'b';
+	long_a[63] = long_b[63] = '\0';
+	fail_unless(hash_string(long_a) != hash_string(long_b), "keys differing past the first 32 bytes should not collide");
+
+	// 1024 sequential keys into 1024 masked buckets; a uniform hash fills
+	// about 1 - 1/e of them (~647)
+	const int count = 1024;
+	bool used[count];
+	int distinct = 0;
+	char key[16];
+	memset(used, 0, sizeof(used));
+	for (int i = 0; i < count; i++) {
+		sprintf(key, "key-%d", i);
+		unsigned int bucket = hash_string(key) & (count - 1);
+		if (!used[bucket]) {
+			used[bucket] = true;
+			++distinct;
+		}
+	}
+	fail_unless(distinct > 560, "poor bucket distribution for sequential keys: %d / %d", distinct, count);
+}
+END_TEST
+
 Suite *ht_suite(void)
 {
 	Suite *s = suite_create("ht");
@@ -95,6 +293,12 @@ Suite *ht_suite(void)
 	tcase_add_test(tc_core, test_hash_overwrite);
 	tcase_add_test(tc_core, test_hash_iterator);
 	tcase_add_test(tc_core, test_hash_empty);
+	tcase_add_test(tc_core, test_hash_grow);
+	tcase_add_test(tc_core, test_hash_reserve);
+	tcase_add_test(tc_core, test_hash_remove);
+	tcase_add_test(tc_core, test_hash_small);
+	tcase_add_test(tc_core, test_hash_get_hashed);
+	tcase_add_test(tc_core, test_hash_string_distribution);
 	suite_add_tcase(s, tc_core);
 	return s;
 }